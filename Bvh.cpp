@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <numeric>
+#include <Bvh.h>
+#include <CpuProfiler.h>
+
+
+namespace
+{
+  float surfaceArea(const glm::vec3& lo, const glm::vec3& hi)
+  {
+    const glm::vec3 extent = glm::max(hi - lo, glm::vec3(0.0f));
+    return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+  }
+
+  struct Bounds
+  {
+    glm::vec3 lo{ std::numeric_limits<float>::max() };
+    glm::vec3 hi{ -std::numeric_limits<float>::max() };
+
+    void grow(const glm::vec3& pointLo, const glm::vec3& pointHi)
+    {
+      lo = glm::min(lo, pointLo);
+      hi = glm::max(hi, pointHi);
+    }
+  };
+}
+
+void Bvh::build(const std::vector<glm::vec3>& lo, const std::vector<glm::vec3>& hi)
+{
+  PROFILE_SCOPE("buildBvh");
+  nodes.clear();
+  primitives.resize(lo.size());
+  std::iota(primitives.begin(), primitives.end(), 0u);
+  if (lo.empty())
+    return;
+
+  std::vector<glm::vec3> centroids(lo.size());
+  for (size_t i = 0; i < lo.size(); ++i)
+    centroids[i] = 0.5f * (lo[i] + hi[i]);
+
+  nodes.reserve(2 * lo.size() / maxLeafSize + 1);
+  nodes.emplace_back();
+  split(0, 0, static_cast<uint32_t>(lo.size()), 0, lo, hi, centroids);
+}
+
+void Bvh::split(uint32_t node, uint32_t first, uint32_t count, uint32_t depth, const std::vector<glm::vec3>& lo,
+  const std::vector<glm::vec3>& hi, const std::vector<glm::vec3>& centroids)
+{
+  Bounds bounds;
+  Bounds centroidBounds;
+  for (uint32_t i = first; i < first + count; ++i)
+  {
+    bounds.grow(lo[primitives[i]], hi[primitives[i]]);
+    centroidBounds.grow(centroids[primitives[i]], centroids[primitives[i]]);
+  }
+  nodes[node].lo = bounds.lo;
+  nodes[node].hi = bounds.hi;
+  nodes[node].firstOrChild = first;
+  nodes[node].count = count;
+  if (count <= maxLeafSize || depth >= maxDepth)
+    return;
+
+  // Cheapest bin boundary over the axes, costs relative to intersecting every primitive of the node
+  const glm::vec3 extent = centroidBounds.hi - centroidBounds.lo;
+  float bestCost = static_cast<float>(count);
+  int bestAxis = -1;
+  uint32_t bestBin = 0;
+  for (int axis = 0; axis < 3; ++axis)
+  {
+    if (extent[axis] <= 0.0f)
+      continue;
+
+    Bounds bins[binsNum];
+    uint32_t binCounts[binsNum] = {};
+    const float scale = binsNum / extent[axis];
+    for (uint32_t i = first; i < first + count; ++i)
+    {
+      const uint32_t p = primitives[i];
+      const uint32_t bin = std::min(static_cast<uint32_t>((centroids[p][axis] - centroidBounds.lo[axis]) * scale), binsNum - 1);
+      bins[bin].grow(lo[p], hi[p]);
+      ++binCounts[bin];
+    }
+
+    // Areas and counts of everything right of each boundary
+    float rightAreas[binsNum];
+    uint32_t rightCounts[binsNum];
+    Bounds right;
+    uint32_t rightCount = 0;
+    for (uint32_t bin = binsNum - 1; bin > 0; --bin)
+    {
+      right.grow(bins[bin].lo, bins[bin].hi);
+      rightCount += binCounts[bin];
+      rightAreas[bin] = rightCount > 0 ? surfaceArea(right.lo, right.hi) : 0.0f;
+      rightCounts[bin] = rightCount;
+    }
+
+    Bounds left;
+    uint32_t leftCount = 0;
+    const float parentArea = surfaceArea(bounds.lo, bounds.hi);
+    for (uint32_t bin = 1; bin < binsNum; ++bin)
+    {
+      left.grow(bins[bin - 1].lo, bins[bin - 1].hi);
+      leftCount += binCounts[bin - 1];
+      if (leftCount == 0 || rightCounts[bin] == 0)
+        continue;
+      const float cost = 0.125f + (surfaceArea(left.lo, left.hi) * leftCount + rightAreas[bin] * rightCounts[bin]) / parentArea;
+      if (cost < bestCost)
+      {
+        bestCost = cost;
+        bestAxis = axis;
+        bestBin = bin;
+      }
+    }
+  }
+
+  uint32_t middle;
+  if (bestAxis >= 0)
+  {
+    const float scale = binsNum / extent[bestAxis];
+    const auto split = std::partition(primitives.begin() + first, primitives.begin() + first + count, [&](uint32_t p)
+      {
+        return std::min(static_cast<uint32_t>((centroids[p][bestAxis] - centroidBounds.lo[bestAxis]) * scale), binsNum - 1) < bestBin;
+      });
+    middle = static_cast<uint32_t>(split - primitives.begin());
+  }
+  else if (count > 4 * maxLeafSize)
+  {
+    // No split beats a leaf but the leaf would be big: centroids on top of each other, split by count
+    middle = first + count / 2;
+  }
+  else
+  {
+    return;
+  }
+
+  const uint32_t leftChild = static_cast<uint32_t>(nodes.size());
+  nodes.emplace_back();
+  split(leftChild, first, middle - first, depth + 1, lo, hi, centroids);
+  const uint32_t rightChild = static_cast<uint32_t>(nodes.size());
+  nodes.emplace_back();
+  split(rightChild, middle, first + count - middle, depth + 1, lo, hi, centroids);
+  nodes[node].firstOrChild = rightChild;
+  nodes[node].count = 0;
+}
@@ -0,0 +1,128 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include <Intersection.h>
+
+
+// Traversal work of a ray, the CPU counterpart of the RAY_STATS counters of the shaders. Only counted in builds with
+// ENABLE_BVH_STATS, traversal does not touch it otherwise
+struct TraversalStats
+{
+  uint32_t nodesVisited = 0;
+  uint32_t primitivesTested = 0;
+
+  TraversalStats& operator+=(const TraversalStats& other)
+  {
+    nodesVisited += other.nodesVisited;
+    primitivesTested += other.primitivesTested;
+    return *this;
+  }
+};
+
+// Bounding volume hierarchy for the CPU renderer, built with binned SAH over the bounds of arbitrary primitives.
+// Nodes are stored depth first: an inner node's first child follows it, the second sits at firstOrChild
+class Bvh
+{
+public:
+  struct Node
+  {
+    glm::vec3 lo;
+    uint32_t firstOrChild;  // first entry of primitives for leaves, second child for inner nodes
+    glm::vec3 hi;
+    uint32_t count;         // primitives of a leaf, 0 for inner nodes
+  };
+
+  void build(const std::vector<glm::vec3>& lo, const std::vector<glm::vec3>& hi);
+
+  // Calls intersect(primitive, t) for the primitives of every leaf the ray reaches before t, nearer children first.
+  // intersect returns whether it hit and then lowers t. Stops at the first hit when anyHit is set.
+  // The visited nodes and tested primitives are added to stats when countStats is set
+  template <typename Intersect>
+  bool traverse(const intersection::Ray<float>& ray, const glm::vec3& invDirection, float tMin, float& t, bool anyHit,
+    TraversalStats& stats, Intersect&& intersect) const;
+
+#ifdef ENABLE_BVH_STATS
+  static constexpr bool countStats = true;
+#else
+  static constexpr bool countStats = false;
+#endif
+
+  std::vector<Node> nodes;
+  // Primitive indices in leaf order
+  std::vector<uint32_t> primitives;
+
+private:
+  // Deeper subtrees become leaves, so traversal stacks of maxDepth entries never overflow
+  static constexpr uint32_t maxDepth = 60;
+  static constexpr uint32_t maxLeafSize = 4;
+  static constexpr uint32_t binsNum = 16;
+
+  void split(uint32_t node, uint32_t first, uint32_t count, uint32_t depth, const std::vector<glm::vec3>& lo,
+    const std::vector<glm::vec3>& hi, const std::vector<glm::vec3>& centroids);
+};
+
+template <typename Intersect>
+bool Bvh::traverse(const intersection::Ray<float>& ray, const glm::vec3& invDirection, float tMin, float& t, bool anyHit,
+  TraversalStats& stats, Intersect&& intersect) const
+{
+  if (nodes.empty())
+    return false;
+
+  struct Entry
+  {
+    uint32_t node;
+    float tEntry;
+  };
+  Entry stack[maxDepth + 2];
+  uint32_t top = 0;
+  float tRoot = t;
+  if (!intersection::rayAabbSlabRobust(ray, invDirection, nodes[0].lo, nodes[0].hi, tMin, tRoot))
+    return false;
+  stack[top++] = { 0, tRoot };
+
+  bool hit = false;
+  while (top > 0)
+  {
+    const Entry entry = stack[--top];
+    // Boxes behind a hit found since they were pushed
+    if (entry.tEntry > t)
+      continue;
+
+    const Node& node = nodes[entry.node];
+    if constexpr (countStats)
+      ++stats.nodesVisited;
+    if (node.count > 0)
+    {
+      for (uint32_t i = node.firstOrChild; i < node.firstOrChild + node.count; ++i)
+      {
+        if constexpr (countStats)
+          ++stats.primitivesTested;
+        if (intersect(primitives[i], t))
+        {
+          hit = true;
+          if (anyHit)
+            return true;
+        }
+      }
+      continue;
+    }
+
+    uint32_t nearChild = entry.node + 1;
+    uint32_t farChild = node.firstOrChild;
+    float tNear = t;
+    float tFar = t;
+    bool hitNear = intersection::rayAabbSlabRobust(ray, invDirection, nodes[nearChild].lo, nodes[nearChild].hi, tMin, tNear);
+    bool hitFar = intersection::rayAabbSlabRobust(ray, invDirection, nodes[farChild].lo, nodes[farChild].hi, tMin, tFar);
+    if (hitNear && hitFar && tFar < tNear)
+    {
+      std::swap(nearChild, farChild);
+      std::swap(tNear, tFar);
+    }
+    if (hitFar)
+      stack[top++] = { farChild, tFar };
+    if (hitNear)
+      stack[top++] = { nearChild, tNear };
+  }
+  return hit;
+}
@@ -0,0 +1,184 @@
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <CameraPath.h>
+#include <SceneLoader.h>
+
+
+namespace
+{
+  vec3 catmullRom(const vec3& p0, const vec3& p1, const vec3& p2, const vec3& p3, float t)
+  {
+    float t2 = t * t;
+    float t3 = t2 * t;
+    return 0.5f * ((2.0f * p1) + (p2 - p0) * t + (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * t2 + (3.0f * p1 - p0 - 3.0f * p2 + p3) * t3);
+  }
+
+  // A frame name pattern split around its single %d or %0Nd, %% stands for a percent sign
+  struct FramePattern
+  {
+    std::string prefix;
+    std::string suffix;
+    size_t width = 0;
+  };
+
+  // The pattern comes from the path file, so it is never handed to printf. False with the reason in error for
+  // anything but exactly one number conversion
+  bool parseFramePattern(const std::string& pattern, FramePattern& parsed, std::string& error)
+  {
+    parsed = {};
+    bool haveNumber = false;
+    for (size_t i = 0; i < pattern.size(); ++i)
+    {
+      std::string& text = haveNumber ? parsed.suffix : parsed.prefix;
+      if (pattern[i] != '%')
+      {
+        text += pattern[i];
+        continue;
+      }
+      if (i + 1 < pattern.size() && pattern[i + 1] == '%')
+      {
+        text += '%';
+        ++i;
+        continue;
+      }
+
+      size_t end = i + 1;
+      size_t width = 0;
+      if (end < pattern.size() && pattern[end] == '0')
+      {
+        ++end;
+        const size_t digits = end;
+        while (end < pattern.size() && pattern[end] >= '0' && pattern[end] <= '9')
+          width = width * 10 + (pattern[end++] - '0');
+        if (end == digits || width > 32)
+        {
+          error = "expected %d or %0Nd with N up to 32";
+          return false;
+        }
+      }
+      if (end >= pattern.size() || pattern[end] != 'd')
+      {
+        error = "only %d, %0Nd and %% are allowed";
+        return false;
+      }
+      if (haveNumber)
+      {
+        error = "more than one frame number";
+        return false;
+      }
+      haveNumber = true;
+      parsed.width = width;
+      i = end;
+    }
+    if (!haveNumber)
+    {
+      error = "no frame number";
+      return false;
+    }
+    return true;
+  }
+}
+
+bool CameraPath::load(const std::string& filename)
+{
+  std::ifstream in(filename);
+  if (!in.is_open())
+  {
+    std::cerr << "Could not open camera path " << filename << std::endl;
+    return false;
+  }
+
+  keyframes.clear();
+  std::string str, cmd;
+  while (getline(in, str)) {
+    if ((str.find_first_not_of(" \t\r\n") == std::string::npos) || (str[0] == '#'))
+      continue;
+
+    std::stringstream ss(str);
+    ss >> cmd;
+
+    if (cmd == "output") {
+      std::string value;
+      if (readvals(ss, 1, &value)) {
+        FramePattern parsed;
+        std::string error;
+        if (value.find('%') != std::string::npos && !parseFramePattern(value, parsed, error)) {
+          std::cerr << "Invalid output pattern " << value << " in " << filename << ": " << error << std::endl;
+          return false;
+        }
+        output = value;
+      }
+    }
+    else if (cmd == "keyframe") {
+      float values[11];
+      if (readvals(ss, 11, values)) {
+        CameraKeyframe k;
+        k.frame = static_cast<uint32_t>(values[0]);
+        k.eye = vec3(values[1], values[2], values[3]);
+        k.center = vec3(values[4], values[5], values[6]);
+        k.up = vec3(values[7], values[8], values[9]);
+        k.fovy = values[10];
+        keyframes.push_back(k);
+      }
+    }
+    else {
+      std::cerr << "Unknown Command: " << cmd << " Skipping \n";
+    }
+  }
+
+  std::stable_sort(keyframes.begin(), keyframes.end(), [](const CameraKeyframe& a, const CameraKeyframe& b) { return a.frame < b.frame; });
+  if (keyframes.empty())
+  {
+    std::cerr << "Camera path " << filename << " has no keyframes" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+CameraKeyframe CameraPath::evaluate(uint32_t frame) const
+{
+  if (frame <= keyframes.front().frame)
+    return keyframes.front();
+  if (frame >= keyframes.back().frame)
+    return keyframes.back();
+
+  // Segment [k1, k2] containing the frame, the neighbours are clamped at the ends of the path
+  size_t i = std::upper_bound(keyframes.begin(), keyframes.end(), frame, [](uint32_t f, const CameraKeyframe& k) { return f < k.frame; }) - keyframes.begin();
+  const CameraKeyframe& k1 = keyframes[i - 1];
+  const CameraKeyframe& k2 = keyframes[i];
+  const CameraKeyframe& k0 = keyframes[i > 1 ? i - 2 : i - 1];
+  const CameraKeyframe& k3 = keyframes[std::min(i + 1, keyframes.size() - 1)];
+  float t = static_cast<float>(frame - k1.frame) / static_cast<float>(k2.frame - k1.frame);
+
+  CameraKeyframe result;
+  result.frame = frame;
+  result.eye = catmullRom(k0.eye, k1.eye, k2.eye, k3.eye, t);
+  result.center = catmullRom(k0.center, k1.center, k2.center, k3.center, t);
+  result.up = normalize(mix(k1.up, k2.up, t));
+  result.fovy = mix(k1.fovy, k2.fovy, t);
+  return result;
+}
+
+std::string CameraPath::frameFilename(uint32_t frame, const std::string& defaultName) const
+{
+  const std::string& pattern = output.empty() ? defaultName : output;
+  if (pattern.find('%') != std::string::npos)
+  {
+    FramePattern parsed;
+    std::string error;
+    if (!parseFramePattern(pattern, parsed, error))
+      throw std::runtime_error("Invalid frame name pattern " + pattern + ": " + error);
+    const std::string number = std::to_string(frame);
+    return parsed.prefix + std::string(parsed.width > number.size() ? parsed.width - number.size() : 0, '0') + number + parsed.suffix;
+  }
+
+  std::filesystem::path path(pattern);
+  char number[16];
+  std::snprintf(number, sizeof(number), "_%04u", frame);
+  return (path.parent_path() / (path.stem().string() + number + path.extension().string())).string();
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include <Transform.h>
+
+using namespace Transform;
+
+
+struct CameraKeyframe
+{
+  uint32_t frame;
+  vec3 eye;
+  vec3 center;
+  vec3 up;
+  float fovy;
+};
+
+// Camera fly-through for batch rendering. Text file in the style of the .test scenes:
+//   output <pattern>   image name, one %d or %0Nd gets the frame number (%% for a percent sign), otherwise
+//                      _0001 is appended
+//   keyframe <frame> <eye xyz> <center xyz> <up xyz> <fovy>
+// Frames between keyframes are interpolated with a Catmull-Rom spline through eye and center, up and fovy
+// are interpolated linearly.
+class CameraPath
+{
+public:
+  bool load(const std::string& filename);
+
+  uint32_t firstFrame() const { return keyframes.front().frame; }
+  uint32_t lastFrame() const { return keyframes.back().frame; }
+  CameraKeyframe evaluate(uint32_t frame) const;
+  // Falls back to defaultName when the path file has no output line
+  std::string frameFilename(uint32_t frame, const std::string& defaultName) const;
+
+private:
+  std::vector<CameraKeyframe> keyframes;
+  std::string output;
+};
@@ -0,0 +1,98 @@
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <CpuProfiler.h>
+
+
+namespace
+{
+  struct ZoneRecord
+  {
+    const char* name;
+    int64_t start;
+    int64_t end;
+  };
+
+  struct ThreadRing
+  {
+    uint32_t threadIndex = 0;
+    // Grows up to ringSize, short-lived threads such as the PNG deflate workers stay small
+    std::vector<ZoneRecord> zones;
+    // Zones ever recorded, the ring holds the last ringSize of them
+    std::atomic<uint64_t> recorded = 0;
+  };
+
+  const auto startTime = std::chrono::steady_clock::now();
+
+  std::mutex ringsMutex;
+  // Shared with the owning thread, so the zones of threads that have exited are still written
+  std::vector<std::shared_ptr<ThreadRing>> rings;
+
+  ThreadRing& threadRing()
+  {
+    thread_local std::shared_ptr<ThreadRing> ring = []
+    {
+      auto newRing = std::make_shared<ThreadRing>();
+      std::lock_guard<std::mutex> lock(ringsMutex);
+      newRing->threadIndex = static_cast<uint32_t>(rings.size());
+      rings.push_back(newRing);
+      return newRing;
+    }();
+    return *ring;
+  }
+}
+
+int64_t CpuProfiler::now()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+void CpuProfiler::record(const char* name, int64_t start, int64_t end)
+{
+  ThreadRing& ring = threadRing();
+  const uint64_t index = ring.recorded.load(std::memory_order_relaxed);
+  if (index < ringSize)
+    ring.zones.push_back({ name, start, end });
+  else
+    ring.zones[index % ringSize] = { name, start, end };
+  ring.recorded.store(index + 1, std::memory_order_release);
+}
+
+bool CpuProfiler::write(const std::string& filename)
+{
+  std::ofstream out(filename);
+  if (!out)
+  {
+    std::cerr << "Could not write CPU trace " << filename << std::endl;
+    return false;
+  }
+
+  // Complete ("X") events in microseconds, one trace thread per recording thread
+  out << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  std::lock_guard<std::mutex> lock(ringsMutex);
+  for (const auto& ring : rings)
+  {
+    const uint64_t recorded = ring->recorded.load(std::memory_order_acquire);
+    const uint64_t begin = recorded > ringSize ? recorded - ringSize : 0;
+    for (uint64_t i = begin; i < recorded; ++i)
+    {
+      const ZoneRecord& zone = ring->zones[i % ringSize];
+      out << (first ? "\n" : ",\n") << "{\"name\":\"" << zone.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << ring->threadIndex
+        << ",\"ts\":" << zone.start / 1000.0 << ",\"dur\":" << (zone.end - zone.start) / 1000.0 << "}";
+      first = false;
+    }
+    if (recorded > ringSize)
+    {
+      std::cerr << "CPU trace thread " << ring->threadIndex << " dropped its " << recorded - ringSize << " oldest zones" << std::endl;
+    }
+  }
+  out << "\n]}\n";
+  std::cout << "CPU trace " << filename << " saved to disk" << std::endl;
+  return true;
+}
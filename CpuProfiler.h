@@ -0,0 +1,44 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+
+// Scoped CPU timing zones exported as a Chrome trace, loadable in chrome://tracing and ui.perfetto.dev.
+// Zones only exist in builds with ENABLE_PROFILING, otherwise PROFILE_SCOPE and PROFILE_WRITE expand to nothing.
+// Every thread records into its own ring buffer without locking; once a thread has recorded more than
+// ringSize zones its oldest ones are overwritten
+class CpuProfiler
+{
+public:
+  static constexpr uint32_t ringSize = 1 << 16;
+
+  // Measures from construction to destruction. The name has to outlive the profiler, e.g. a string literal
+  class Zone
+  {
+  public:
+    explicit Zone(const char* name) : name(name), start(now()) {}
+    Zone(const Zone&) = delete;
+    Zone& operator=(const Zone&) = delete;
+    ~Zone() { record(name, start, now()); }
+
+  private:
+    const char* name;
+    int64_t start;
+  };
+
+  // Nanoseconds since the process started
+  static int64_t now();
+  static void record(const char* name, int64_t start, int64_t end);
+  // Writes the zones of all threads that ever recorded, including finished ones. No thread may record meanwhile
+  static bool write(const std::string& filename);
+};
+
+#ifdef ENABLE_PROFILING
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) CpuProfiler::Zone PROFILE_CONCAT(profileZone, __LINE__)(name)
+#define PROFILE_WRITE(filename) CpuProfiler::write(filename)
+#else
+#define PROFILE_SCOPE(name)
+#define PROFILE_WRITE(filename)
+#endif
@@ -0,0 +1,1243 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <numeric>
+#include <thread>
+#include <CpuProfiler.h>
+#include <CpuRenderer.h>
+#include <ImageCompare.h>
+#include <ImageWriter.h>
+#include <SceneCorpus.h>
+#include <TileScheduler.h>
+
+
+namespace
+{
+  using intersection::Ray;
+
+  double secondsSince(std::chrono::steady_clock::time_point start)
+  {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  float luminance(const glm::vec3& c)
+  {
+    return glm::dot(c, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+  }
+
+  // Mean relative standard error of the pixel means like the accumulation in raygen.rgen, from the color sums and
+  // the sums of the squared luminances of the passes
+  double estimatedError(const std::vector<glm::vec3>& sums, const std::vector<double>& luminanceSquares, uint32_t passes)
+  {
+    if (passes < 2)
+      return 1.0;
+    double errorSum = 0.0;
+    for (size_t i = 0; i < sums.size(); ++i)
+    {
+      const double sum = luminance(sums[i]);
+      const double variance = std::max((luminanceSquares[i] - sum * sum / passes) / (passes - 1), 0.0);
+      const double relError = std::sqrt(variance / passes) / std::max(sum / passes, 1.0 / 256.0);
+      errorSum += std::min(relError, 1.0);
+    }
+    return errorSum / static_cast<double>(sums.size());
+  }
+
+  // False with the reason in error for the integrators the CPU renderer lacks. The regression keeps the maxdepth of
+  // the scene, its references are rendered with the reflections
+  bool loadScene(const std::string& path, Scene& scene, std::string& error, bool sceneDepth = false)
+  {
+    scene.loadScene(path);
+    if (scene.integratorName != "raytracer" && scene.integratorName != "direct")
+    {
+      error = "The CPU renderer has no " + scene.integratorName + " integrator";
+      return false;
+    }
+    // Like VulkanRaytracer::setupScene
+    if (!sceneDepth)
+      scene.depth = 1;
+    return true;
+  }
+
+  std::vector<float> meanRgba(const std::vector<glm::vec3>& sums, uint32_t passes)
+  {
+    std::vector<float> rgba(sums.size() * 4);
+    for (size_t i = 0; i < sums.size(); ++i)
+    {
+      const glm::vec3 c = sums[i] / static_cast<float>(passes);
+      rgba[4 * i] = c.r;
+      rgba[4 * i + 1] = c.g;
+      rgba[4 * i + 2] = c.b;
+      rgba[4 * i + 3] = 1.0f;
+    }
+    return rgba;
+  }
+
+  void writeImage(const std::string& filename, const std::vector<float>& rgba, uint32_t width, uint32_t height)
+  {
+    std::unique_ptr<ImageWriter> writer = ImageWriter::create(filename);
+    writer->open(filename, width, height);
+    writer->writeRows(rgba.data(), height);
+    writer->close();
+  }
+
+  // Stable counting sort of ray indices by the signs of their directions, so neighbouring rays of a stage
+  // visit the BVH children in the same order
+  void sortByOctant(const std::vector<float> (&direction)[3], size_t count, std::vector<uint8_t>& octants,
+    std::vector<uint32_t>& order)
+  {
+    uint32_t offsets[9] = {};
+    octants.resize(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+      octants[i] = static_cast<uint8_t>((direction[0][i] < 0.0f) | (direction[1][i] < 0.0f) << 1 | (direction[2][i] < 0.0f) << 2);
+      ++offsets[octants[i] + 1];
+    }
+    for (int octant = 1; octant < 9; ++octant)
+      offsets[octant] += offsets[octant - 1];
+    order.resize(count);
+    for (size_t i = 0; i < count; ++i)
+      order[offsets[octants[i]]++] = static_cast<uint32_t>(i);
+  }
+
+  // Sphere of shaders/spheres.rint: the ray goes to object space with a normalized direction and the hit
+  // distance comes back as the world space distance of the hit point
+  bool intersectSphere(const Sphere& sphere, const Ray<float>& ray, float tMin, float& t)
+  {
+    Ray<float> object;
+    object.origin = glm::vec3(sphere.invertedTransform * glm::vec4(ray.origin, 1.0f));
+    object.direction = glm::normalize(glm::vec3(sphere.invertedTransform * glm::vec4(ray.direction, 0.0f)));
+    float tObject = std::numeric_limits<float>::infinity();
+    if (!intersection::raySphereStable(object, sphere.pos, sphere.radius, 0.0f, tObject))
+      return false;
+
+    const glm::vec3 point = glm::vec3(sphere.transform * glm::vec4(object.origin + tObject * object.direction, 1.0f));
+    const float tWorld = glm::length(point - ray.origin);
+    if (tWorld <= tMin || tWorld >= t)
+      return false;
+    t = tWorld;
+    return true;
+  }
+
+  // Phong term of closesthit*.rchit
+  glm::vec4 computeLight(const glm::vec3& direction, const glm::vec4& lightcolor, const glm::vec3& normal,
+    const glm::vec3& halfvec, const Material& m)
+  {
+    const glm::vec4 lambert = m.diffuse * std::max(glm::dot(normal, direction), 0.0f);
+    const glm::vec4 phong = m.specular * std::pow(std::max(glm::dot(normal, halfvec), 0.0f), m.shininess);
+    return lightcolor * (lambert + phong);
+  }
+
+  // Modified Phong BRDF of raycommon.glsl, used for the quad lights
+  glm::vec4 computeLight(const glm::vec3& direction, const glm::vec3& eyedir, const glm::vec3& normal, const Material& m)
+  {
+    const float pi = 3.1415926535897932384626433832795f;
+    const glm::vec4 lambert = m.diffuse / pi;
+    const glm::vec4 phong = m.specular * (m.shininess + 2) / (2 * pi) *
+      std::pow(std::max(glm::dot(glm::reflect(-eyedir, normal), direction), 0.0f), m.shininess);
+    return lambert + phong;
+  }
+
+  // stepAndOutputRNGFloat of raycommon.glsl
+  float stepAndOutputRNGFloat(uint32_t& rngState)
+  {
+    rngState = rngState * 747796405u + 1u;
+    uint32_t word = ((rngState >> ((rngState >> 28) + 4)) ^ rngState) * 277803737u;
+    word = (word >> 22) ^ word;
+    return static_cast<float>(word) / 4294967295.0f;
+  }
+
+  // Queue of path segments in structure of arrays layout
+  struct PathQueue
+  {
+    std::vector<float> origin[3];
+    std::vector<float> direction[3];
+    std::vector<float> attenuation[3];
+    std::vector<uint32_t> pixel;
+
+    size_t size() const { return pixel.size(); }
+
+    void resize(size_t count)
+    {
+      for (int axis = 0; axis < 3; ++axis)
+      {
+        origin[axis].resize(count);
+        direction[axis].resize(count);
+        attenuation[axis].resize(count);
+      }
+      pixel.resize(count);
+    }
+
+    Ray<float> ray(size_t i) const
+    {
+      return { glm::vec3(origin[0][i], origin[1][i], origin[2][i]), glm::vec3(direction[0][i], direction[1][i], direction[2][i]) };
+    }
+
+    glm::vec3 attenuationAt(size_t i) const
+    {
+      return glm::vec3(attenuation[0][i], attenuation[1][i], attenuation[2][i]);
+    }
+
+    void set(size_t i, const Ray<float>& ray, const glm::vec3& att, uint32_t pixelIndex)
+    {
+      for (int axis = 0; axis < 3; ++axis)
+      {
+        origin[axis][i] = ray.origin[axis];
+        direction[axis][i] = ray.direction[axis];
+        attenuation[axis][i] = att[axis];
+      }
+      pixel[i] = pixelIndex;
+    }
+
+    void copy(size_t dst, size_t src)
+    {
+      for (int axis = 0; axis < 3; ++axis)
+      {
+        origin[axis][dst] = origin[axis][src];
+        direction[axis][dst] = direction[axis][src];
+        attenuation[axis][dst] = attenuation[axis][src];
+      }
+      pixel[dst] = pixel[src];
+    }
+  };
+
+  // Shadow rays with what they add to their path when the light is visible
+  struct ShadowQueue
+  {
+    std::vector<float> origin[3];
+    std::vector<float> direction[3];
+    std::vector<float> contribution[3];
+    std::vector<float> tMin;
+    std::vector<float> tMax;
+
+    void resize(size_t count)
+    {
+      for (int axis = 0; axis < 3; ++axis)
+      {
+        origin[axis].resize(count);
+        direction[axis].resize(count);
+        contribution[axis].resize(count);
+      }
+      tMin.resize(count);
+      tMax.resize(count);
+    }
+
+    void set(size_t i, const Ray<float>& ray, float rayTMin, float rayTMax, const glm::vec3& add)
+    {
+      for (int axis = 0; axis < 3; ++axis)
+      {
+        origin[axis][i] = ray.origin[axis];
+        direction[axis][i] = ray.direction[axis];
+        contribution[axis][i] = add[axis];
+      }
+      tMin[i] = rayTMin;
+      tMax[i] = rayTMax;
+    }
+
+    Ray<float> ray(size_t i) const
+    {
+      return { glm::vec3(origin[0][i], origin[1][i], origin[2][i]), glm::vec3(direction[0][i], direction[1][i], direction[2][i]) };
+    }
+
+    void copy(size_t dst, const ShadowQueue& from, size_t src)
+    {
+      for (int axis = 0; axis < 3; ++axis)
+      {
+        origin[axis][dst] = from.origin[axis][src];
+        direction[axis][dst] = from.direction[axis][src];
+        contribution[axis][dst] = from.contribution[axis][src];
+      }
+      tMin[dst] = from.tMin[src];
+      tMax[dst] = from.tMax[src];
+    }
+
+    glm::vec3 contributionAt(size_t i) const
+    {
+      return glm::vec3(contribution[0][i], contribution[1][i], contribution[2][i]);
+    }
+  };
+}
+
+CpuRenderer::CpuRenderer(const Scene& scene, const Settings& settings)
+  : scene(scene), settings(settings), topology(CpuTopology::detect()), workers(topology.workers(settings.threadsNum)),
+  pool(workers, settings.pinThreads), direct(scene.integratorName == "direct"), maxDepth(scene.depth), geometry(1)
+{
+  // The matrices VulkanRaytracer puts into the uniform buffer
+  const float aspect = static_cast<float>(scene.width) / static_cast<float>(scene.height);
+  viewInverse = glm::inverse(glm::lookAt(scene.eyeInit, scene.center, glm::normalize(scene.upInit)));
+  projInverse = glm::inverse(glm::perspective(glm::radians(scene.fovy), aspect, 0.1f, 512.0f));
+
+  // Placements are flattened into world space triangles. Animated scenes are rendered at time 0
+  std::vector<Triangle>& triangles = geometry[0].triangles;
+  std::vector<glm::vec3> lo, hi;
+  for (size_t k = 0; k < scene.meshPlacements.size(); ++k)
+  {
+    const MeshPlacement& placement = scene.meshPlacements[k];
+    const MeshInstance& instance = scene.meshInstances[k];
+    const Mesh& mesh = scene.meshes[placement.mesh];
+    const glm::mat4 transform = scene.placementTransform(placement, 0.0f);
+    const glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(transform)));
+    for (uint32_t t = 0; t < mesh.indexCount / 3; ++t)
+    {
+      const Vertex& v0 = scene.vertices[scene.indices[mesh.firstIndex + 3 * t]];
+      const Vertex& v1 = scene.vertices[scene.indices[mesh.firstIndex + 3 * t + 1]];
+      const Vertex& v2 = scene.vertices[scene.indices[mesh.firstIndex + 3 * t + 2]];
+      Triangle triangle;
+      triangle.v0 = glm::vec3(transform * glm::vec4(v0.pos, 1.0f));
+      triangle.v1 = glm::vec3(transform * glm::vec4(v1.pos, 1.0f));
+      triangle.v2 = glm::vec3(transform * glm::vec4(v2.pos, 1.0f));
+      triangle.n0 = normalMatrix * v0.normal;
+      triangle.n1 = normalMatrix * v1.normal;
+      triangle.n2 = normalMatrix * v2.normal;
+      triangle.material = instance.materialOffset + t * instance.materialStride;
+      triangles.push_back(triangle);
+      lo.push_back(glm::min(triangle.v0, glm::min(triangle.v1, triangle.v2)));
+      hi.push_back(glm::max(triangle.v0, glm::max(triangle.v1, triangle.v2)));
+    }
+  }
+
+  for (const Sphere& sphere : scene.spheres)
+  {
+    glm::vec3 sphereLo(std::numeric_limits<float>::max());
+    glm::vec3 sphereHi(-std::numeric_limits<float>::max());
+    for (int corner = 0; corner < 8; ++corner)
+    {
+      const glm::vec3 sign((corner & 1) ? 1.0f : -1.0f, (corner & 2) ? 1.0f : -1.0f, (corner & 4) ? 1.0f : -1.0f);
+      const glm::vec3 p = glm::vec3(sphere.transform * glm::vec4(sphere.pos + sign * sphere.radius, 1.0f));
+      sphereLo = glm::min(sphereLo, p);
+      sphereHi = glm::max(sphereHi, p);
+    }
+    lo.push_back(sphereLo);
+    hi.push_back(sphereHi);
+  }
+
+  geometry[0].bvh.build(lo, hi);
+
+  nodeGeometry.assign(topology.nodes.size(), 0);
+  if (!settings.replicateBvh || topology.nodes.size() < 2)
+    return;
+
+  // Pages go to the node of the thread touching them first, so every copy is made by a thread pinned to its node
+  std::vector<uint32_t> nodeCpus(topology.nodes.size(), ~0u);
+  for (const CpuTopology::Worker& worker : workers)
+  {
+    if (nodeCpus[worker.node] == ~0u)
+    {
+      nodeCpus[worker.node] = worker.cpu;
+      nodeGeometry[worker.node] = static_cast<uint32_t>(geometry.size());
+      geometry.emplace_back();
+    }
+  }
+  std::vector<std::thread> copies;
+  for (uint32_t node = 0; node < topology.nodes.size(); ++node)
+  {
+    if (nodeCpus[node] == ~0u)
+      continue;
+    copies.emplace_back([this, node, cpu = nodeCpus[node]]()
+      {
+        pinCurrentThread(cpu);
+        geometry[nodeGeometry[node]] = geometry[0];
+      });
+  }
+  for (std::thread& copy : copies)
+    copy.join();
+}
+
+intersection::Ray<float> CpuRenderer::cameraRay(uint32_t x, uint32_t y) const
+{
+  // raygen.rgen
+  const glm::vec2 uv = (glm::vec2(static_cast<float>(x), static_cast<float>(y)) + glm::vec2(0.5f)) /
+    glm::vec2(static_cast<float>(scene.width), static_cast<float>(scene.height));
+  const glm::vec2 d(uv.x * 2.0f - 1.0f, 1.0f - 2.0f * uv.y);
+  const glm::vec4 target = projInverse * glm::vec4(d.x, d.y, 1.0f, 1.0f);
+
+  Ray<float> ray;
+  ray.origin = glm::vec3(viewInverse * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+  ray.direction = glm::normalize(glm::vec3(viewInverse * glm::vec4(glm::normalize(glm::vec3(target) / target.w), 0.0f)));
+  return ray;
+}
+
+CpuRenderer::Hit CpuRenderer::closestHit(const Geometry& geometry, const Ray<float>& ray, float tMin, float tMax,
+  TraversalStats& traversal) const
+{
+  const std::vector<Triangle>& triangles = geometry.triangles;
+  Hit hit;
+  hit.t = tMax;
+  const intersection::WatertightRay<float> watertight(ray);
+  const glm::vec3 invDirection = 1.0f / ray.direction;
+  const uint32_t trianglesNum = static_cast<uint32_t>(triangles.size());
+  geometry.bvh.traverse(ray, invDirection, tMin, hit.t, false, traversal, [&](uint32_t primitive, float& t)
+    {
+      if (primitive < trianglesNum)
+      {
+        const Triangle& triangle = triangles[primitive];
+        glm::vec3 barycentrics;
+        if (!intersection::rayTriangleWatertight(watertight, triangle.v0, triangle.v1, triangle.v2, tMin, t, &barycentrics))
+          return false;
+        hit.barycentrics = barycentrics;
+      }
+      else if (!intersectSphere(scene.spheres[primitive - trianglesNum], ray, tMin, t))
+      {
+        return false;
+      }
+      hit.primitive = primitive;
+      return true;
+    });
+  return hit;
+}
+
+bool CpuRenderer::occluded(const Geometry& geometry, const ShadowRay& shadowRay, TraversalStats& traversal) const
+{
+  const std::vector<Triangle>& triangles = geometry.triangles;
+  float t = shadowRay.tMax;
+  const intersection::WatertightRay<float> watertight(shadowRay.ray);
+  const glm::vec3 invDirection = 1.0f / shadowRay.ray.direction;
+  const uint32_t trianglesNum = static_cast<uint32_t>(triangles.size());
+  return geometry.bvh.traverse(shadowRay.ray, invDirection, shadowRay.tMin, t, true, traversal, [&](uint32_t primitive, float& tHit)
+    {
+      if (primitive < trianglesNum)
+      {
+        const Triangle& triangle = triangles[primitive];
+        return intersection::rayTriangleWatertight(watertight, triangle.v0, triangle.v1, triangle.v2, shadowRay.tMin, tHit);
+      }
+      return intersectSphere(scene.spheres[primitive - trianglesNum], shadowRay.ray, shadowRay.tMin, tHit);
+    });
+}
+
+CpuRenderer::Surface CpuRenderer::surface(const Geometry& geometry, const Ray<float>& ray, const Hit& hit) const
+{
+  const std::vector<Triangle>& triangles = geometry.triangles;
+  Surface s;
+  if (hit.primitive < triangles.size())
+  {
+    const Triangle& triangle = triangles[hit.primitive];
+    const glm::vec3& b = hit.barycentrics;
+    s.point = triangle.v0 * b.x + triangle.v1 * b.y + triangle.v2 * b.z;
+    s.normal = glm::normalize(triangle.n0 * b.x + triangle.n1 * b.y + triangle.n2 * b.z);
+    s.geometricNormal = glm::normalize(glm::cross(triangle.v1 - triangle.v0, triangle.v2 - triangle.v0));
+    s.material = &scene.triangleMaterials[triangle.material];
+    s.triangle = true;
+    return s;
+  }
+
+  const uint32_t index = hit.primitive - static_cast<uint32_t>(triangles.size());
+  const Sphere& sphere = scene.spheres[index];
+  s.point = ray.origin + ray.direction * hit.t;
+  const glm::vec3 pointTransf = glm::vec3(sphere.invertedTransform * glm::vec4(s.point, 1.0f));
+  s.normal = glm::normalize(glm::mat3(glm::transpose(sphere.invertedTransform)) * (pointTransf - sphere.pos));
+  s.geometricNormal = s.normal;
+  s.material = &scene.sphereMaterials[index];
+  s.triangle = false;
+  return s;
+}
+
+CpuRenderer::ShadowRay CpuRenderer::shadowRay(const Surface& s, const glm::vec3& direction, float dist) const
+{
+  ShadowRay shadow;
+  shadow.ray.direction = direction;
+  if (s.triangle)
+  {
+    shadow.ray.origin = intersection::offsetRayOrigin(s.point, glm::dot(direction, s.geometricNormal) < 0.0f ? -s.geometricNormal : s.geometricNormal);
+    shadow.tMin = 0.0f;
+  }
+  else
+  {
+    shadow.ray.origin = s.point;
+    shadow.tMin = eps;
+  }
+  shadow.tMax = direct ? dist - eps : dist;
+  return shadow;
+}
+
+bool CpuRenderer::reflect(const Ray<float>& ray, const Surface& s, Ray<float>& reflected, glm::vec3& attenuation) const
+{
+  const glm::vec3 specular(s.material->specular);
+  if (specular.x < 0.01f && specular.y < 0.01f && specular.z < 0.01f)
+    return false;
+
+  attenuation *= specular;
+  reflected.direction = glm::normalize(glm::reflect(ray.direction, s.normal));
+  reflected.origin = s.triangle ?
+    intersection::offsetRayOrigin(s.point, glm::dot(ray.direction, s.geometricNormal) < 0.0f ? s.geometricNormal : -s.geometricNormal) :
+    s.point;
+  return true;
+}
+
+float CpuRenderer::getSample(const PathVertex& vertex, uint32_t s, uint32_t dimension, uint32_t& rngState) const
+{
+  const uint32_t sampleIndex = vertex.frameIndex * static_cast<uint32_t>(scene.lightsamples) + s;
+  dimension += vertex.depth * sampling::DIMENSIONS_PER_BOUNCE;
+  if (scene.samplerType == sampling::SAMPLER_SOBOL)
+    return sampling::sampleSobol(sampling::pixelSeed(vertex.x, vertex.y), sampleIndex, dimension);
+  if (scene.samplerType == sampling::SAMPLER_BLUE_NOISE)
+    return sampling::sampleBlueNoise(scene.blueNoise[sampling::blueNoiseIndex(vertex.x, vertex.y, dimension)], sampleIndex, dimension);
+  return stepAndOutputRNGFloat(rngState);
+}
+
+template <typename Emit>
+glm::vec3 CpuRenderer::shade(const Ray<float>& ray, const Surface& s, const PathVertex& vertex, Emit&& emit) const
+{
+  const Material& m = *s.material;
+  // closesthit.rchit looks from the ray origin, the direct shaders along the ray
+  const glm::vec3 eyedir = direct ? -ray.direction : glm::normalize(ray.origin - s.point);
+
+  for (const DirectionLight& light : scene.directLights)
+  {
+    const glm::vec3 direction = glm::normalize(light.dir);
+    const glm::vec3 halfvec = glm::normalize(direction + eyedir);
+    emit(shadowRay(s, direction, 10000.0f), glm::vec3(computeLight(direction, light.color, s.normal, halfvec, m)));
+  }
+
+  for (const PointLight& light : scene.pointLights)
+  {
+    const glm::vec3 lightdir = light.pos - s.point;
+    const glm::vec3 direction = glm::normalize(lightdir);
+    const float dist = glm::length(lightdir);
+    if (glm::dot(s.normal, direction) <= 0.0f)
+      continue;
+    const glm::vec3 halfvec = glm::normalize(direction + eyedir);
+    const glm::vec4 color = computeLight(direction, light.color, s.normal, halfvec, m);
+    const float a = light.attenuation.x + light.attenuation.y * dist + light.attenuation.z * dist * dist;
+    emit(shadowRay(s, direction, dist), glm::vec3(color / a));
+  }
+
+  if (direct && glm::vec3(m.emission) == glm::vec3(0.0f) && !scene.quadLights.empty())
+  {
+    const uint32_t lightsamples = static_cast<uint32_t>(scene.lightsamples);
+    const uint32_t quadLightsNum = static_cast<uint32_t>(scene.quadLights.size());
+    const uint32_t gridWidth = static_cast<uint32_t>(std::sqrt(static_cast<float>(lightsamples)));
+    uint32_t rngState = sampling::hashCombine(sampling::pixelSeed(vertex.x, vertex.y), vertex.frameIndex);
+    for (uint32_t sample = 0; sample < lightsamples; ++sample)
+    {
+      // sampleLightIndex and getLightPos of closesthit_direct.rchit
+      const float scaled = getSample(vertex, sample, 0, rngState) * quadLightsNum;
+      const uint32_t slot = std::min(static_cast<uint32_t>(scaled), quadLightsNum - 1);
+      const LightAliasEntry& entry = scene.lightAliasTable[slot];
+      const uint32_t lightIndex = (scaled - slot) < entry.probability ? slot : entry.alias;
+      const float lightPdf = scene.lightAliasTable[lightIndex].pdf;
+      const QuadLight& q = scene.quadLights[lightIndex];
+
+      float u1 = getSample(vertex, sample, 1, rngState);
+      float u2 = getSample(vertex, sample, 2, rngState);
+      if (scene.samplerType == sampling::SAMPLER_PCG && scene.lightstratify && sample < gridWidth * gridWidth)
+      {
+        u1 = (u1 + sample % gridWidth) / gridWidth;
+        u2 = (u2 + sample / gridWidth) / gridWidth;
+      }
+      const glm::vec3 lightpos = q.pos + u1 * q.abSide + u2 * q.acSide;
+
+      const glm::vec3 lightdir = lightpos - s.point;
+      const glm::vec3 direction = glm::normalize(lightdir);
+      const float dist = glm::length(lightdir);
+      if (glm::dot(s.normal, direction) <= 0.0f)
+        continue;
+      const glm::vec4 F = computeLight(direction, eyedir, s.normal, m);
+      const float cosOmegaO = glm::dot(q.normal, direction);
+      const float cosOmegaI = glm::dot(s.normal, direction);
+      const float geom = std::max(cosOmegaI, 0.0f) * std::max(cosOmegaO, 0.0f) / (dist * dist);
+      const float area = glm::length(glm::cross(q.abSide, q.acSide));
+      emit(shadowRay(s, direction, dist), glm::vec3(q.color * F * geom * area / lightPdf) / static_cast<float>(lightsamples));
+    }
+  }
+
+  return glm::vec3(m.ambient + m.emission);
+}
+
+CpuRenderer::Stats& CpuRenderer::Stats::operator+=(const Stats& other)
+{
+  primaryRays += other.primaryRays;
+  secondaryRays += other.secondaryRays;
+  shadowRays += other.shadowRays;
+  seconds += other.seconds;
+  generateSeconds += other.generateSeconds;
+  sortSeconds += other.sortSeconds;
+  intersectSeconds += other.intersectSeconds;
+  shadeSeconds += other.shadeSeconds;
+  shadowSeconds += other.shadowSeconds;
+  accumulateSeconds += other.accumulateSeconds;
+  stolenTiles += other.stolenTiles;
+  nodesVisited += other.nodesVisited;
+  primitivesTested += other.primitivesTested;
+  return *this;
+}
+
+CpuRenderer::Stats CpuRenderer::render(Mode mode, uint32_t firstPass, uint32_t passes, std::vector<glm::vec3>& image,
+  uint32_t waveSize, std::vector<TraversalStats>* traversal) const
+{
+  PROFILE_SCOPE(mode == Mode::PerPixel ? "cpuRenderPerPixel" : "cpuRenderWavefront");
+  image.resize(scene.width * scene.height, glm::vec3(0.0f));
+  if (!Bvh::countStats)
+    traversal = nullptr;
+  else if (traversal)
+    traversal->resize(scene.width * scene.height);
+  Stats stats;
+  const auto start = std::chrono::steady_clock::now();
+  for (uint32_t pass = firstPass; pass < firstPass + passes; ++pass)
+  {
+    if (mode == Mode::PerPixel)
+      renderPerPixel(pass, image, traversal, stats);
+    else
+      renderWavefront(pass, image, std::max(waveSize, 1u), traversal, stats);
+  }
+  stats.seconds = secondsSince(start);
+  return stats;
+}
+
+void CpuRenderer::renderPerPixel(uint32_t frameIndex, std::vector<glm::vec3>& image, std::vector<TraversalStats>* traversal,
+  Stats& stats) const
+{
+  const uint32_t width = static_cast<uint32_t>(scene.width);
+  const uint32_t height = static_cast<uint32_t>(scene.height);
+  const uint32_t tilesX = (width + tileSize - 1) / tileSize;
+  const uint32_t tilesY = (height + tileSize - 1) / tileSize;
+  std::atomic<uint64_t> secondaryRays = 0;
+  std::atomic<uint64_t> shadowRays = 0;
+  std::atomic<uint64_t> nodesVisited = 0;
+  std::atomic<uint64_t> primitivesTested = 0;
+  TileScheduler scheduler(workers, static_cast<uint32_t>(topology.nodes.size()), settings.pinThreads, settings.stealTiles);
+  stats.stolenTiles += scheduler.run(tilesX * tilesY, [&](uint32_t worker, uint32_t tile)
+    {
+      PROFILE_SCOPE("cpuTile");
+      const Geometry& nodeLocal = geometry[nodeGeometry[workers[worker].node]];
+      const uint32_t x0 = (tile % tilesX) * tileSize;
+      const uint32_t y0 = (tile / tilesX) * tileSize;
+      uint64_t secondary = 0;
+      uint64_t shadow = 0;
+      TraversalStats tileTraversal;
+      // Shadow rays of the current hit, traced after its base color is added like in the wavefront
+      std::vector<std::pair<ShadowRay, glm::vec3>> pending;
+      for (uint32_t y = y0; y < std::min(y0 + tileSize, height); ++y)
+      {
+        for (uint32_t x = x0; x < std::min(x0 + tileSize, width); ++x)
+        {
+          Ray<float> ray = cameraRay(x, y);
+          glm::vec3 color(0.0f);
+          glm::vec3 attenuation(1.0f);
+          TraversalStats pixelTraversal;
+          for (uint32_t depth = 0; depth < maxDepth; ++depth)
+          {
+            if (depth > 0)
+              ++secondary;
+            const Hit hit = closestHit(nodeLocal, ray, pathTMin, pathTMax, pixelTraversal);
+            if (hit.primitive == noHit)
+              break;
+
+            const Surface s = surface(nodeLocal, ray, hit);
+            pending.clear();
+            const glm::vec3 base = shade(ray, s, { x, y, depth, frameIndex }, [&](const ShadowRay& shadowRay, const glm::vec3& contribution)
+              {
+                pending.emplace_back(shadowRay, contribution);
+              });
+            color += attenuation * base;
+            for (const auto& [shadowRay, contribution] : pending)
+            {
+              if (!occluded(nodeLocal, shadowRay, pixelTraversal))
+                color += attenuation * contribution;
+            }
+            shadow += pending.size();
+
+            Ray<float> reflected;
+            if (!reflect(ray, s, reflected, attenuation))
+              break;
+            ray = reflected;
+          }
+          image[y * width + x] += color;
+          if constexpr (Bvh::countStats)
+          {
+            tileTraversal += pixelTraversal;
+            if (traversal)
+              (*traversal)[y * width + x] += pixelTraversal;
+          }
+        }
+      }
+      secondaryRays += secondary;
+      shadowRays += shadow;
+      nodesVisited += tileTraversal.nodesVisited;
+      primitivesTested += tileTraversal.primitivesTested;
+    });
+  stats.primaryRays += scene.width * scene.height;
+  stats.secondaryRays += secondaryRays;
+  stats.shadowRays += shadowRays;
+  stats.nodesVisited += nodesVisited;
+  stats.primitivesTested += primitivesTested;
+}
+
+void CpuRenderer::renderWavefront(uint32_t frameIndex, std::vector<glm::vec3>& image, uint32_t waveSize,
+  std::vector<TraversalStats>* traversal, Stats& stats) const
+{
+  const uint32_t width = static_cast<uint32_t>(scene.width);
+  const size_t pixelsNum = scene.width * scene.height;
+  // The stages trace against the replica of the node their worker runs on, like the tiles of the per pixel loop
+  auto nodeLocal = [this](uint32_t worker) -> const Geometry& { return geometry[nodeGeometry[workers[worker].node]]; };
+  const uint32_t trianglesNum = static_cast<uint32_t>(geometry[0].triangles.size());
+  // A hit emits at most one shadow ray per directional and point light plus the quad light samples
+  const size_t shadowSlots = scene.directLights.size() + scene.pointLights.size() +
+    (direct && !scene.quadLights.empty() ? static_cast<size_t>(scene.lightsamples) : 0);
+  const size_t grain = 256;
+
+  PathQueue paths, next;
+  ShadowQueue slots, shadows;
+  std::vector<Hit> hits;
+  std::vector<uint8_t> octants;
+  std::vector<uint32_t> order;
+  std::vector<uint64_t> keys;
+  std::vector<glm::vec3> base, color;
+  std::vector<uint32_t> shadowCounts, shadowOffsets;
+  std::vector<uint8_t> alive, visible;
+  // Traversal work of the path and shadow rays, summed per pixel in the accumulate stage
+  std::vector<TraversalStats> pathTraversal, shadowTraversal;
+
+  for (size_t waveBegin = 0; waveBegin < pixelsNum; waveBegin += waveSize)
+  {
+    const size_t waveEnd = std::min(waveBegin + waveSize, pixelsNum);
+    auto start = std::chrono::steady_clock::now();
+    {
+      PROFILE_SCOPE("cpuGenerate");
+      paths.resize(waveEnd - waveBegin);
+      pool.run(paths.size(), grain, [&](size_t begin, size_t end)
+        {
+          for (size_t i = begin; i < end; ++i)
+          {
+            const uint32_t pixel = static_cast<uint32_t>(waveBegin + i);
+            paths.set(i, cameraRay(pixel % width, pixel / width), glm::vec3(1.0f), pixel);
+          }
+        });
+      color.assign(paths.size(), glm::vec3(0.0f));
+      stats.primaryRays += paths.size();
+    }
+    stats.generateSeconds += secondsSince(start);
+
+    for (uint32_t depth = 0; depth < maxDepth && paths.size() > 0; ++depth)
+    {
+      const size_t count = paths.size();
+      if (depth > 0)
+        stats.secondaryRays += count;
+
+      start = std::chrono::steady_clock::now();
+      sortByOctant(paths.direction, count, octants, order);
+      stats.sortSeconds += secondsSince(start);
+
+      start = std::chrono::steady_clock::now();
+      {
+        PROFILE_SCOPE("cpuIntersect");
+        hits.resize(count);
+        pathTraversal.assign(Bvh::countStats ? count : 0, {});
+        pool.run(count, grain, [&](uint32_t worker, size_t begin, size_t end)
+          {
+            const Geometry& local = nodeLocal(worker);
+            TraversalStats uncounted;
+            for (size_t k = begin; k < end; ++k)
+            {
+              const uint32_t i = order[k];
+              hits[i] = closestHit(local, paths.ray(i), pathTMin, pathTMax, Bvh::countStats ? pathTraversal[i] : uncounted);
+            }
+          });
+      }
+      stats.intersectSeconds += secondsSince(start);
+
+      // Hits sharing a material are shaded together, misses go last
+      start = std::chrono::steady_clock::now();
+      keys.resize(count);
+      for (size_t i = 0; i < count; ++i)
+      {
+        const uint32_t primitive = hits[i].primitive;
+        const uint64_t material = primitive == noHit ? noHit : primitive < trianglesNum ? geometry[0].triangles[primitive].material :
+          static_cast<uint32_t>(scene.triangleMaterials.size()) + primitive - trianglesNum;
+        keys[i] = material << 32 | i;
+      }
+      std::sort(keys.begin(), keys.end());
+      for (size_t k = 0; k < count; ++k)
+        order[k] = static_cast<uint32_t>(keys[k]);
+      stats.sortSeconds += secondsSince(start);
+
+      start = std::chrono::steady_clock::now();
+      {
+        PROFILE_SCOPE("cpuShade");
+        base.resize(count);
+        shadowCounts.assign(count, 0);
+        alive.assign(count, 0);
+        slots.resize(count * shadowSlots);
+        next.resize(count);
+        pool.run(count, grain, [&](uint32_t worker, size_t begin, size_t end)
+          {
+            const Geometry& local = nodeLocal(worker);
+            for (size_t k = begin; k < end; ++k)
+            {
+              const uint32_t i = order[k];
+              if (hits[i].primitive == noHit)
+              {
+                base[i] = glm::vec3(0.0f);
+                continue;
+              }
+
+              const Ray<float> ray = paths.ray(i);
+              const uint32_t pixel = paths.pixel[i];
+              const Surface s = surface(local, ray, hits[i]);
+              uint32_t& emitted = shadowCounts[i];
+              base[i] = shade(ray, s, { pixel % width, pixel / width, depth, frameIndex }, [&](const ShadowRay& shadowRay, const glm::vec3& contribution)
+                {
+                  slots.set(i * shadowSlots + emitted++, shadowRay.ray, shadowRay.tMin, shadowRay.tMax, contribution);
+                });
+
+              glm::vec3 attenuation = paths.attenuationAt(i);
+              Ray<float> reflected;
+              if (depth + 1 < maxDepth && reflect(ray, s, reflected, attenuation))
+              {
+                next.set(i, reflected, attenuation, pixel);
+                alive[i] = 1;
+              }
+            }
+          });
+      }
+      stats.shadeSeconds += secondsSince(start);
+
+      start = std::chrono::steady_clock::now();
+      {
+        PROFILE_SCOPE("cpuShadow");
+        shadowOffsets.resize(count + 1);
+        shadowOffsets[0] = 0;
+        for (size_t i = 0; i < count; ++i)
+          shadowOffsets[i + 1] = shadowOffsets[i] + shadowCounts[i];
+        const size_t shadowsNum = shadowOffsets[count];
+        shadows.resize(shadowsNum);
+        pool.run(count, grain, [&](size_t begin, size_t end)
+          {
+            for (size_t i = begin; i < end; ++i)
+            {
+              for (uint32_t j = 0; j < shadowCounts[i]; ++j)
+                shadows.copy(shadowOffsets[i] + j, slots, i * shadowSlots + j);
+            }
+          });
+
+        sortByOctant(shadows.direction, shadowsNum, octants, order);
+        visible.resize(shadowsNum);
+        shadowTraversal.assign(Bvh::countStats ? shadowsNum : 0, {});
+        pool.run(shadowsNum, grain, [&](uint32_t worker, size_t begin, size_t end)
+          {
+            const Geometry& local = nodeLocal(worker);
+            TraversalStats uncounted;
+            for (size_t k = begin; k < end; ++k)
+            {
+              const uint32_t j = order[k];
+              visible[j] = !occluded(local, { shadows.ray(j), shadows.tMin[j], shadows.tMax[j] },
+                Bvh::countStats ? shadowTraversal[j] : uncounted);
+            }
+          });
+        stats.shadowRays += shadowsNum;
+      }
+      stats.shadowSeconds += secondsSince(start);
+
+      start = std::chrono::steady_clock::now();
+      {
+        PROFILE_SCOPE("cpuAccumulate");
+        // A wave holds one path per pixel, in the order of the per pixel loop: base color, then the visible lights
+        for (size_t i = 0; i < count; ++i)
+        {
+          glm::vec3& pathColor = color[paths.pixel[i] - waveBegin];
+          const glm::vec3 attenuation = paths.attenuationAt(i);
+          pathColor += attenuation * base[i];
+          for (uint32_t j = shadowOffsets[i]; j < shadowOffsets[i + 1]; ++j)
+          {
+            if (visible[j])
+              pathColor += attenuation * shadows.contributionAt(j);
+          }
+        }
+
+        if constexpr (Bvh::countStats)
+        {
+          for (size_t i = 0; i < count; ++i)
+          {
+            TraversalStats pixelTraversal = pathTraversal[i];
+            for (uint32_t j = shadowOffsets[i]; j < shadowOffsets[i + 1]; ++j)
+              pixelTraversal += shadowTraversal[j];
+            stats.nodesVisited += pixelTraversal.nodesVisited;
+            stats.primitivesTested += pixelTraversal.primitivesTested;
+            if (traversal)
+              (*traversal)[paths.pixel[i]] += pixelTraversal;
+          }
+        }
+
+        // Reflected paths move to the front of the next queue
+        size_t aliveNum = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+          if (alive[i])
+            next.copy(aliveNum++, i);
+        }
+        next.resize(aliveNum);
+        std::swap(paths, next);
+      }
+      stats.accumulateSeconds += secondsSince(start);
+    }
+
+    for (size_t i = 0; i < color.size(); ++i)
+      image[waveBegin + i] += color[i];
+  }
+}
+
+bool CpuRenderer::requested(const std::vector<std::string>& args)
+{
+  return std::find(args.begin(), args.end(), "-cpu") != args.end();
+}
+
+CpuRenderer::Options CpuRenderer::parseOptions(const std::vector<std::string>& args)
+{
+  Options options;
+  for (size_t i = 0; i < args.size(); ++i)
+  {
+    if (args[i] == "-no-pin")
+      options.settings.pinThreads = false;
+    else if (args[i] == "-no-steal")
+      options.settings.stealTiles = false;
+    else if (args[i] == "-numa-replicas")
+      options.settings.replicateBvh = true;
+    else if (args[i] == "-ray-stats")
+      options.rayStats = true;
+    else if (i + 1 == args.size())
+      break;
+    // The mode is optional, -cpu -regression <dir> renders the regression in the default mode
+    else if (args[i] == "-cpu" && args[i + 1].rfind('-', 0) != 0)
+      options.modeName = args[i + 1];
+    else if (args[i] == "-s" || args[i] == "-scene")
+      options.scenePath = args[i + 1];
+    else if (args[i] == "-threads")
+      options.settings.threadsNum = static_cast<uint32_t>(std::atoi(args[i + 1].c_str()));
+    else if (args[i] == "-wave-size")
+      options.waveSize = static_cast<uint32_t>(std::atoi(args[i + 1].c_str()));
+    else if (args[i] == "-regression")
+      options.regressionDir = args[i + 1];
+    else if (args[i] == "-regression-tolerance")
+      options.regressionTolerance = static_cast<uint32_t>(std::atoi(args[i + 1].c_str()));
+    else if (args[i] == "-regression-max-bad")
+      options.regressionMaxBadPixels = std::atof(args[i + 1].c_str());
+    else if (args[i] == "-benchmark")
+      options.benchmarkFile = args[i + 1];
+    else if (args[i] == "-benchmark-dir")
+      options.benchmarkDir = args[i + 1];
+    else if (args[i] == "-heatmap")
+    {
+      options.heatmapFile = args[i + 1];
+      options.rayStats = true;
+    }
+    else if (args[i] == "-benchmark-runs")
+      options.benchmarkRuns = static_cast<uint32_t>(std::max(std::atoi(args[i + 1].c_str()), 1));
+    else
+      options.stop.parse(args, i);
+  }
+  return options;
+}
+
+RenderSummary CpuRenderer::accumulate(Mode mode, const StopCriteria& stop, uint32_t waveSize, std::vector<glm::vec3>& image,
+  Stats& stats, std::vector<TraversalStats>* traversal) const
+{
+  // One pass at a time like VulkanRaytracer::accumulatePasses, the pass images give the error estimate
+  const size_t pixelsNum = static_cast<size_t>(scene.width) * scene.height;
+  const uint32_t lightsamples = static_cast<uint32_t>(std::max(scene.lightsamples, 1));
+  image.assign(pixelsNum, glm::vec3(0.0f));
+  std::vector<double> luminanceSquares(pixelsNum, 0.0);
+  std::vector<glm::vec3> passImage;
+  RenderSummary summary;
+  const auto start = std::chrono::steady_clock::now();
+  while (summary.stopReason.empty())
+  {
+    passImage.assign(pixelsNum, glm::vec3(0.0f));
+    const Stats pass = render(mode, summary.passes, 1, passImage, waveSize, traversal);
+    stats += pass;
+    ++summary.passes;
+    for (size_t i = 0; i < pixelsNum; ++i)
+    {
+      image[i] += passImage[i];
+      const double l = luminance(passImage[i]);
+      luminanceSquares[i] += l * l;
+    }
+
+    PassProgress progress;
+    progress.passes = summary.passes;
+    progress.lightsamples = lightsamples;
+    progress.passSeconds = pass.seconds;
+    progress.elapsedSeconds = secondsSince(start);
+    summary.stopReason = stopReason(stop, progress, [&]() { return estimatedError(image, luminanceSquares, summary.passes); });
+  }
+  summary.seconds = secondsSince(start);
+  summary.meanSpp = static_cast<double>(summary.passes) * lightsamples;
+  if (summary.passes > 1)
+    summary.error = estimatedError(image, luminanceSquares, summary.passes);
+  return summary;
+}
+
+bool CpuRenderer::run(const std::vector<std::string>& args)
+{
+  const Options options = parseOptions(args);
+  const std::string& modeName = options.modeName;
+  const Settings& settings = options.settings;
+  const StopCriteria& stop = options.stop;
+  if (modeName != "perpixel" && modeName != "wavefront" && modeName != "compare" && modeName != "scaling")
+  {
+    std::cerr << "Unknown CPU renderer mode " << modeName << ", expected perpixel, wavefront, compare or scaling" << std::endl;
+    return false;
+  }
+  if (!options.benchmarkFile.empty())
+    return runBenchmark(options);
+  if (!options.regressionDir.empty())
+    return runRegression(options);
+  if (options.scenePath.empty())
+  {
+    std::cerr << "The CPU renderer needs a scene, -s <file>" << std::endl;
+    return false;
+  }
+
+  Scene scene;
+  std::string error;
+  if (!loadScene(options.scenePath, scene, error))
+  {
+    std::cerr << error << std::endl;
+    return false;
+  }
+
+  const uint32_t lightsamples = static_cast<uint32_t>(std::max(scene.lightsamples, 1));
+  const CpuTopology topology = CpuTopology::detect();
+  std::cout << "CPU renderer: " << options.scenePath << ", " << scene.spheres.size() << " spheres, "
+    << topology.nodes.size() << " NUMA nodes with " << topology.cpusNum() << " processors" << std::endl;
+
+  auto report = [](const char* name, const Stats& stats)
+  {
+    std::cout << name << ": " << stats.seconds << " s, " << stats.rays() / stats.seconds * 1e-6 << " Mrays/s ("
+      << stats.primaryRays << " primary, " << stats.secondaryRays << " secondary, " << stats.shadowRays << " shadow rays)" << std::endl;
+  };
+
+  if (modeName == "scaling")
+  {
+    // Without stealing every node only works off its own share of the tiles, the difference to stealing is the
+    // imbalance between the nodes. Every thread count renders the same passes, only -spp applies
+    const uint32_t passes = stop.maxSpp > 0 ? (stop.maxSpp + lightsamples - 1) / lightsamples : 1;
+    std::vector<uint32_t> threadCounts;
+    for (uint32_t count = 1; count < topology.cpusNum(); count *= 2)
+      threadCounts.push_back(count);
+    threadCounts.push_back(topology.cpusNum());
+
+    std::cout << (settings.replicateBvh && topology.nodes.size() > 1 ? "Geometry replicated on every NUMA node with threads" :
+      "Geometry shared by all NUMA nodes") << std::endl;
+    double oneThreadSeconds = 0.0;
+    for (uint32_t threadsNum : threadCounts)
+    {
+      Settings scaled = settings;
+      scaled.threadsNum = threadsNum;
+      std::vector<glm::vec3> image;
+      scaled.stealTiles = true;
+      const Stats stealing = CpuRenderer(scene, scaled).render(Mode::PerPixel, 0, passes, image);
+      image.clear();
+      scaled.stealTiles = false;
+      const Stats separate = CpuRenderer(scene, scaled).render(Mode::PerPixel, 0, passes, image);
+
+      std::vector<bool> usedNodes(topology.nodes.size(), false);
+      for (const CpuTopology::Worker& worker : topology.workers(threadsNum))
+        usedNodes[worker.node] = true;
+      if (threadsNum == 1)
+        oneThreadSeconds = stealing.seconds;
+      const double speedup = oneThreadSeconds / stealing.seconds;
+      std::cout << threadsNum << " threads on " << std::count(usedNodes.begin(), usedNodes.end(), true) << " nodes: "
+        << stealing.seconds << " s, " << stealing.rays() / stealing.seconds * 1e-6 << " Mrays/s, speedup " << speedup
+        << ", efficiency " << 100.0 * speedup / threadsNum << "%, " << stealing.stolenTiles << " tiles stolen; without stealing "
+        << separate.seconds << " s" << std::endl;
+    }
+    return true;
+  }
+
+  const CpuRenderer renderer(scene, settings);
+  std::cout << renderer.geometry[0].triangles.size() << " triangles, " << renderer.workers.size() << " threads" << std::endl;
+
+  if (options.rayStats && !Bvh::countStats)
+    std::cerr << "-ray-stats and -heatmap need a build with ENABLE_BVH_STATS" << std::endl;
+  const bool rayStats = options.rayStats && Bvh::countStats;
+
+  const Mode mode = options.mode();
+  std::vector<glm::vec3> image;
+  std::vector<TraversalStats> traversal;
+  Stats stats;
+  const RenderSummary summary = renderer.accumulate(mode, stop, options.waveSize, image, stats, rayStats ? &traversal : nullptr);
+  const uint32_t passes = summary.passes;
+  std::cout << "Rendered " << passes << " passes in " << summary.seconds << " s, stopped by " << summary.stopReason << std::endl;
+
+  if (mode == Mode::PerPixel)
+  {
+    report("per pixel", stats);
+    std::cout << "  " << stats.stolenTiles << " tiles stolen between NUMA nodes" << std::endl;
+  }
+  else
+  {
+    report("wavefront", stats);
+    std::cout << "  generate " << stats.generateSeconds << " s, sort " << stats.sortSeconds << " s, intersect "
+      << stats.intersectSeconds << " s, shade " << stats.shadeSeconds << " s, shadow " << stats.shadowSeconds
+      << " s, accumulate " << stats.accumulateSeconds << " s" << std::endl;
+  }
+  if (rayStats)
+  {
+    const double rays = static_cast<double>(std::max<uint64_t>(stats.rays(), 1));
+    std::cout << "  BVH traversal: " << stats.nodesVisited / rays << " nodes visited and " << stats.primitivesTested / rays
+      << " primitives tested per ray" << std::endl;
+  }
+  if (rayStats && !options.heatmapFile.empty())
+  {
+    std::vector<uint32_t> nodesVisited(traversal.size());
+    for (size_t i = 0; i < traversal.size(); ++i)
+      nodesVisited[i] = traversal[i].nodesVisited;
+    const uint32_t maxNodes = writeHeatmap(options.heatmapFile, nodesVisited.data(), static_cast<uint32_t>(scene.width),
+      static_cast<uint32_t>(scene.height));
+    std::cout << "Traversal heatmap " << options.heatmapFile << " saved to disk, red is "
+      << static_cast<double>(maxNodes) / passes << " nodes visited per pass" << std::endl;
+  }
+
+  if (modeName == "compare")
+  {
+    std::vector<glm::vec3> perPixelImage;
+    const Stats perPixel = renderer.render(Mode::PerPixel, 0, passes, perPixelImage);
+    report("per pixel", perPixel);
+    float maxDifference = 0.0f;
+    for (size_t i = 0; i < image.size(); ++i)
+    {
+      const glm::vec3 difference = glm::abs(image[i] - perPixelImage[i]);
+      maxDifference = std::max(maxDifference, std::max(difference.x, std::max(difference.y, difference.z)));
+    }
+    std::cout << "max difference " << maxDifference << std::endl;
+    if (maxDifference > 0.0f)
+    {
+      std::cerr << "The wavefront and per pixel images differ" << std::endl;
+      return false;
+    }
+  }
+
+  writeImage(scene.screenshotName, meanRgba(image, passes), static_cast<uint32_t>(scene.width), static_cast<uint32_t>(scene.height));
+  std::cout << "Wrote " << scene.screenshotName << std::endl;
+  writeRenderReport(std::filesystem::path(scene.screenshotName).replace_extension(".json").string(), scene.screenshotName,
+    static_cast<uint32_t>(scene.width), static_cast<uint32_t>(scene.height), lightsamples, stop, stop.stopAtTargetError, summary, nullptr);
+  return true;
+}
+
+bool CpuRenderer::runRegression(const Options& options)
+{
+  uint32_t passedNum = 0, failedNum = 0, skippedNum = 0;
+  std::vector<std::string> jpegOnly;
+  for (const std::filesystem::path& scenePath : sceneFiles(options.regressionDir))
+  {
+    const std::filesystem::path reference = referenceImage(scenePath);
+    Scene scene;
+    std::string error = "no PNG reference";
+    const std::vector<std::filesystem::path> jpegs = jpegReferences(scenePath);
+    if (reference.empty() && !jpegs.empty())
+    {
+      error = "only " + std::to_string(jpegs.size()) + " JPEG references, not compared";
+      jpegOnly.push_back(scenePath.stem().string());
+    }
+    if (reference.empty() || !loadScene(scenePath.string(), scene, error, true))
+    {
+      std::cout << "SKIP " << scenePath.string() << ": " << error << std::endl;
+      ++skippedNum;
+      continue;
+    }
+
+    const CpuRenderer renderer(scene, options.settings);
+    std::vector<glm::vec3> image;
+    Stats stats;
+    const RenderSummary summary = renderer.accumulate(options.mode(), options.stop, options.waveSize, image, stats);
+
+    // Rounded to 8 bits the way the PNG writer saves it
+    const uint32_t width = static_cast<uint32_t>(scene.width);
+    const uint32_t height = static_cast<uint32_t>(scene.height);
+    const std::vector<float> rgba = meanRgba(image, summary.passes);
+    std::vector<uint8_t> rgb(static_cast<size_t>(width) * height * 3);
+    for (uint32_t y = 0; y < height; ++y)
+      convertRowEdx(&rgba[static_cast<size_t>(y) * width * 4], &rgb[static_cast<size_t>(y) * width * 3], width);
+
+    const std::string stem = reference.stem().string();
+    if (compareWithReference(rgb.data(), width, height, reference.string(), stem + "_diff.png", options.regressionTolerance,
+      options.regressionMaxBadPixels))
+    {
+      ++passedNum;
+    }
+    else
+    {
+      writeImage(stem + "_render.png", rgba, width, height);
+      ++failedNum;
+    }
+  }
+
+  std::cout << "Regression: " << passedNum << " passed, " << failedNum << " failed, " << skippedNum << " skipped";
+  if (!jpegOnly.empty())
+  {
+    std::cout << ", " << jpegOnly.size() << " of them only have JPEG references:";
+    for (const std::string& name : jpegOnly)
+      std::cout << " " << name;
+  }
+  std::cout << std::endl;
+  return failedNum == 0 && passedNum > 0;
+}
+
+bool CpuRenderer::runBenchmark(const Options& options)
+{
+  // A fixed number of samples, budgets are ignored like in the Vulkan benchmark
+  StopCriteria stop;
+  stop.maxSpp = options.stop.maxSpp > 0 ? options.stop.maxSpp : benchmarkDefaultSpp;
+
+  std::vector<BenchmarkResult> results;
+  size_t threadsNum = 0;
+  for (const char* name : benchmarkScenes)
+  {
+    const std::filesystem::path scenePath = std::filesystem::path(options.benchmarkDir) / (std::string(name) + ".test");
+    if (!std::filesystem::exists(scenePath))
+    {
+      std::cerr << "Benchmark scene " << scenePath.string() << " not found, skipped" << std::endl;
+      continue;
+    }
+
+    BenchmarkResult result;
+    result.scene = name;
+    std::vector<double> loadMs, buildMs, renderSeconds, mrays;
+    for (uint32_t run = 0; run < options.benchmarkRuns; ++run)
+    {
+      auto start = std::chrono::steady_clock::now();
+      Scene scene;
+      std::string error;
+      if (!loadScene(scenePath.string(), scene, error))
+      {
+        std::cerr << "Benchmark scene " << scenePath.string() << " skipped: " << error << std::endl;
+        break;
+      }
+      loadMs.push_back(secondsSince(start) * 1e3);
+
+      start = std::chrono::steady_clock::now();
+      const CpuRenderer renderer(scene, options.settings);
+      buildMs.push_back(secondsSince(start) * 1e3);
+      threadsNum = renderer.workers.size();
+
+      std::vector<glm::vec3> image;
+      Stats stats;
+      const RenderSummary summary = renderer.accumulate(options.mode(), stop, options.waveSize, image, stats);
+      // The rays the renderer traced, not the raysPerSample estimate the Vulkan benchmark has to use
+      renderSeconds.push_back(summary.seconds);
+      mrays.push_back(stats.rays() / summary.seconds * 1e-6);
+
+      result.width = static_cast<uint32_t>(scene.width);
+      result.height = static_cast<uint32_t>(scene.height);
+      result.triangles = scene.indices.size() / 3;
+      result.spheres = scene.spheres.size();
+    }
+    if (mrays.empty())
+      continue;
+    std::cout << name << ": " << std::accumulate(mrays.begin(), mrays.end(), 0.0) / mrays.size() << " Mrays/s, "
+      << std::accumulate(buildMs.begin(), buildMs.end(), 0.0) / buildMs.size() << " ms BVH build" << std::endl;
+
+    result.runs = { { "loadMs", loadMs }, { "accelerationStructureMs", buildMs }, { "renderSeconds", renderSeconds },
+      { "mraysPerSecond", mrays } };
+    result.peakRssBytes = peakResidentBytes();
+    results.push_back(std::move(result));
+  }
+
+  const std::string device = "CPU " + std::string(options.mode() == Mode::PerPixel ? "per pixel" : "wavefront") + ", " +
+    std::to_string(threadsNum) + " threads";
+  if (!writeBenchmarkResults(options.benchmarkFile, device, stop.maxSpp, options.benchmarkRuns, results))
+    return false;
+  std::cout << "Benchmark results written to " << options.benchmarkFile << std::endl;
+  return true;
+}
@@ -0,0 +1,199 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <Bvh.h>
+#include <CpuTopology.h>
+#include <RenderReport.h>
+#include <SceneLoader.h>
+#include <WorkerPool.h>
+
+
+// Renders scenes on the CPU with the shading of the raytracer and direct integrators. Samples and ray offsets
+// come from the same sources as in the shaders, so the images match the GPU up to rounding.
+// The same work runs in one of two schedules:
+// - per pixel: every thread traces whole paths, shadow rays included, one pixel after the other. Threads are
+//   pinned to cores and take 16x16 tiles from work stealing queues per NUMA node (see TileScheduler)
+// - wavefront: waves of paths move through separate stages (generate, intersect, shade sorted by material,
+//   shadow rays, accumulate) over structure of arrays queues, rays sorted by direction octant before traversal.
+//   The stages run on a pool of threads pinned like the per pixel ones, kept for the lifetime of the renderer
+// Both sum the same values in the same order, their images are identical
+class CpuRenderer
+{
+public:
+  enum class Mode
+  {
+    PerPixel,
+    Wavefront,
+  };
+
+  struct Stats
+  {
+    uint64_t primaryRays = 0;
+    uint64_t secondaryRays = 0;
+    uint64_t shadowRays = 0;
+    double seconds = 0.0;
+    // Wavefront stages, summed over the waves
+    double generateSeconds = 0.0;
+    double sortSeconds = 0.0;
+    double intersectSeconds = 0.0;
+    double shadeSeconds = 0.0;
+    double shadowSeconds = 0.0;
+    double accumulateSeconds = 0.0;
+    // Per pixel tiles taken from the queue of another NUMA node
+    uint64_t stolenTiles = 0;
+    // BVH traversal of all rays, only counted in builds with ENABLE_BVH_STATS
+    uint64_t nodesVisited = 0;
+    uint64_t primitivesTested = 0;
+
+    uint64_t rays() const { return primaryRays + secondaryRays + shadowRays; }
+    Stats& operator+=(const Stats& other);
+  };
+
+  struct Settings
+  {
+    uint32_t threadsNum = 0;    // 0: one per logical processor
+    bool pinThreads = true;     // per pixel threads pinned to a processor each, NUMA nodes filled one after the other
+    bool stealTiles = true;     // threads out of tiles take them from the queues of the other nodes
+    bool replicateBvh = false;  // copy of the triangles and the BVH on every NUMA node with threads
+  };
+
+  // The scene has to outlive the renderer
+  CpuRenderer(const Scene& scene, const Settings& settings);
+
+  // Adds passes [firstPass, firstPass + passes) to the per pixel color sums in image. With ENABLE_BVH_STATS the
+  // traversal work of the rays of every pixel is added to traversal when it is given
+  Stats render(Mode mode, uint32_t firstPass, uint32_t passes, std::vector<glm::vec3>& image, uint32_t waveSize = 1 << 18,
+    std::vector<TraversalStats>* traversal = nullptr) const;
+
+  // -cpu [perpixel|wavefront|compare|scaling] among the arguments
+  static bool requested(const std::vector<std::string>& args);
+  // Loads the scene of the arguments, renders it without Vulkan and writes its screenshot with the sidecar report of
+  // the headless Vulkan path. Passes are added until -time-budget, -target-error or -spp stop them, one pass without.
+  // compare renders it in both modes, reports their throughput and checks that the images agree. scaling renders per
+  // pixel on 1, 2, 4, ... threads up to every processor, with and without stealing between NUMA nodes.
+  // -ray-stats prints the BVH nodes and primitives per ray, -heatmap <file> writes the nodes visited by the rays of
+  // every pixel like the Vulkan ray heatmap, both need a build with ENABLE_BVH_STATS.
+  // -regression <dir> compares the scenes of the directory with their PNG references instead, -benchmark <file>
+  // renders the benchmark corpus and writes the JSON of the Vulkan benchmark
+  static bool run(const std::vector<std::string>& args);
+
+private:
+  // Command line of run()
+  struct Options
+  {
+    std::string modeName = "wavefront";
+    std::string scenePath;
+    uint32_t waveSize = 1 << 18;
+    Settings settings;
+    StopCriteria stop;
+    std::string regressionDir;
+    uint32_t regressionTolerance = 8;
+    double regressionMaxBadPixels = 0.001;
+    std::string benchmarkFile;
+    std::string benchmarkDir = "data";
+    uint32_t benchmarkRuns = 3;
+    bool rayStats = false;
+    std::string heatmapFile;
+
+    Mode mode() const { return modeName == "perpixel" ? Mode::PerPixel : Mode::Wavefront; }
+  };
+
+  static constexpr uint32_t noHit = ~0u;
+  // raygen.rgen traces every path ray with these, the shadow rays of spheres start at EPS
+  static constexpr float pathTMin = 0.001f;
+  static constexpr float pathTMax = 10000.0f;
+  static constexpr float eps = 0.001f;
+  static constexpr uint32_t tileSize = 16;
+
+  // World space triangle of a mesh placement, normals are transformed but not normalized like in the hit shaders
+  struct Triangle
+  {
+    glm::vec3 v0, v1, v2;
+    glm::vec3 n0, n1, n2;
+    uint32_t material;
+  };
+
+  // What traversal reads, replicated per NUMA node on request
+  struct Geometry
+  {
+    std::vector<Triangle> triangles;
+    // Triangles first, then scene.spheres
+    Bvh bvh;
+  };
+
+  struct Hit
+  {
+    float t = pathTMax;
+    uint32_t primitive = noHit;
+    glm::vec3 barycentrics{ 0.0f };
+  };
+
+  struct Surface
+  {
+    glm::vec3 point;
+    glm::vec3 normal;
+    glm::vec3 geometricNormal;
+    const Material* material;
+    // Triangle hit points are accurate to a few ulps and leave through offsetRayOrigin, sphere hit points through EPS
+    bool triangle;
+  };
+
+  struct ShadowRay
+  {
+    intersection::Ray<float> ray;
+    float tMin;
+    float tMax;
+  };
+
+  // What the hit shaders read from the payload and the pass
+  struct PathVertex
+  {
+    uint32_t x, y;
+    uint32_t depth;
+    uint32_t frameIndex;
+  };
+
+  intersection::Ray<float> cameraRay(uint32_t x, uint32_t y) const;
+  Hit closestHit(const Geometry& geometry, const intersection::Ray<float>& ray, float tMin, float tMax,
+    TraversalStats& traversal) const;
+  bool occluded(const Geometry& geometry, const ShadowRay& shadowRay, TraversalStats& traversal) const;
+  Surface surface(const Geometry& geometry, const intersection::Ray<float>& ray, const Hit& hit) const;
+  ShadowRay shadowRay(const Surface& surface, const glm::vec3& direction, float dist) const;
+  // Reflection continuing the path, false when the material stops it
+  bool reflect(const intersection::Ray<float>& ray, const Surface& surface, intersection::Ray<float>& reflected,
+    glm::vec3& attenuation) const;
+  float getSample(const PathVertex& vertex, uint32_t s, uint32_t dimension, uint32_t& rngState) const;
+  // Color of the hit without the lights, emit(shadowRay, contribution) for every light the shaders test for occlusion
+  template <typename Emit>
+  glm::vec3 shade(const intersection::Ray<float>& ray, const Surface& surface, const PathVertex& vertex, Emit&& emit) const;
+
+  static Options parseOptions(const std::vector<std::string>& args);
+  // Every scene of the directory with a PNG reference, like VulkanRaytracer::renderRegression
+  static bool runRegression(const Options& options);
+  // The corpus of VulkanRaytracer::renderBenchmark, the BVH build takes the place of the acceleration structures
+  static bool runBenchmark(const Options& options);
+  // Adds passes until stop ends the render, image receives the color sums of the passes
+  RenderSummary accumulate(Mode mode, const StopCriteria& stop, uint32_t waveSize, std::vector<glm::vec3>& image, Stats& stats,
+    std::vector<TraversalStats>* traversal = nullptr) const;
+
+  void renderPerPixel(uint32_t frameIndex, std::vector<glm::vec3>& image, std::vector<TraversalStats>* traversal, Stats& stats) const;
+  void renderWavefront(uint32_t frameIndex, std::vector<glm::vec3>& image, uint32_t waveSize, std::vector<TraversalStats>* traversal,
+    Stats& stats) const;
+
+  const Scene& scene;
+  Settings settings;
+  CpuTopology topology;
+  std::vector<CpuTopology::Worker> workers;
+  // Runs the wavefront stages, not part of the renderer's state
+  mutable WorkerPool pool;
+  bool direct;
+  uint32_t maxDepth;
+  glm::mat4 viewInverse;
+  glm::mat4 projInverse;
+  // The first is built by the constructor, the replicas of the NUMA nodes follow
+  std::vector<Geometry> geometry;
+  // Index into geometry for every node of the topology
+  std::vector<uint32_t> nodeGeometry;
+};
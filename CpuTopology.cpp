@@ -0,0 +1,141 @@
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <CpuTopology.h>
+
+
+namespace
+{
+#ifdef __linux__
+  // "0-3,8-11" as written to /sys/devices/system/node/node*/cpulist
+  std::vector<uint32_t> parseCpuList(const std::string& list)
+  {
+    std::vector<uint32_t> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ','))
+    {
+      if (range.empty() || range[0] < '0' || range[0] > '9')
+        continue;
+      const size_t dash = range.find('-');
+      const uint32_t first = static_cast<uint32_t>(std::stoul(range.substr(0, dash)));
+      const uint32_t last = dash == std::string::npos ? first : static_cast<uint32_t>(std::stoul(range.substr(dash + 1)));
+      for (uint32_t cpu = first; cpu <= last; ++cpu)
+        cpus.push_back(cpu);
+    }
+    return cpus;
+  }
+#endif
+}
+
+CpuTopology CpuTopology::detect()
+{
+  CpuTopology topology;
+#ifdef _WIN32
+  // Nodes spanning several processor groups only report their primary group
+  ULONG highestNode = 0;
+  if (GetNumaHighestNodeNumber(&highestNode))
+  {
+    for (ULONG id = 0; id <= highestNode; ++id)
+    {
+      GROUP_AFFINITY affinity{};
+      if (!GetNumaNodeProcessorMaskEx(static_cast<USHORT>(id), &affinity) || affinity.Mask == 0)
+        continue;
+      Node node{ static_cast<uint32_t>(id), {} };
+      for (uint32_t bit = 0; bit < 64; ++bit)
+      {
+        if (affinity.Mask & (KAFFINITY(1) << bit))
+          node.cpus.push_back(affinity.Group * 64u + bit);
+      }
+      topology.nodes.push_back(node);
+    }
+  }
+#elif defined(__linux__)
+  // Containers and taskset may allow only some of the processors of a node
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  const bool haveAffinity = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+  std::error_code error;
+  for (const auto& entry : std::filesystem::directory_iterator("/sys/devices/system/node", error))
+  {
+    const std::string name = entry.path().filename().string();
+    if (name.size() < 5 || name.compare(0, 4, "node") != 0 || name.find_first_not_of("0123456789", 4) != std::string::npos)
+      continue;
+    std::ifstream file(entry.path() / "cpulist");
+    std::string list;
+    std::getline(file, list);
+    Node node{ static_cast<uint32_t>(std::stoul(name.substr(4))), {} };
+    for (uint32_t cpu : parseCpuList(list))
+    {
+      if (!haveAffinity || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)))
+        node.cpus.push_back(cpu);
+    }
+    if (!node.cpus.empty())
+      topology.nodes.push_back(node);
+  }
+  std::sort(topology.nodes.begin(), topology.nodes.end(), [](const Node& a, const Node& b) { return a.id < b.id; });
+#endif
+
+  if (topology.nodes.empty())
+  {
+    Node node{ 0, {} };
+    for (uint32_t cpu = 0; cpu < std::max(std::thread::hardware_concurrency(), 1u); ++cpu)
+      node.cpus.push_back(cpu);
+    topology.nodes.push_back(node);
+  }
+  return topology;
+}
+
+std::vector<CpuTopology::Worker> CpuTopology::workers(uint32_t threadsNum) const
+{
+  std::vector<Worker> all;
+  for (uint32_t node = 0; node < nodes.size(); ++node)
+  {
+    for (uint32_t cpu : nodes[node].cpus)
+      all.push_back({ cpu, node });
+  }
+
+  std::vector<Worker> placed(threadsNum > 0 ? threadsNum : all.size());
+  for (size_t i = 0; i < placed.size(); ++i)
+    placed[i] = all[i % all.size()];
+  return placed;
+}
+
+uint32_t CpuTopology::cpusNum() const
+{
+  size_t count = 0;
+  for (const Node& node : nodes)
+    count += node.cpus.size();
+  return static_cast<uint32_t>(count);
+}
+
+bool pinCurrentThread(uint32_t cpu)
+{
+#ifdef _WIN32
+  GROUP_AFFINITY affinity{};
+  affinity.Group = static_cast<WORD>(cpu / 64);
+  affinity.Mask = KAFFINITY(1) << (cpu % 64);
+  return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+#elif defined(__linux__)
+  if (cpu >= CPU_SETSIZE)
+    return false;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  (void)cpu;
+  return false;
+#endif
+}
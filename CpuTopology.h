@@ -0,0 +1,34 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+
+// NUMA nodes of the machine with the logical processors the process may run on. Without NUMA information
+// from the OS there is a single node holding every hardware thread
+struct CpuTopology
+{
+  struct Node
+  {
+    uint32_t id;
+    // On Windows group * 64 + processor number within the group
+    std::vector<uint32_t> cpus;
+  };
+
+  struct Worker
+  {
+    uint32_t cpu;   // logical processor the worker runs on
+    uint32_t node;  // index into nodes
+  };
+
+  static CpuTopology detect();
+
+  // Places threadsNum workers, 0 for one per processor. Nodes are filled one after the other, so fewer workers
+  // than a socket has cores stay on one socket. Extra workers wrap around
+  std::vector<Worker> workers(uint32_t threadsNum) const;
+  uint32_t cpusNum() const;
+
+  std::vector<Node> nodes;
+};
+
+// Restricts the calling thread to one logical processor. False where the OS doesn't support it
+bool pinCurrentThread(uint32_t cpu);
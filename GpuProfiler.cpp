@@ -0,0 +1,117 @@
+#include <iostream>
+#include <GpuProfiler.h>
+
+
+namespace
+{
+  const char* phaseNames[GpuProfiler::PHASE_COUNT] = { "trace", "copy", "as_build", "upload" };
+}
+
+void GpuProfiler::create(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t queueFamily, uint32_t slotsNum, const std::string& filename)
+{
+  uint32_t queueFamiliesNum = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamiliesNum, nullptr);
+  std::vector<VkQueueFamilyProperties> queueFamilies(queueFamiliesNum);
+  vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamiliesNum, queueFamilies.data());
+  const uint32_t validBits = queueFamily < queueFamiliesNum ? queueFamilies[queueFamily].timestampValidBits : 0;
+  if (validBits == 0)
+  {
+    std::cerr << "The queue has no timestamp support, GPU timings are disabled" << std::endl;
+    return;
+  }
+
+  out.open(filename);
+  if (!out.is_open())
+  {
+    std::cerr << "Could not create " << filename << ", GPU timings are disabled" << std::endl;
+    return;
+  }
+  out << "frame,phase,ms\n";
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+  timestampPeriodMs = properties.limits.timestampPeriod / 1e6;
+  timestampMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+
+  this->device = device;
+  VkQueryPoolCreateInfo queryPoolInfo{};
+  queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  queryPoolInfo.queryCount = PHASE_COUNT * 2;
+  queryPools.resize(slotsNum + 1);
+  for (VkQueryPool& pool : queryPools)
+  {
+    if (vkCreateQueryPool(device, &queryPoolInfo, nullptr, &pool) != VK_SUCCESS)
+    {
+      std::cerr << "Could not create a timestamp query pool, GPU timings are disabled" << std::endl;
+      destroy();
+      return;
+    }
+  }
+  pendingFrames.assign(queryPools.size(), UINT64_MAX);
+}
+
+void GpuProfiler::destroy()
+{
+  for (uint32_t slot = 0; slot < pendingFrames.size(); ++slot)
+  {
+    collect(slot);
+  }
+  for (VkQueryPool pool : queryPools)
+  {
+    if (pool != VK_NULL_HANDLE)
+      vkDestroyQueryPool(device, pool, nullptr);
+  }
+  queryPools.clear();
+  pendingFrames.clear();
+  out.close();
+}
+
+void GpuProfiler::reset(VkCommandBuffer cmd, uint32_t slot)
+{
+  if (slot < queryPools.size())
+    vkCmdResetQueryPool(cmd, queryPools[slot], 0, PHASE_COUNT * 2);
+}
+
+void GpuProfiler::begin(VkCommandBuffer cmd, uint32_t slot, Phase phase)
+{
+  if (slot < queryPools.size())
+    vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPools[slot], phase * 2);
+}
+
+void GpuProfiler::end(VkCommandBuffer cmd, uint32_t slot, Phase phase)
+{
+  if (slot < queryPools.size())
+    vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPools[slot], phase * 2 + 1);
+}
+
+void GpuProfiler::submit(uint32_t slot)
+{
+  if (slot >= queryPools.size())
+    return;
+  collect(slot);
+  pendingFrames[slot] = frame;
+  if (slot != setupSlot())
+    ++frame;
+}
+
+void GpuProfiler::collect(uint32_t slot)
+{
+  if (slot >= pendingFrames.size() || pendingFrames[slot] == UINT64_MAX)
+    return;
+
+  // Value and availability per query. Without the wait flag queries that are not done, or that the
+  // slot never wrote, come back unavailable instead of blocking
+  std::array<uint64_t, PHASE_COUNT * 4> results{};
+  vkGetQueryPoolResults(device, queryPools[slot], 0, PHASE_COUNT * 2, sizeof(results), results.data(), 2 * sizeof(uint64_t),
+    VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+  for (uint32_t phase = 0; phase < PHASE_COUNT; ++phase)
+  {
+    const uint64_t* r = &results[phase * 4];
+    if (r[1] == 0 || r[3] == 0)
+      continue;
+    last[phase] = static_cast<double>((r[2] - r[0]) & timestampMask) * timestampPeriodMs;
+    out << pendingFrames[slot] << ',' << phaseNames[phase] << ',' << last[phase] << '\n';
+  }
+  pendingFrames[slot] = UINT64_MAX;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "vulkan/vulkan.h"
+
+
+// GPU timestamps around the render phases, streamed as CSV rows "frame,phase,ms".
+// Every slot owns a query pool with a begin and end timestamp per phase. The draw command buffers are one
+// slot each, so the pools form a ring: a slot is read right before it is submitted again, when its previous
+// submission has finished, and readback never waits on the GPU. One-off command buffers of scene setup share
+// the last slot and are read once their synchronous flush returned
+class GpuProfiler
+{
+public:
+  enum Phase : uint32_t
+  {
+    PHASE_TRACE,
+    PHASE_COPY,
+    PHASE_AS_BUILD,
+    PHASE_UPLOAD,
+    PHASE_COUNT
+  };
+
+  GpuProfiler() = default;
+  GpuProfiler(const GpuProfiler&) = delete;
+  GpuProfiler& operator=(const GpuProfiler&) = delete;
+  ~GpuProfiler() { destroy(); }
+
+  // Stays disabled, every call a no-op, if the queue family has no timestamps or the file can't be created
+  void create(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t queueFamily, uint32_t slotsNum, const std::string& filename);
+  // Writes what the pending slots measured, the device has to be idle
+  void destroy();
+  bool enabled() const { return !queryPools.empty(); }
+  uint32_t setupSlot() const { return static_cast<uint32_t>(queryPools.size()) - 1; }
+
+  // Recorded at the start of the slot's command buffer
+  void reset(VkCommandBuffer cmd, uint32_t slot);
+  void begin(VkCommandBuffer cmd, uint32_t slot, Phase phase);
+  void end(VkCommandBuffer cmd, uint32_t slot, Phase phase);
+  // Called before the slot is submitted: writes the timings of its previous submission. Draw slots count frames
+  void submit(uint32_t slot);
+  // Writes the timings of a slot whose submission is known to be complete
+  void collect(uint32_t slot);
+
+  double lastMs(Phase phase) const { return last[phase]; }
+
+private:
+  VkDevice device = VK_NULL_HANDLE;
+  std::vector<VkQueryPool> queryPools;
+  double timestampPeriodMs = 0.0;
+  uint64_t timestampMask = 0;
+  uint64_t frame = 0;
+  // Frame of the submission each slot is waiting to be read for, UINT64_MAX when there is none
+  std::vector<uint64_t> pendingFrames;
+  std::array<double, PHASE_COUNT> last{};
+  std::ofstream out;
+};
@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <zlib.h>
+#include <ImageCompare.h>
+#include <ImageWriter.h>
+
+
+namespace
+{
+  uint32_t readBigEndian(const uint8_t* p)
+  {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+  }
+
+  uint8_t paeth(int a, int b, int c)
+  {
+    int p = a + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc)
+      return static_cast<uint8_t>(a);
+    return static_cast<uint8_t>(pb <= pc ? b : c);
+  }
+}
+
+std::vector<uint8_t> readPng(const std::string& filename, uint32_t& width, uint32_t& height)
+{
+  std::ifstream file(filename, std::ios::binary);
+  if (!file)
+    throw std::runtime_error("Could not open " + filename);
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+  static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+  if (data.size() < 8 || !std::equal(signature, signature + 8, data.begin()))
+    throw std::runtime_error(filename + " is not a PNG");
+
+  uint32_t channels = 0;
+  std::vector<uint8_t> compressed;
+  for (size_t pos = 8; pos + 12 <= data.size();)
+  {
+    const uint32_t length = readBigEndian(&data[pos]);
+    const std::string type(reinterpret_cast<const char*>(&data[pos + 4]), 4);
+    const uint8_t* chunk = &data[pos + 8];
+    if (pos + 12 + length > data.size())
+      throw std::runtime_error(filename + ": truncated " + type + " chunk");
+
+    if (type == "IHDR")
+    {
+      width = readBigEndian(chunk);
+      height = readBigEndian(chunk + 4);
+      const uint8_t bitDepth = chunk[8], colorType = chunk[9], interlace = chunk[12];
+      if (bitDepth != 8 || (colorType != 2 && colorType != 6) || interlace != 0)
+        throw std::runtime_error(filename + ": only non-interlaced 8-bit RGB and RGBA PNGs are supported");
+      channels = colorType == 6 ? 4 : 3;
+    }
+    else if (type == "IDAT")
+    {
+      compressed.insert(compressed.end(), chunk, chunk + length);
+    }
+    else if (type == "IEND")
+    {
+      break;
+    }
+    pos += 12 + length;
+  }
+  if (channels == 0)
+    throw std::runtime_error(filename + ": missing IHDR");
+
+  // Every scanline starts with its filter type byte
+  const size_t stride = static_cast<size_t>(width) * channels;
+  std::vector<uint8_t> filtered((stride + 1) * height);
+  uLongf filteredSize = static_cast<uLongf>(filtered.size());
+  if (uncompress(filtered.data(), &filteredSize, compressed.data(), static_cast<uLong>(compressed.size())) != Z_OK || filteredSize != filtered.size())
+    throw std::runtime_error(filename + ": corrupt image data");
+
+  std::vector<uint8_t> previous(stride, 0), row(stride);
+  std::vector<uint8_t> rgb(static_cast<size_t>(width) * height * 3);
+  for (uint32_t y = 0; y < height; ++y)
+  {
+    const uint8_t filter = filtered[y * (stride + 1)];
+    const uint8_t* src = &filtered[y * (stride + 1) + 1];
+    for (size_t i = 0; i < stride; ++i)
+    {
+      const int a = i >= channels ? row[i - channels] : 0;
+      const int b = previous[i];
+      const int c = i >= channels ? previous[i - channels] : 0;
+      switch (filter)
+      {
+      case 0: row[i] = src[i]; break;
+      case 1: row[i] = static_cast<uint8_t>(src[i] + a); break;
+      case 2: row[i] = static_cast<uint8_t>(src[i] + b); break;
+      case 3: row[i] = static_cast<uint8_t>(src[i] + (a + b) / 2); break;
+      case 4: row[i] = static_cast<uint8_t>(src[i] + paeth(a, b, c)); break;
+      default: throw std::runtime_error(filename + ": unknown scanline filter");
+      }
+    }
+    for (uint32_t x = 0; x < width; ++x)
+      std::copy_n(&row[x * channels], 3, &rgb[(static_cast<size_t>(y) * width + x) * 3]);
+    std::swap(previous, row);
+  }
+  return rgb;
+}
+
+ImageDifference compareImages(const uint8_t* rgb, const uint8_t* reference, uint32_t width, uint32_t height, uint32_t tolerance,
+  std::vector<float>* diff, float diffGain)
+{
+  ImageDifference result;
+  result.pixelsNum = static_cast<uint64_t>(width) * height;
+  if (diff)
+    diff->assign(result.pixelsNum * 4, 0.0f);
+
+  double squaredSum = 0.0;
+  uint32_t maxError = 0;
+  for (uint64_t p = 0; p < result.pixelsNum; ++p)
+  {
+    uint32_t pixelError = 0;
+    for (int c = 0; c < 3; ++c)
+    {
+      const uint32_t error = static_cast<uint32_t>(std::abs(int(rgb[p * 3 + c]) - int(reference[p * 3 + c])));
+      squaredSum += double(error) * error;
+      pixelError = std::max(pixelError, error);
+      if (diff)
+        (*diff)[p * 4 + c] = std::min(error * diffGain / 255.0f, 1.0f);
+    }
+    maxError = std::max(maxError, pixelError);
+    if (pixelError > tolerance)
+      ++result.pixelsOverTolerance;
+  }
+
+  result.rmse = std::sqrt(squaredSum / (3.0 * std::max<uint64_t>(result.pixelsNum, 1))) / 255.0;
+  result.psnr = result.rmse > 0.0 ? 20.0 * std::log10(1.0 / result.rmse) : std::numeric_limits<double>::infinity();
+  result.maxError = maxError / 255.0;
+  return result;
+}
+
+bool compareWithReference(const uint8_t* rgb, uint32_t width, uint32_t height, const std::string& reference,
+  const std::string& diffName, uint32_t tolerance, double maxBadPixels)
+{
+  uint32_t referenceWidth = 0, referenceHeight = 0;
+  std::vector<uint8_t> referenceRgb;
+  try
+  {
+    referenceRgb = readPng(reference, referenceWidth, referenceHeight);
+  }
+  catch (const std::exception& e)
+  {
+    std::cout << "FAIL " << reference << ": " << e.what() << std::endl;
+    return false;
+  }
+  if (referenceWidth != width || referenceHeight != height)
+  {
+    std::cout << "FAIL " << reference << ": reference is " << referenceWidth << "x" << referenceHeight
+      << ", the render " << width << "x" << height << std::endl;
+    return false;
+  }
+
+  std::vector<float> diff;
+  const ImageDifference difference = compareImages(rgb, referenceRgb.data(), width, height, tolerance, &diff);
+  const double badFraction = static_cast<double>(difference.pixelsOverTolerance) / difference.pixelsNum;
+  const bool passed = badFraction <= maxBadPixels;
+  std::cout << (passed ? "PASS " : "FAIL ") << reference << ": RMSE " << difference.rmse << ", PSNR " << difference.psnr
+    << " dB, max error " << std::lround(difference.maxError * 255.0) << "/255, " << difference.pixelsOverTolerance
+    << " pixels over tolerance (" << badFraction * 100.0 << "%), difference in " << diffName << std::endl;
+
+  std::unique_ptr<ImageWriter> writer = ImageWriter::create(diffName);
+  writer->open(diffName, width, height);
+  writer->writeRows(diff.data(), height);
+  writer->close();
+  return passed;
+}
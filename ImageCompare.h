@@ -0,0 +1,32 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+// Difference of an 8-bit RGB image against its reference
+struct ImageDifference
+{
+  // Over all channels, in [0, 1]
+  double rmse = 0.0;
+  // Peak signal to noise ratio in dB, infinite for identical images
+  double psnr = 0.0;
+  // Largest channel difference, in [0, 1]
+  double maxError = 0.0;
+  // Pixels with a channel difference above the tolerance
+  uint64_t pixelsOverTolerance = 0;
+  uint64_t pixelsNum = 0;
+};
+
+// Reads a non-interlaced 8-bit RGB or RGBA PNG as packed RGB bytes, alpha is dropped. Throws on other formats
+std::vector<uint8_t> readPng(const std::string& filename, uint32_t& width, uint32_t& height);
+
+// Compares packed RGB bytes of equal size. tolerance is the channel difference a pixel may have, in 1/255 steps.
+// diff receives the absolute differences as RGBA floats scaled by diffGain, ready for the image writers
+ImageDifference compareImages(const uint8_t* rgb, const uint8_t* reference, uint32_t width, uint32_t height, uint32_t tolerance,
+  std::vector<float>* diff = nullptr, float diffGain = 8.0f);
+
+// Compares packed RGB bytes with a PNG reference, prints PASS or FAIL with the statistics and writes the difference
+// image to diffName. Passes while at most maxBadPixels of the pixels differ by more than tolerance in a channel
+bool compareWithReference(const uint8_t* rgb, uint32_t width, uint32_t height, const std::string& reference,
+  const std::string& diffName, uint32_t tolerance, double maxBadPixels);
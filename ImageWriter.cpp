@@ -0,0 +1,531 @@
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <thread>
+#include <ImageWriter.h>
+#include <CpuProfiler.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define IMAGE_WRITER_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__) || defined(__AVX__)
+#define IMAGE_WRITER_SSSE3
+#include <tmmintrin.h>
+#endif
+
+
+namespace
+{
+  // Uncompressed bytes per parallel deflate strip
+  constexpr size_t stripMinSize = 1 << 20;
+  constexpr size_t deflateWindowSize = 1 << 15;
+
+  void putBigEndian(uint8_t* dst, uint32_t v)
+  {
+    dst[0] = static_cast<uint8_t>(v >> 24);
+    dst[1] = static_cast<uint8_t>(v >> 16);
+    dst[2] = static_cast<uint8_t>(v >> 8);
+    dst[3] = static_cast<uint8_t>(v);
+  }
+
+  template<typename T>
+  void putLittleEndian(std::vector<uint8_t>& dst, T v)
+  {
+    uint8_t bytes[sizeof(T)];
+    std::memcpy(bytes, &v, sizeof(T));
+    if constexpr (std::endian::native == std::endian::big)
+      std::reverse(bytes, bytes + sizeof(T));
+    dst.insert(dst.end(), bytes, bytes + sizeof(T));
+  }
+
+#ifdef IMAGE_WRITER_SSE2
+  // Drops the alpha bytes of four RGBA8 pixels and stores the 12 RGB bytes
+  void storeRgb(__m128i pixels, uint8_t* rgb)
+  {
+#ifdef IMAGE_WRITER_SSSE3
+    const __m128i dropAlpha = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    alignas(16) uint8_t packed[16];
+    _mm_store_si128(reinterpret_cast<__m128i*>(packed), _mm_shuffle_epi8(pixels, dropAlpha));
+    std::memcpy(rgb, packed, 12);
+#else
+    // Two pixels per 64-bit word: RGB of the first and RGB of the second shifted down over its alpha
+    alignas(16) uint64_t words[2];
+    _mm_store_si128(reinterpret_cast<__m128i*>(words), pixels);
+    const uint64_t low = (words[0] & 0xffffffull) | ((words[0] >> 8) & 0xffffff000000ull);
+    const uint64_t high = (words[1] & 0xffffffull) | ((words[1] >> 8) & 0xffffff000000ull);
+    std::memcpy(rgb, &low, 6);
+    std::memcpy(rgb + 6, &high, 6);
+#endif
+  }
+#endif
+
+  void putString(std::vector<uint8_t>& dst, const char* s)
+  {
+    dst.insert(dst.end(), s, s + std::strlen(s) + 1);
+  }
+
+  // Same quantization the raygen shader used to apply before writing rgba8: the channel is floored to
+  // k / 256 and the UNORM store rounds k / 256 * 255, which is (k * 255 + 128) >> 8 in integers
+  uint8_t edxRound(float c)
+  {
+    const uint32_t k = static_cast<uint32_t>(std::clamp(c, 0.0f, 1.0f) * 256.0f);
+    return static_cast<uint8_t>((k * 255 + 128) >> 8);
+  }
+
+  float linearToSrgb(float c)
+  {
+    return c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+  }
+
+  float srgbToLinear(float s)
+  {
+    return s <= 0.04045f ? s / 12.92f : std::pow((s + 0.055f) / 1.055f, 2.4f);
+  }
+
+  // sRGB buckets indexed by the float bits of the channel: 13 octaves below 1.0 with 10 mantissa bits
+  // each, everything under 2^-13 encodes to 0 anyway. A bucket is narrower than a tenth of a code, so
+  // it holds at most one code boundary, stored as the linear threshold where the next code starts
+  constexpr uint32_t srgbTableMinBits = 114u << 23;
+  constexpr uint32_t srgbTableShift = 13;
+  constexpr size_t srgbTableSize = (13u << 10) + 1;
+
+  struct SrgbTable
+  {
+    std::array<uint8_t, srgbTableSize> code;
+    std::array<float, srgbTableSize> threshold;
+  };
+
+  const SrgbTable& srgbTable()
+  {
+    static const SrgbTable table = []() {
+      SrgbTable t{};
+      for (uint32_t i = 0; i < srgbTableSize; ++i)
+      {
+        uint32_t lowBits = srgbTableMinBits + (i << srgbTableShift);
+        float low;
+        std::memcpy(&low, &lowBits, sizeof(float));
+        long code = std::lround(linearToSrgb(std::min(low, 1.0f)) * 255.0f);
+        t.code[i] = static_cast<uint8_t>(code);
+        t.threshold[i] = code < 255 ? srgbToLinear((code + 0.5f) / 255.0f) : 2.0f;
+      }
+      return t;
+    }();
+    return table;
+  }
+
+  uint8_t srgbRound(float c)
+  {
+    const SrgbTable& table = srgbTable();
+    c = std::clamp(c, 0.0f, 1.0f);
+    uint32_t bits;
+    std::memcpy(&bits, &c, sizeof(bits));
+    const uint32_t i = (std::max(bits, srgbTableMinBits) - srgbTableMinBits) >> srgbTableShift;
+    return table.code[i] + (c >= table.threshold[i] ? 1 : 0);
+  }
+}
+
+uint16_t floatToHalf(float value)
+{
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  const uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000u);
+  const uint32_t magnitude = bits & 0x7fffffffu;
+
+  if (magnitude >= 0x7f800000u)
+    return sign | (magnitude > 0x7f800000u ? 0x7e00u : 0x7c00u);
+  // Rounds up to infinity
+  if (magnitude >= 0x477ff000u)
+    return sign | 0x7c00u;
+  // Subnormal halves: shift the mantissa with its implicit bit into place
+  if (magnitude < 0x38800000u)
+  {
+    if (magnitude < 0x33000000u)
+      return sign;
+    const uint32_t exponent = magnitude >> 23;
+    const uint32_t mantissa = (magnitude & 0x7fffffu) | 0x800000u;
+    const uint32_t shift = 126 - exponent;
+    uint32_t half = mantissa >> shift;
+    const uint32_t remainder = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (remainder > halfway || (remainder == halfway && (half & 1u)))
+      ++half;
+    return sign | static_cast<uint16_t>(half);
+  }
+
+  uint32_t half = (magnitude - 0x38000000u) >> 13;
+  const uint32_t remainder = magnitude & 0x1fffu;
+  if (remainder > 0x1000u || (remainder == 0x1000u && (half & 1u)))
+    ++half;
+  return sign | static_cast<uint16_t>(half);
+}
+
+void convertRowEdx(const float* rgba, uint8_t* rgb, uint32_t width)
+{
+  uint32_t x = 0;
+#ifdef IMAGE_WRITER_SSE2
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 scale = _mm_set1_ps(256.0f);
+  const __m128i mul = _mm_set1_epi16(255);
+  const __m128i bias = _mm_set1_epi16(128);
+  for (; x + 4 <= width; x += 4, rgba += 16, rgb += 12)
+  {
+    __m128i k[4];
+    for (int i = 0; i < 4; ++i)
+    {
+      // max/min return the second operand for NaN, so NaN ends up as 0
+      __m128 c = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(rgba + i * 4), zero), one);
+      k[i] = _mm_cvttps_epi32(_mm_mul_ps(c, scale));
+    }
+    // k <= 256 fits signed 16 bits, k * 255 + 128 fits unsigned 16 bits
+    __m128i k01 = _mm_packs_epi32(k[0], k[1]);
+    __m128i k23 = _mm_packs_epi32(k[2], k[3]);
+    k01 = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(k01, mul), bias), 8);
+    k23 = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(k23, mul), bias), 8);
+    storeRgb(_mm_packus_epi16(k01, k23), rgb);
+  }
+#endif
+  for (; x < width; ++x, rgba += 4, rgb += 3)
+  {
+    rgb[0] = edxRound(rgba[0]);
+    rgb[1] = edxRound(rgba[1]);
+    rgb[2] = edxRound(rgba[2]);
+  }
+}
+
+void convertRowSrgb(const float* rgba, uint8_t* rgb, uint32_t width)
+{
+  const SrgbTable& table = srgbTable();
+  uint32_t x = 0;
+#ifdef IMAGE_WRITER_SSE2
+  const __m128 lowest = _mm_castsi128_ps(_mm_set1_epi32(static_cast<int>(srgbTableMinBits)));
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128i minBits = _mm_set1_epi32(static_cast<int>(srgbTableMinBits));
+  alignas(16) uint32_t index[4];
+  alignas(16) float value[4];
+  for (; x < width; ++x, rgba += 4, rgb += 3)
+  {
+    // Clamping to [2^-13, 1] as floats keeps the bit pattern inside the table
+    __m128 c = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(rgba), lowest), one);
+    __m128i i = _mm_srli_epi32(_mm_sub_epi32(_mm_castps_si128(c), minBits), srgbTableShift);
+    _mm_store_si128(reinterpret_cast<__m128i*>(index), i);
+    _mm_store_ps(value, c);
+    for (int channel = 0; channel < 3; ++channel)
+      rgb[channel] = table.code[index[channel]] + (value[channel] >= table.threshold[index[channel]] ? 1 : 0);
+  }
+#endif
+  for (; x < width; ++x, rgba += 4, rgb += 3)
+  {
+    rgb[0] = srgbRound(rgba[0]);
+    rgb[1] = srgbRound(rgba[1]);
+    rgb[2] = srgbRound(rgba[2]);
+  }
+}
+
+std::unique_ptr<ImageWriter> ImageWriter::create(const std::string& filename, bool halfFloat, bool srgb)
+{
+  std::string extension = std::filesystem::path(filename).extension().string();
+  std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+  if (extension == ".exr")
+    return std::make_unique<ExrWriter>(halfFloat);
+  if (extension == ".pfm")
+    return std::make_unique<PfmWriter>();
+  return std::make_unique<PngWriter>(srgb);
+}
+
+void ImageWriter::open(const std::string& filename_, uint32_t width_, uint32_t height_)
+{
+  filename = filename_;
+  width = width_;
+  height = height_;
+  rowsWritten = 0;
+
+  file.open(filename, std::ios::binary);
+  if (!file)
+    throw std::runtime_error("Could not open " + filename + " for writing");
+  writeHeader();
+}
+
+void ImageWriter::writeRows(const float* rgba, uint32_t rowsNum)
+{
+  const size_t rowSize = static_cast<size_t>(width) * 4;
+  for (uint32_t y = 0; y < rowsNum && rowsWritten < height; ++y, ++rowsWritten)
+    writeRow(rgba + y * rowSize, rowsWritten);
+}
+
+void ImageWriter::close()
+{
+  if (!file.is_open())
+    return;
+
+  if (rowsWritten != height)
+    throw std::runtime_error(filename + ": " + std::to_string(rowsWritten) + " of " + std::to_string(height) + " rows written");
+
+  finish();
+  file.close();
+  if (!file)
+    throw std::runtime_error("Could not write " + filename);
+}
+
+PngWriter::PngWriter(bool srgb, uint32_t threadsNum)
+  : srgb(srgb), threadsNum(threadsNum > 0 ? threadsNum : std::max(std::thread::hardware_concurrency(), 1u))
+{
+}
+
+void PngWriter::writeHeader()
+{
+  const std::array<uint8_t, 8> signature = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+  file.write(reinterpret_cast<const char*>(signature.data()), signature.size());
+
+  std::array<uint8_t, 13> header{};
+  putBigEndian(&header[0], width);
+  putBigEndian(&header[4], height);
+  header[8] = 8;  // bit depth
+  header[9] = 2;  // color type RGB
+  header[10] = 0; // deflate
+  header[11] = 0; // adaptive filtering
+  header[12] = 0; // no interlace
+  writeChunk("IHDR", header.data(), static_cast<uint32_t>(header.size()));
+
+  // Strips of at least a megabyte keep the per strip overhead (flush marker, lost context) negligible
+  const size_t scanlineSize = 1 + static_cast<size_t>(width) * 3;
+  stripSize = std::max<size_t>(scanlineSize, stripMinSize);
+  pending.clear();
+  pending.reserve(stripSize * threadsNum + scanlineSize + deflateWindowSize);
+  dictionarySize = 0;
+  adler = adler32(0L, nullptr, 0);
+  streamStarted = false;
+}
+
+void PngWriter::writeRow(const float* rgba, uint32_t)
+{
+  // Filter type 0 (none): the rows come straight from the renderer
+  const size_t offset = pending.size();
+  pending.resize(offset + 1 + static_cast<size_t>(width) * 3);
+  pending[offset] = 0;
+  if (srgb)
+    convertRowSrgb(rgba, &pending[offset + 1], width);
+  else
+    convertRowEdx(rgba, &pending[offset + 1], width);
+
+  if (pending.size() - dictionarySize >= stripSize * threadsNum)
+    compressPending(false);
+}
+
+void PngWriter::finish()
+{
+  compressPending(true);
+  writeChunk("IEND", nullptr, 0);
+}
+
+// Deflates the pending scanlines as one strip per thread. Each strip is primed with the 32 KB before it
+// and ends on a byte boundary (sync flush), so the strips concatenate into a single deflate stream
+void PngWriter::compressPending(bool last)
+{
+  PROFILE_SCOPE("compressPending");
+  const size_t dataSize = pending.size() - dictionarySize;
+  const size_t stripsNum = std::max<size_t>((dataSize + stripSize - 1) / stripSize, 1);
+  std::vector<Strip> strips(stripsNum);
+  for (size_t i = 0; i < stripsNum; ++i)
+  {
+    strips[i].begin = dictionarySize + i * stripSize;
+    strips[i].end = std::min(strips[i].begin + stripSize, pending.size());
+  }
+
+  // Exceptions can't leave a thread, every strip keeps its own until all threads are joined
+  auto compress = [this, &strips, last, stripsNum](size_t i)
+  {
+    try
+    {
+      compressStrip(strips[i], last && i == stripsNum - 1);
+    }
+    catch (...)
+    {
+      strips[i].error = std::current_exception();
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < stripsNum; ++i)
+    workers.emplace_back(compress, i);
+  compress(0);
+  for (std::thread& worker : workers)
+    worker.join();
+  for (const Strip& strip : strips)
+  {
+    if (strip.error)
+      std::rethrow_exception(strip.error);
+  }
+
+  for (size_t i = 0; i < stripsNum; ++i)
+  {
+    Strip& strip = strips[i];
+    adler = adler32_combine(adler, strip.adler, static_cast<z_off_t>(strip.end - strip.begin));
+    if (!streamStarted)
+    {
+      // zlib header: deflate with a 32 KB window, default compression
+      strip.compressed.insert(strip.compressed.begin(), { 0x78, 0x9c });
+      streamStarted = true;
+    }
+    if (last && i == stripsNum - 1)
+    {
+      uint8_t trailer[4];
+      putBigEndian(trailer, static_cast<uint32_t>(adler));
+      strip.compressed.insert(strip.compressed.end(), trailer, trailer + 4);
+    }
+    if (!strip.compressed.empty())
+      writeChunk("IDAT", strip.compressed.data(), static_cast<uint32_t>(strip.compressed.size()));
+  }
+
+  // The tail of this batch is the dictionary of the next one
+  const size_t keep = std::min(pending.size(), deflateWindowSize);
+  std::copy(pending.end() - keep, pending.end(), pending.begin());
+  pending.resize(keep);
+  dictionarySize = keep;
+}
+
+void PngWriter::compressStrip(Strip& strip, bool last) const
+{
+  PROFILE_SCOPE("compressStrip");
+  z_stream stream{};
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    throw std::runtime_error("Could not initialize zlib for " + filename);
+
+  const size_t dictionaryBegin = strip.begin - std::min(strip.begin, deflateWindowSize);
+  if (strip.begin > dictionaryBegin)
+    deflateSetDictionary(&stream, &pending[dictionaryBegin], static_cast<uInt>(strip.begin - dictionaryBegin));
+
+  const size_t size = strip.end - strip.begin;
+  strip.adler = adler32(adler32(0L, nullptr, 0), pending.data() + strip.begin, static_cast<uInt>(size));
+  // Room for the stream plus the sync flush marker
+  strip.compressed.resize(deflateBound(&stream, static_cast<uLong>(size)) + 16);
+  stream.next_in = const_cast<Bytef*>(pending.data() + strip.begin);
+  stream.avail_in = static_cast<uInt>(size);
+  stream.next_out = strip.compressed.data();
+  stream.avail_out = static_cast<uInt>(strip.compressed.size());
+  const int result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+  const bool complete = last ? result == Z_STREAM_END : (result == Z_OK && stream.avail_in == 0 && stream.avail_out > 0);
+  strip.compressed.resize(strip.compressed.size() - stream.avail_out);
+  deflateEnd(&stream);
+  if (!complete)
+    throw std::runtime_error("zlib error while writing " + filename);
+}
+
+void PngWriter::writeChunk(const char* type, const uint8_t* data, uint32_t size)
+{
+  uint8_t length[4];
+  putBigEndian(length, size);
+  file.write(reinterpret_cast<const char*>(length), 4);
+  file.write(type, 4);
+  if (size > 0)
+    file.write(reinterpret_cast<const char*>(data), size);
+
+  uLong crc = crc32(0L, reinterpret_cast<const Bytef*>(type), 4);
+  if (size > 0)
+    crc = crc32(crc, data, size);
+  uint8_t crcBytes[4];
+  putBigEndian(crcBytes, static_cast<uint32_t>(crc));
+  file.write(reinterpret_cast<const char*>(crcBytes), 4);
+}
+
+void ExrWriter::writeHeader()
+{
+  const int32_t pixelType = halfFloat ? 1 : 2;
+  std::vector<uint8_t> header;
+  putLittleEndian<uint32_t>(header, 20000630u); // magic
+  putLittleEndian<uint32_t>(header, 2u);        // version 2, single part scanline
+
+  // Channels are stored in alphabetical order
+  std::vector<uint8_t> channels;
+  for (const char* name : { "B", "G", "R" })
+  {
+    putString(channels, name);
+    putLittleEndian<int32_t>(channels, pixelType);
+    putLittleEndian<uint32_t>(channels, 0u); // pLinear + reserved
+    putLittleEndian<int32_t>(channels, 1);   // xSampling
+    putLittleEndian<int32_t>(channels, 1);   // ySampling
+  }
+  channels.push_back(0);
+
+  auto attribute = [&header](const char* name, const char* type, const std::vector<uint8_t>& value) {
+    putString(header, name);
+    putString(header, type);
+    putLittleEndian<int32_t>(header, static_cast<int32_t>(value.size()));
+    header.insert(header.end(), value.begin(), value.end());
+  };
+
+  std::vector<uint8_t> window;
+  putLittleEndian<int32_t>(window, 0);
+  putLittleEndian<int32_t>(window, 0);
+  putLittleEndian<int32_t>(window, static_cast<int32_t>(width) - 1);
+  putLittleEndian<int32_t>(window, static_cast<int32_t>(height) - 1);
+  std::vector<uint8_t> one;
+  putLittleEndian<float>(one, 1.0f);
+  std::vector<uint8_t> center;
+  putLittleEndian<float>(center, 0.0f);
+  putLittleEndian<float>(center, 0.0f);
+
+  attribute("channels", "chlist", channels);
+  attribute("compression", "compression", { 0 });
+  attribute("dataWindow", "box2i", window);
+  attribute("displayWindow", "box2i", window);
+  attribute("lineOrder", "lineOrder", { 0 });
+  attribute("pixelAspectRatio", "float", one);
+  attribute("screenWindowCenter", "v2f", center);
+  attribute("screenWindowWidth", "float", one);
+  header.push_back(0);
+
+  // Uncompressed blocks hold one scanline each and all have the same size, so the offset table is known up front
+  const size_t channelSize = halfFloat ? sizeof(uint16_t) : sizeof(float);
+  const size_t blockSize = 8 + static_cast<size_t>(width) * 3 * channelSize;
+  const uint64_t firstBlock = header.size() + static_cast<uint64_t>(height) * sizeof(uint64_t);
+  for (uint32_t y = 0; y < height; ++y)
+    putLittleEndian<uint64_t>(header, firstBlock + y * blockSize);
+  file.write(reinterpret_cast<const char*>(header.data()), header.size());
+
+  block.reserve(blockSize);
+}
+
+void ExrWriter::writeRow(const float* rgba, uint32_t y)
+{
+  block.clear();
+  putLittleEndian<int32_t>(block, static_cast<int32_t>(y));
+  putLittleEndian<int32_t>(block, static_cast<int32_t>(width * 3 * (halfFloat ? sizeof(uint16_t) : sizeof(float))));
+  for (int channel : { 2, 1, 0 })
+  {
+    for (uint32_t x = 0; x < width; ++x)
+    {
+      if (halfFloat)
+        putLittleEndian<uint16_t>(block, floatToHalf(rgba[x * 4 + channel]));
+      else
+        putLittleEndian<float>(block, rgba[x * 4 + channel]);
+    }
+  }
+  file.write(reinterpret_cast<const char*>(block.data()), block.size());
+}
+
+void PfmWriter::writeHeader()
+{
+  // A negative scale marks little-endian data
+  const std::string header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+  file.write(header.data(), header.size());
+  dataOffset = static_cast<std::streamoff>(header.size());
+  row.resize(static_cast<size_t>(width) * 3);
+}
+
+void PfmWriter::writeRow(const float* rgba, uint32_t y)
+{
+  for (uint32_t x = 0; x < width; ++x)
+  {
+    row[x * 3] = rgba[x * 4];
+    row[x * 3 + 1] = rgba[x * 4 + 1];
+    row[x * 3 + 2] = rgba[x * 4 + 2];
+  }
+  const std::streamoff rowSize = static_cast<std::streamoff>(row.size() * sizeof(float));
+  file.seekp(dataOffset + static_cast<std::streamoff>(height - 1 - y) * rowSize);
+  file.write(reinterpret_cast<const char*>(row.data()), rowSize);
+}
@@ -0,0 +1,229 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+#include <utility>
+
+#include <glm/glm.hpp>
+
+// Scalar ray-primitive tests for host side tracing and tools. Templated on the scalar type, so the double
+// instantiations serve as the reference the float and SIMD versions are checked against.
+// Every test takes the current closest distance in t and only reports (and stores) hits in (tMin, t)
+namespace intersection
+{
+  template <typename T> using Vec3 = glm::vec<3, T, glm::defaultp>;
+
+  template <typename T>
+  struct Ray
+  {
+    Vec3<T> origin;
+    Vec3<T> direction;
+  };
+
+  // Moeller-Trumbore: one cross product per ray and triangle, but rays through a shared edge can miss
+  // both triangles, the barycentric tests of the two sides are not evaluated consistently
+  template <typename T>
+  bool rayTriangleMollerTrumbore(const Ray<T>& ray, const Vec3<T>& v0, const Vec3<T>& v1, const Vec3<T>& v2, T tMin, T& t)
+  {
+    const Vec3<T> e1 = v1 - v0;
+    const Vec3<T> e2 = v2 - v0;
+    const Vec3<T> pvec = glm::cross(ray.direction, e2);
+    const T det = glm::dot(e1, pvec);
+    if (det == T(0))
+      return false;
+
+    const T invDet = T(1) / det;
+    const Vec3<T> tvec = ray.origin - v0;
+    const T u = glm::dot(tvec, pvec) * invDet;
+    if (u < T(0) || u > T(1))
+      return false;
+    const Vec3<T> qvec = glm::cross(tvec, e1);
+    const T v = glm::dot(ray.direction, qvec) * invDet;
+    if (v < T(0) || u + v > T(1))
+      return false;
+    const T tHit = glm::dot(e2, qvec) * invDet;
+    if (tHit <= tMin || tHit >= t)
+      return false;
+    t = tHit;
+    return true;
+  }
+
+  // Ray dependent part of the watertight test: the axes permuted so z is the dominant direction and the shear
+  // that maps the direction onto +z
+  template <typename T>
+  struct WatertightRay
+  {
+    explicit WatertightRay(const Ray<T>& ray) : origin(ray.origin)
+    {
+      const Vec3<T> absDirection = glm::abs(ray.direction);
+      kz = absDirection.x > absDirection.y ? (absDirection.x > absDirection.z ? 0 : 2) : (absDirection.y > absDirection.z ? 1 : 2);
+      kx = kz == 2 ? 0 : kz + 1;
+      ky = kx == 2 ? 0 : kx + 1;
+      // Keeps the winding, so the signs of U, V, W don't depend on the direction
+      if (ray.direction[kz] < T(0))
+        std::swap(kx, ky);
+      shear = Vec3<T>(ray.direction[kx] / ray.direction[kz], ray.direction[ky] / ray.direction[kz], T(1) / ray.direction[kz]);
+    }
+
+    Vec3<T> origin;
+    Vec3<T> shear;
+    int kx, ky, kz;
+  };
+
+  // Watertight test of Woop, Benthin and Wald (JCGT 2013). The edge functions are evaluated in the sheared
+  // ray space, where a shared edge gives the same values with opposite signs on both triangles, and are
+  // recomputed in double when one of them is exactly zero. Rays can't leak through edges or vertices.
+  // On a hit the weights of v0, v1 and v2 go to barycentrics when given
+  template <typename T>
+  bool rayTriangleWatertight(const WatertightRay<T>& ray, const Vec3<T>& v0, const Vec3<T>& v1, const Vec3<T>& v2, T tMin, T& t,
+    Vec3<T>* barycentrics = nullptr)
+  {
+    const Vec3<T> a = v0 - ray.origin;
+    const Vec3<T> b = v1 - ray.origin;
+    const Vec3<T> c = v2 - ray.origin;
+    const T ax = a[ray.kx] - ray.shear.x * a[ray.kz];
+    const T ay = a[ray.ky] - ray.shear.y * a[ray.kz];
+    const T bx = b[ray.kx] - ray.shear.x * b[ray.kz];
+    const T by = b[ray.ky] - ray.shear.y * b[ray.kz];
+    const T cx = c[ray.kx] - ray.shear.x * c[ray.kz];
+    const T cy = c[ray.ky] - ray.shear.y * c[ray.kz];
+
+    T u = cx * by - cy * bx;
+    T v = ax * cy - ay * cx;
+    T w = bx * ay - by * ax;
+    if constexpr (std::is_same_v<T, float>)
+    {
+      if (u == 0.0f || v == 0.0f || w == 0.0f)
+      {
+        u = static_cast<float>(static_cast<double>(cx) * by - static_cast<double>(cy) * bx);
+        v = static_cast<float>(static_cast<double>(ax) * cy - static_cast<double>(ay) * cx);
+        w = static_cast<float>(static_cast<double>(bx) * ay - static_cast<double>(by) * ax);
+      }
+    }
+    if ((u < T(0) || v < T(0) || w < T(0)) && (u > T(0) || v > T(0) || w > T(0)))
+      return false;
+    const T det = u + v + w;
+    if (det == T(0))
+      return false;
+
+    // Distance scaled by det, compared before the division
+    const T az = ray.shear.z * a[ray.kz];
+    const T bz = ray.shear.z * b[ray.kz];
+    const T cz = ray.shear.z * c[ray.kz];
+    const T tScaled = u * az + v * bz + w * cz;
+    const T absDet = std::abs(det);
+    const T absT = det < T(0) ? -tScaled : tScaled;
+    if (absT <= tMin * absDet || absT >= t * absDet)
+      return false;
+    const T invDet = T(1) / det;
+    t = tScaled * invDet;
+    if (barycentrics)
+      *barycentrics = Vec3<T>(u * invDet, v * invDet, w * invDet);
+    return true;
+  }
+
+  // The quadratic of shaders/spheres.rint: b^2 - 4ac cancels catastrophically for small spheres far away
+  // and -b + sqrt(disc) for the far root cancels when the ray starts close to the sphere
+  template <typename T>
+  bool raySphereQuadratic(const Ray<T>& ray, const Vec3<T>& center, T radius, T tMin, T& t)
+  {
+    const Vec3<T> oc = ray.origin - center;
+    const T a = glm::dot(ray.direction, ray.direction);
+    const T b = T(2) * glm::dot(oc, ray.direction);
+    const T c = glm::dot(oc, oc) - radius * radius;
+    const T discriminant = b * b - T(4) * a * c;
+    if (discriminant < T(0))
+      return false;
+
+    const T root = std::sqrt(discriminant);
+    T tHit = (-b - root) / (T(2) * a);
+    if (tHit <= tMin)
+      tHit = (-b + root) / (T(2) * a);
+    if (tHit <= tMin || tHit >= t)
+      return false;
+    t = tHit;
+    return true;
+  }
+
+  // Numerically stable form from Ray Tracing Gems, chapter 7: the discriminant comes from the distance of
+  // the sphere center to the ray, and the two roots are formed without subtracting nearly equal values
+  template <typename T>
+  bool raySphereStable(const Ray<T>& ray, const Vec3<T>& center, T radius, T tMin, T& t)
+  {
+    const Vec3<T> f = ray.origin - center;
+    const T a = glm::dot(ray.direction, ray.direction);
+    const T b = -glm::dot(f, ray.direction);
+    const Vec3<T> l = f + (b / a) * ray.direction;
+    const T discriminant = radius * radius - glm::dot(l, l);
+    if (discriminant < T(0))
+      return false;
+
+    const T c = glm::dot(f, f) - radius * radius;
+    const T q = b + std::copysign(std::sqrt(a * discriminant), b);
+    T t0 = c / q;
+    T t1 = q / a;
+    if (t0 > t1)
+      std::swap(t0, t1);
+    const T tHit = t0 > tMin ? t0 : t1;
+    if (tHit <= tMin || tHit >= t)
+      return false;
+    t = tHit;
+    return true;
+  }
+
+  // Kay-Kajiya slabs with min/max per axis. Reports the entry distance, or tMin when the origin is inside
+  template <typename T>
+  bool rayAabbSlab(const Ray<T>& ray, const Vec3<T>& invDirection, const Vec3<T>& lo, const Vec3<T>& hi, T tMin, T& t)
+  {
+    T tNear = tMin;
+    T tFar = t;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      const T t0 = (lo[axis] - ray.origin[axis]) * invDirection[axis];
+      const T t1 = (hi[axis] - ray.origin[axis]) * invDirection[axis];
+      tNear = std::max(tNear, std::min(t0, t1));
+      tFar = std::min(tFar, std::max(t0, t1));
+    }
+    if (tNear > tFar)
+      return false;
+    t = tNear;
+    return true;
+  }
+
+  // Slabs with the near and far planes picked by the direction signs (Williams et al. 2005), no min/max of the
+  // plane distances. The far distance is widened by 2 gamma(3) (Ize 2013), so rounding can't cull a box the ray
+  // grazes, which the BVH traversal relies on
+  template <typename T>
+  bool rayAabbSlabRobust(const Ray<T>& ray, const Vec3<T>& invDirection, const Vec3<T>& lo, const Vec3<T>& hi, T tMin, T& t)
+  {
+    constexpr T epsilon = std::numeric_limits<T>::epsilon() / 2;
+    constexpr T farScale = T(1) + T(2) * (3 * epsilon) / (T(1) - 3 * epsilon);
+    T tNear = tMin;
+    T tFar = t;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      const bool negative = invDirection[axis] < T(0);
+      const T nearPlane = negative ? hi[axis] : lo[axis];
+      const T farPlane = negative ? lo[axis] : hi[axis];
+      tNear = std::max(tNear, (nearPlane - ray.origin[axis]) * invDirection[axis]);
+      tFar = std::min(tFar, (farPlane - ray.origin[axis]) * invDirection[axis] * farScale);
+    }
+    if (tNear > tFar)
+      return false;
+    t = tNear;
+    return true;
+  }
+
+  // Host side of shaders/rayoffset.glsl, with the GLSL builtins it uses. Secondary rays start at
+  // offsetRayOrigin(hit point, geometric normal facing the new direction) and tMin 0
+  using vec3 = glm::vec3;
+  using std::abs;
+  inline int floatBitsToInt(float x) { return std::bit_cast<int>(x); }
+  inline float intBitsToFloat(int x) { return std::bit_cast<float>(x); }
+
+#define SHARED_FUNC inline
+#include "shaders/rayoffset.glsl"
+#undef SHARED_FUNC
+}
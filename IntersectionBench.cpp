@@ -0,0 +1,422 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include <Intersection.h>
+#include <IntersectionBench.h>
+
+
+// Times the intersection kernels of Intersection.h (scalar) and IntersectionSimd.h (SSE2, AVX2) on random
+// rays and primitives and reports nanoseconds per ray-primitive test. Every version is checked against the
+// double precision reference first, the exit code is nonzero when one disagrees on too many hits or when
+// a ray leaving a triangle from offsetRayOrigin hits the triangle again
+using namespace intersection;
+using bench::Kernel;
+
+namespace
+{
+  // Hits the reference reports and a kernel doesn't, or the other way around
+  constexpr double maxMismatchRate = 1e-3;
+  // Median relative error of the hit distances both report
+  constexpr double maxMedianError = 1e-5;
+
+  constexpr float tMin = 1e-4f;
+  constexpr float tMax = 1e30f;
+
+  struct KernelInfo
+  {
+    Kernel kernel;
+    const char* name;
+  };
+
+  const KernelInfo kernels[] = {
+    { Kernel::TriangleMollerTrumbore, "triangle Moeller-Trumbore" },
+    { Kernel::TriangleWatertight, "triangle watertight" },
+    { Kernel::SphereQuadratic, "sphere quadratic" },
+    { Kernel::SphereStable, "sphere stable" },
+    { Kernel::BoxSlab, "box slab" },
+    { Kernel::BoxSlabRobust, "box slab robust" },
+  };
+
+  enum class Version
+  {
+    Scalar,
+    Sse2,
+    Avx2,
+  };
+
+  const char* versionNames[] = { "scalar", "SSE2", "AVX2" };
+
+  struct alignas(32) Block
+  {
+    float lanes[simd::batchAlignment];
+  };
+
+  // Component arrays of one primitive type, each 32 byte aligned
+  class SoaArrays
+  {
+  public:
+    SoaArrays(size_t components, size_t count) : blocksPerComponent(count / simd::batchAlignment), blocks(components * blocksPerComponent) {}
+    float* operator[](size_t component) { return blocks[component * blocksPerComponent].lanes; }
+
+  private:
+    size_t blocksPerComponent;
+    std::vector<Block> blocks;
+  };
+
+  struct Scene
+  {
+    explicit Scene(size_t count) : count(count), triangles(9, count), spheres(4, count), boxes(6, count)
+    {
+      std::mt19937 rng(1);
+      std::uniform_real_distribution<float> position(-1.0f, 1.0f);
+      std::uniform_real_distribution<float> offset(-0.25f, 0.25f);
+      std::uniform_real_distribution<float> size(0.01f, 0.2f);
+      for (size_t i = 0; i < count; ++i)
+      {
+        const float center[3] = { position(rng), position(rng), position(rng) };
+        for (size_t vertex = 0; vertex < 3; ++vertex)
+        {
+          for (size_t axis = 0; axis < 3; ++axis)
+            triangles[vertex * 3 + axis][i] = center[axis] + offset(rng);
+        }
+
+        for (size_t axis = 0; axis < 3; ++axis)
+          spheres[axis][i] = position(rng);
+        spheres[3][i] = size(rng);
+
+        for (size_t axis = 0; axis < 3; ++axis)
+        {
+          const float boxCenter = position(rng);
+          const float halfExtent = size(rng);
+          boxes[axis][i] = boxCenter - halfExtent;
+          boxes[3 + axis][i] = boxCenter + halfExtent;
+        }
+      }
+
+      batches.triangles.count = batches.spheres.count = batches.boxes.count = count;
+      for (size_t axis = 0; axis < 3; ++axis)
+      {
+        for (size_t vertex = 0; vertex < 3; ++vertex)
+          batches.triangles.vertices[vertex][axis] = triangles[vertex * 3 + axis];
+        batches.spheres.center[axis] = spheres[axis];
+        batches.boxes.lo[axis] = boxes[axis];
+        batches.boxes.hi[axis] = boxes[3 + axis];
+      }
+      batches.spheres.radius = spheres[3];
+    }
+
+    template <typename T>
+    Vec3<T> vertex(size_t vertex, size_t i) const
+    {
+      const auto& v = batches.triangles.vertices[vertex];
+      return Vec3<T>(v[0][i], v[1][i], v[2][i]);
+    }
+
+    template <typename T>
+    Vec3<T> component(const float* const* arrays, size_t i) const
+    {
+      return Vec3<T>(arrays[0][i], arrays[1][i], arrays[2][i]);
+    }
+
+    size_t count;
+    SoaArrays triangles;
+    SoaArrays spheres;
+    SoaArrays boxes;
+    bench::Batches batches;
+  };
+
+  // Origins on a sphere around the primitives, aimed at random points among them
+  std::vector<simd::PackedRay> generateRays(size_t count, uint32_t seed)
+  {
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> gaussian;
+    std::uniform_real_distribution<float> position(-1.0f, 1.0f);
+    std::vector<simd::PackedRay> rays(count);
+    for (simd::PackedRay& packed : rays)
+    {
+      Ray<float> ray;
+      ray.origin = glm::normalize(Vec3<float>(gaussian(rng), gaussian(rng), gaussian(rng))) * 3.0f;
+      ray.direction = glm::normalize(Vec3<float>(position(rng), position(rng), position(rng)) - ray.origin);
+      const WatertightRay<float> watertight(ray);
+      for (int axis = 0; axis < 3; ++axis)
+      {
+        packed.origin[axis] = ray.origin[axis];
+        packed.direction[axis] = ray.direction[axis];
+        packed.invDirection[axis] = 1.0f / ray.direction[axis];
+        packed.shear[axis] = watertight.shear[axis];
+      }
+      packed.kx = watertight.kx;
+      packed.ky = watertight.ky;
+      packed.kz = watertight.kz;
+    }
+    return rays;
+  }
+
+  template <typename T>
+  Ray<T> unpack(const simd::PackedRay& packed)
+  {
+    Ray<T> ray;
+    ray.origin = Vec3<T>(packed.origin[0], packed.origin[1], packed.origin[2]);
+    ray.direction = Vec3<T>(packed.direction[0], packed.direction[1], packed.direction[2]);
+    return ray;
+  }
+
+  // The scalar tests of Intersection.h over the same batches, T = double is the reference
+  template <typename T>
+  void intersectRaysScalar(Kernel kernel, const simd::PackedRay* rays, size_t rayCount, const Scene& scene, T* t, size_t tStride)
+  {
+    const bench::Batches& batches = scene.batches;
+    for (size_t r = 0; r < rayCount; ++r)
+    {
+      const Ray<T> ray = unpack<T>(rays[r]);
+      const WatertightRay<T> watertight(ray);
+      const Vec3<T> invDirection = T(1) / ray.direction;
+      T* rayT = t + r * tStride;
+      for (size_t i = 0; i < scene.count; ++i)
+      {
+        T tHit = T(tMax);
+        bool hit = false;
+        switch (kernel)
+        {
+        case Kernel::TriangleMollerTrumbore:
+          hit = rayTriangleMollerTrumbore(ray, scene.vertex<T>(0, i), scene.vertex<T>(1, i), scene.vertex<T>(2, i), T(tMin), tHit);
+          break;
+        case Kernel::TriangleWatertight:
+          hit = rayTriangleWatertight(watertight, scene.vertex<T>(0, i), scene.vertex<T>(1, i), scene.vertex<T>(2, i), T(tMin), tHit);
+          break;
+        case Kernel::SphereQuadratic:
+          hit = raySphereQuadratic(ray, scene.component<T>(batches.spheres.center, i), T(batches.spheres.radius[i]), T(tMin), tHit);
+          break;
+        case Kernel::SphereStable:
+          hit = raySphereStable(ray, scene.component<T>(batches.spheres.center, i), T(batches.spheres.radius[i]), T(tMin), tHit);
+          break;
+        case Kernel::BoxSlab:
+          hit = rayAabbSlab(ray, invDirection, scene.component<T>(batches.boxes.lo, i), scene.component<T>(batches.boxes.hi, i), T(tMin), tHit);
+          break;
+        case Kernel::BoxSlabRobust:
+          hit = rayAabbSlabRobust(ray, invDirection, scene.component<T>(batches.boxes.lo, i), scene.component<T>(batches.boxes.hi, i), T(tMin), tHit);
+          break;
+        }
+        rayT[i] = hit ? tHit : std::numeric_limits<T>::infinity();
+      }
+    }
+  }
+
+  // The reference of every kernel is its exact counterpart: watertight triangles, the stable sphere form and plain slabs
+  Kernel referenceKernel(Kernel kernel)
+  {
+    switch (kernel)
+    {
+    case Kernel::TriangleMollerTrumbore:
+    case Kernel::TriangleWatertight:
+      return Kernel::TriangleWatertight;
+    case Kernel::SphereQuadratic:
+    case Kernel::SphereStable:
+      return Kernel::SphereStable;
+    default:
+      return Kernel::BoxSlab;
+    }
+  }
+
+  bool cpuHasAvx2()
+  {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool fma = (info[2] & (1 << 12)) != 0;
+    if (!osxsave || !fma || (_xgetbv(0) & 6) != 6)
+      return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#elif defined(__GNUC__)
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+    return false;
+#endif
+  }
+
+  bool run(Version version, Kernel kernel, const simd::PackedRay* rays, size_t rayCount, const Scene& scene, float* t, size_t tStride)
+  {
+    switch (version)
+    {
+    case Version::Scalar:
+      intersectRaysScalar<float>(kernel, rays, rayCount, scene, t, tStride);
+      return true;
+    case Version::Sse2:
+      bench::intersectRays<simd::Sse2Lanes>(kernel, rays, rayCount, scene.batches, tMin, tMax, t, tStride);
+      return true;
+    case Version::Avx2:
+      return bench::intersectRaysAvx2(kernel, rays, rayCount, scene.batches, tMin, tMax, t, tStride);
+    }
+    return false;
+  }
+
+  // Rays leaving a random point of every triangle to the side of its normal that hit the triangle again
+  struct SelfHits
+  {
+    size_t atPoint = 0;
+    size_t withEps = 0;
+    size_t withOffset = 0;
+  };
+
+  // The scene moved by translation in every axis, far from the origin a fixed tMin stops being enough
+  SelfHits countSelfHits(const Scene& scene, float translation, uint32_t seed)
+  {
+    // EPS of shaders/raycommon.glsl, the tMin the shadow rays used before the offset
+    constexpr float eps = 0.001f;
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> barycentric(0.0f, 1.0f);
+    std::normal_distribution<float> gaussian;
+    const Vec3<float> shift(translation, translation, translation);
+    SelfHits selfHits;
+    for (size_t i = 0; i < scene.count; ++i)
+    {
+      const Vec3<float> v0 = scene.vertex<float>(0, i) + shift;
+      const Vec3<float> v1 = scene.vertex<float>(1, i) + shift;
+      const Vec3<float> v2 = scene.vertex<float>(2, i) + shift;
+      float b1 = barycentric(rng);
+      float b2 = barycentric(rng);
+      if (b1 + b2 > 1.0f)
+      {
+        b1 = 1.0f - b1;
+        b2 = 1.0f - b2;
+      }
+      const Vec3<float> point = v0 * (1.0f - b1 - b2) + v1 * b1 + v2 * b2;
+      Vec3<float> normal = glm::normalize(glm::cross(v1 - v0, v2 - v0));
+      Vec3<float> direction = glm::normalize(Vec3<float>(gaussian(rng), gaussian(rng), gaussian(rng)));
+      if (glm::dot(direction, normal) < 0.0f)
+        normal = Vec3<float>(0.0f, 0.0f, 0.0f) - normal;
+
+      float t = tMax;
+      selfHits.atPoint += rayTriangleWatertight(WatertightRay<float>({ point, direction }), v0, v1, v2, 0.0f, t) ? 1 : 0;
+      t = tMax;
+      selfHits.withEps += rayTriangleWatertight(WatertightRay<float>({ point, direction }), v0, v1, v2, eps, t) ? 1 : 0;
+      t = tMax;
+      const Vec3<float> origin = offsetRayOrigin(point, normal);
+      selfHits.withOffset += rayTriangleWatertight(WatertightRay<float>({ origin, direction }), v0, v1, v2, 0.0f, t) ? 1 : 0;
+    }
+    return selfHits;
+  }
+
+  struct Agreement
+  {
+    size_t mismatches = 0;
+    size_t tests = 0;
+    double medianError = 0.0;
+    double maxError = 0.0;
+  };
+
+  Agreement compare(const std::vector<float>& t, const std::vector<double>& reference)
+  {
+    Agreement agreement;
+    agreement.tests = t.size();
+    std::vector<double> errors;
+    for (size_t i = 0; i < t.size(); ++i)
+    {
+      const bool hit = std::isfinite(t[i]);
+      const bool referenceHit = std::isfinite(reference[i]);
+      if (hit != referenceHit)
+        ++agreement.mismatches;
+      else if (hit)
+        errors.push_back(std::abs(t[i] - reference[i]) / std::max(std::abs(reference[i]), 1e-30));
+    }
+    if (!errors.empty())
+    {
+      std::nth_element(errors.begin(), errors.begin() + errors.size() / 2, errors.end());
+      agreement.medianError = errors[errors.size() / 2];
+      agreement.maxError = *std::max_element(errors.begin(), errors.end());
+    }
+    return agreement;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  size_t rayCount = 4096;
+  size_t primitiveCount = 1024;
+  size_t checkRayCount = 1024;
+  int repeats = 5;
+  for (int i = 1; i < argc; ++i)
+  {
+    const std::string arg = argv[i];
+    if (arg == "-rays" && i + 1 < argc)
+      rayCount = std::strtoul(argv[++i], nullptr, 10);
+    else if (arg == "-primitives" && i + 1 < argc)
+      primitiveCount = std::strtoul(argv[++i], nullptr, 10);
+    else if (arg == "-check-rays" && i + 1 < argc)
+      checkRayCount = std::strtoul(argv[++i], nullptr, 10);
+    else if (arg == "-repeats" && i + 1 < argc)
+      repeats = std::max(1, std::atoi(argv[++i]));
+    else
+    {
+      std::fprintf(stderr, "Usage: %s [-rays N] [-primitives N] [-check-rays N] [-repeats N]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  primitiveCount = std::max<size_t>(simd::batchAlignment, (primitiveCount + simd::batchAlignment - 1) / simd::batchAlignment * simd::batchAlignment);
+
+  const Scene scene(primitiveCount);
+  const std::vector<simd::PackedRay> rays = generateRays(rayCount, 2);
+  const std::vector<simd::PackedRay> checkRays = generateRays(checkRayCount, 3);
+
+  std::vector<Version> versions = { Version::Scalar, Version::Sse2 };
+  if (cpuHasAvx2() && bench::intersectRaysAvx2(Kernel::BoxSlab, checkRays.data(), 0, scene.batches, tMin, tMax, nullptr, 0))
+    versions.push_back(Version::Avx2);
+  else
+    std::printf("AVX2 skipped, not supported by the CPU or the build\n");
+
+  std::printf("%zu rays x %zu primitives, %zu rays checked against double precision\n\n", rayCount, primitiveCount, checkRayCount);
+  bool passed = true;
+  std::vector<float> t(checkRayCount * primitiveCount);
+  std::vector<double> reference(checkRayCount * primitiveCount);
+  for (const KernelInfo& info : kernels)
+  {
+    intersectRaysScalar<double>(referenceKernel(info.kernel), checkRays.data(), checkRayCount, scene, reference.data(), primitiveCount);
+    const size_t referenceHits = std::count_if(reference.begin(), reference.end(), [](double value) { return std::isfinite(value); });
+
+    std::printf("%s (%.2f%% hits)\n", info.name, 100.0 * referenceHits / std::max<size_t>(reference.size(), 1));
+    for (Version version : versions)
+    {
+      run(version, info.kernel, checkRays.data(), checkRayCount, scene, t.data(), primitiveCount);
+      const Agreement agreement = compare(t, reference);
+      const double mismatchRate = static_cast<double>(agreement.mismatches) / std::max<size_t>(agreement.tests, 1);
+      const bool agrees = mismatchRate <= maxMismatchRate && agreement.medianError <= maxMedianError;
+      passed = passed && agrees;
+
+      // Best of the repeats, results overwrite one row so the timing isn't about memory bandwidth
+      double best = 0.0;
+      for (int repeat = 0; repeat < repeats; ++repeat)
+      {
+        const auto start = std::chrono::steady_clock::now();
+        run(version, info.kernel, rays.data(), rayCount, scene, t.data(), 0);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        best = repeat == 0 ? seconds : std::min(best, seconds);
+      }
+      const double nsPerTest = best * 1e9 / (static_cast<double>(rayCount) * primitiveCount);
+
+      std::printf("  %-7s %7.3f ns/test  %zu mismatched hits, relative error median %.2e max %.2e%s\n", versionNames[static_cast<int>(version)],
+        nsPerTest, agreement.mismatches, agreement.medianError, agreement.maxError, agrees ? "" : "  FAILED");
+    }
+  }
+
+  // Offset origins may never hit their own triangle again, with or without tMin
+  std::printf("self-intersections of %zu rays leaving the triangles\n", primitiveCount);
+  for (float translation : { 0.0f, 100.0f, 10000.0f })
+  {
+    const SelfHits selfHits = countSelfHits(scene, translation, 4);
+    passed = passed && selfHits.withOffset == 0;
+    std::printf("  scene at %-7g tMin 0: %zu, tMin EPS: %zu, offsetRayOrigin: %zu%s\n", translation, selfHits.atPoint, selfHits.withEps,
+      selfHits.withOffset, selfHits.withOffset == 0 ? "" : "  FAILED");
+  }
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
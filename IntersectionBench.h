@@ -0,0 +1,62 @@
+#pragma once
+#include <IntersectionSimd.h>
+
+
+// Shared by the intersection benchmark and its AVX2 translation unit
+namespace intersection::bench
+{
+  enum class Kernel
+  {
+    TriangleMollerTrumbore,
+    TriangleWatertight,
+    SphereQuadratic,
+    SphereStable,
+    BoxSlab,
+    BoxSlabRobust,
+  };
+
+  struct Batches
+  {
+    simd::TriangleBatch triangles;
+    simd::SphereBatch spheres;
+    simd::BoxBatch boxes;
+  };
+
+  // Tests every ray against the kernel's batch, the results of ray r start at t + r * tStride.
+  // A stride of 0 overwrites the same results, which is what the timing runs do
+  template <typename Lanes>
+  void intersectRays(Kernel kernel, const simd::PackedRay* rays, size_t rayCount, const Batches& batches, float tMin, float tMax,
+    float* t, size_t tStride)
+  {
+    for (size_t r = 0; r < rayCount; ++r)
+    {
+      float* rayT = t + r * tStride;
+      switch (kernel)
+      {
+      case Kernel::TriangleMollerTrumbore:
+        simd::rayTrianglesMollerTrumbore<Lanes>(rays[r], batches.triangles, tMin, tMax, rayT);
+        break;
+      case Kernel::TriangleWatertight:
+        simd::rayTrianglesWatertight<Lanes>(rays[r], batches.triangles, tMin, tMax, rayT);
+        break;
+      case Kernel::SphereQuadratic:
+        simd::raySpheresQuadratic<Lanes>(rays[r], batches.spheres, tMin, tMax, rayT);
+        break;
+      case Kernel::SphereStable:
+        simd::raySpheresStable<Lanes>(rays[r], batches.spheres, tMin, tMax, rayT);
+        break;
+      case Kernel::BoxSlab:
+        simd::rayBoxesSlab<Lanes>(rays[r], batches.boxes, tMin, tMax, rayT);
+        break;
+      case Kernel::BoxSlabRobust:
+        simd::rayBoxesSlabRobust<Lanes>(rays[r], batches.boxes, tMin, tMax, rayT);
+        break;
+      }
+    }
+  }
+
+  // intersectRays with AVX2 lanes. Returns false when the benchmark was built without AVX2 support,
+  // the caller checks that the CPU has AVX2 and FMA
+  bool intersectRaysAvx2(Kernel kernel, const simd::PackedRay* rays, size_t rayCount, const Batches& batches, float tMin, float tMax,
+    float* t, size_t tStride);
+}
@@ -0,0 +1,15 @@
+// Compiled with AVX2 and FMA code generation, see CMakeLists.txt. Nothing in here may run before the
+// benchmark has checked the CPU, so this file only instantiates the AVX2 kernels
+#include <IntersectionBench.h>
+
+
+bool intersection::bench::intersectRaysAvx2(Kernel kernel, const simd::PackedRay* rays, size_t rayCount, const Batches& batches,
+  float tMin, float tMax, float* t, size_t tStride)
+{
+#ifdef __AVX2__
+  intersectRays<simd::Avx2Lanes>(kernel, rays, rayCount, batches, tMin, tMax, t, tStride);
+  return true;
+#else
+  return false;
+#endif
+}
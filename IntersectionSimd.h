@@ -0,0 +1,325 @@
+#pragma once
+#include <cstddef>
+#include <limits>
+
+#include <emmintrin.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+
+// SIMD versions of the tests in Intersection.h: one ray against a batch of primitives stored as structure of
+// arrays, Lanes::width primitives per step. The same templates build the SSE2 and the AVX2 kernels, the AVX2
+// lanes only exist in translation units compiled for AVX2. Batch arrays are 32 byte aligned and padded to a
+// multiple of 8, result arrays need no alignment.
+// Every kernel writes the hit distance in (tMin, tMax) per primitive, infinity for a miss
+namespace intersection::simd
+{
+  constexpr size_t batchAlignment = 8;
+
+  // A ray with everything the kernels precompute per ray, see WatertightRay for kx, ky, kz and shear
+  struct PackedRay
+  {
+    float origin[3];
+    float direction[3];
+    float invDirection[3];
+    float shear[3];
+    int kx, ky, kz;
+  };
+
+  // Component arrays indexed [vertex][axis]
+  struct TriangleBatch
+  {
+    const float* vertices[3][3];
+    size_t count;
+  };
+
+  struct SphereBatch
+  {
+    const float* center[3];
+    const float* radius;
+    size_t count;
+  };
+
+  struct BoxBatch
+  {
+    const float* lo[3];
+    const float* hi[3];
+    size_t count;
+  };
+
+  struct Sse2Lanes
+  {
+    using Float = __m128;
+    static constexpr size_t width = 4;
+
+    static Float load(const float* p) { return _mm_load_ps(p); }
+    static void store(float* p, Float a) { _mm_storeu_ps(p, a); }
+    static Float broadcast(float a) { return _mm_set1_ps(a); }
+    static Float add(Float a, Float b) { return _mm_add_ps(a, b); }
+    static Float sub(Float a, Float b) { return _mm_sub_ps(a, b); }
+    static Float mul(Float a, Float b) { return _mm_mul_ps(a, b); }
+    static Float div(Float a, Float b) { return _mm_div_ps(a, b); }
+    static Float min(Float a, Float b) { return _mm_min_ps(a, b); }
+    static Float max(Float a, Float b) { return _mm_max_ps(a, b); }
+    static Float sqrt(Float a) { return _mm_sqrt_ps(a); }
+    static Float less(Float a, Float b) { return _mm_cmplt_ps(a, b); }
+    static Float lessEqual(Float a, Float b) { return _mm_cmple_ps(a, b); }
+    static Float notEqual(Float a, Float b) { return _mm_cmpneq_ps(a, b); }
+    static Float bitAnd(Float a, Float b) { return _mm_and_ps(a, b); }
+    static Float bitOr(Float a, Float b) { return _mm_or_ps(a, b); }
+    static Float bitXor(Float a, Float b) { return _mm_xor_ps(a, b); }
+    static Float select(Float mask, Float a, Float b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+  };
+
+#ifdef __AVX2__
+  struct Avx2Lanes
+  {
+    using Float = __m256;
+    static constexpr size_t width = 8;
+
+    static Float load(const float* p) { return _mm256_load_ps(p); }
+    static void store(float* p, Float a) { _mm256_storeu_ps(p, a); }
+    static Float broadcast(float a) { return _mm256_set1_ps(a); }
+    static Float add(Float a, Float b) { return _mm256_add_ps(a, b); }
+    static Float sub(Float a, Float b) { return _mm256_sub_ps(a, b); }
+    static Float mul(Float a, Float b) { return _mm256_mul_ps(a, b); }
+    static Float div(Float a, Float b) { return _mm256_div_ps(a, b); }
+    static Float min(Float a, Float b) { return _mm256_min_ps(a, b); }
+    static Float max(Float a, Float b) { return _mm256_max_ps(a, b); }
+    static Float sqrt(Float a) { return _mm256_sqrt_ps(a); }
+    static Float less(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static Float lessEqual(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+    static Float notEqual(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_UQ); }
+    static Float bitAnd(Float a, Float b) { return _mm256_and_ps(a, b); }
+    static Float bitOr(Float a, Float b) { return _mm256_or_ps(a, b); }
+    static Float bitXor(Float a, Float b) { return _mm256_xor_ps(a, b); }
+    static Float select(Float mask, Float a, Float b) { return _mm256_blendv_ps(b, a, mask); }
+  };
+#endif
+
+  template <typename Lanes>
+  void rayTrianglesMollerTrumbore(const PackedRay& ray, const TriangleBatch& batch, float tMin, float tMax, float* t)
+  {
+    using L = Lanes;
+    const auto zero = L::broadcast(0.0f);
+    const auto one = L::broadcast(1.0f);
+    const auto lower = L::broadcast(tMin);
+    const auto upper = L::broadcast(tMax);
+    const auto miss = L::broadcast(std::numeric_limits<float>::infinity());
+    const auto dx = L::broadcast(ray.direction[0]);
+    const auto dy = L::broadcast(ray.direction[1]);
+    const auto dz = L::broadcast(ray.direction[2]);
+    for (size_t i = 0; i < batch.count; i += L::width)
+    {
+      const auto v0x = L::load(batch.vertices[0][0] + i);
+      const auto v0y = L::load(batch.vertices[0][1] + i);
+      const auto v0z = L::load(batch.vertices[0][2] + i);
+      const auto e1x = L::sub(L::load(batch.vertices[1][0] + i), v0x);
+      const auto e1y = L::sub(L::load(batch.vertices[1][1] + i), v0y);
+      const auto e1z = L::sub(L::load(batch.vertices[1][2] + i), v0z);
+      const auto e2x = L::sub(L::load(batch.vertices[2][0] + i), v0x);
+      const auto e2y = L::sub(L::load(batch.vertices[2][1] + i), v0y);
+      const auto e2z = L::sub(L::load(batch.vertices[2][2] + i), v0z);
+
+      const auto px = L::sub(L::mul(dy, e2z), L::mul(dz, e2y));
+      const auto py = L::sub(L::mul(dz, e2x), L::mul(dx, e2z));
+      const auto pz = L::sub(L::mul(dx, e2y), L::mul(dy, e2x));
+      const auto det = L::add(L::add(L::mul(e1x, px), L::mul(e1y, py)), L::mul(e1z, pz));
+      const auto invDet = L::div(one, det);
+
+      const auto tx = L::sub(L::broadcast(ray.origin[0]), v0x);
+      const auto ty = L::sub(L::broadcast(ray.origin[1]), v0y);
+      const auto tz = L::sub(L::broadcast(ray.origin[2]), v0z);
+      const auto u = L::mul(L::add(L::add(L::mul(tx, px), L::mul(ty, py)), L::mul(tz, pz)), invDet);
+      const auto qx = L::sub(L::mul(ty, e1z), L::mul(tz, e1y));
+      const auto qy = L::sub(L::mul(tz, e1x), L::mul(tx, e1z));
+      const auto qz = L::sub(L::mul(tx, e1y), L::mul(ty, e1x));
+      const auto v = L::mul(L::add(L::add(L::mul(dx, qx), L::mul(dy, qy)), L::mul(dz, qz)), invDet);
+      const auto tHit = L::mul(L::add(L::add(L::mul(e2x, qx), L::mul(e2y, qy)), L::mul(e2z, qz)), invDet);
+
+      auto hit = L::notEqual(det, zero);
+      hit = L::bitAnd(hit, L::bitAnd(L::lessEqual(zero, u), L::lessEqual(u, one)));
+      hit = L::bitAnd(hit, L::bitAnd(L::lessEqual(zero, v), L::lessEqual(L::add(u, v), one)));
+      hit = L::bitAnd(hit, L::bitAnd(L::less(lower, tHit), L::less(tHit, upper)));
+      L::store(t + i, L::select(hit, tHit, miss));
+    }
+  }
+
+  // Without the double precision fallback of the scalar version: edge functions that round to exactly zero
+  // count as on the edge, so a ray can hit both triangles sharing an edge but can't pass between them
+  template <typename Lanes>
+  void rayTrianglesWatertight(const PackedRay& ray, const TriangleBatch& batch, float tMin, float tMax, float* t)
+  {
+    using L = Lanes;
+    const auto zero = L::broadcast(0.0f);
+    const auto signBit = L::broadcast(-0.0f);
+    const auto lower = L::broadcast(tMin);
+    const auto upper = L::broadcast(tMax);
+    const auto miss = L::broadcast(std::numeric_limits<float>::infinity());
+    const auto sx = L::broadcast(ray.shear[0]);
+    const auto sy = L::broadcast(ray.shear[1]);
+    const auto sz = L::broadcast(ray.shear[2]);
+    const auto ox = L::broadcast(ray.origin[ray.kx]);
+    const auto oy = L::broadcast(ray.origin[ray.ky]);
+    const auto oz = L::broadcast(ray.origin[ray.kz]);
+    for (size_t i = 0; i < batch.count; i += L::width)
+    {
+      // The axis permutation is per ray, so it only selects which arrays are loaded
+      typename L::Float x[3], y[3], z[3];
+      for (int vertex = 0; vertex < 3; ++vertex)
+      {
+        z[vertex] = L::sub(L::load(batch.vertices[vertex][ray.kz] + i), oz);
+        x[vertex] = L::sub(L::sub(L::load(batch.vertices[vertex][ray.kx] + i), ox), L::mul(sx, z[vertex]));
+        y[vertex] = L::sub(L::sub(L::load(batch.vertices[vertex][ray.ky] + i), oy), L::mul(sy, z[vertex]));
+      }
+
+      const auto u = L::sub(L::mul(x[2], y[1]), L::mul(y[2], x[1]));
+      const auto v = L::sub(L::mul(x[0], y[2]), L::mul(y[0], x[2]));
+      const auto w = L::sub(L::mul(x[1], y[0]), L::mul(y[1], x[0]));
+      const auto anyNegative = L::bitOr(L::bitOr(L::less(u, zero), L::less(v, zero)), L::less(w, zero));
+      const auto anyPositive = L::bitOr(L::bitOr(L::less(zero, u), L::less(zero, v)), L::less(zero, w));
+      const auto det = L::add(L::add(u, v), w);
+
+      const auto tScaled = L::mul(sz, L::add(L::add(L::mul(u, z[0]), L::mul(v, z[1])), L::mul(w, z[2])));
+      const auto detSign = L::bitAnd(det, signBit);
+      const auto absDet = L::bitXor(det, detSign);
+      const auto absT = L::bitXor(tScaled, detSign);
+
+      // Edge functions of mixed signs miss, all zero is a degenerate det
+      auto hit = L::bitAnd(L::notEqual(det, zero), L::bitXor(anyNegative, anyPositive));
+      hit = L::bitAnd(hit, L::bitAnd(L::less(L::mul(lower, absDet), absT), L::less(absT, L::mul(upper, absDet))));
+      L::store(t + i, L::select(hit, L::div(tScaled, det), miss));
+    }
+  }
+
+  template <typename Lanes>
+  void raySpheresQuadratic(const PackedRay& ray, const SphereBatch& batch, float tMin, float tMax, float* t)
+  {
+    using L = Lanes;
+    const auto zero = L::broadcast(0.0f);
+    const auto lower = L::broadcast(tMin);
+    const auto upper = L::broadcast(tMax);
+    const auto miss = L::broadcast(std::numeric_limits<float>::infinity());
+    const auto dx = L::broadcast(ray.direction[0]);
+    const auto dy = L::broadcast(ray.direction[1]);
+    const auto dz = L::broadcast(ray.direction[2]);
+    const float a = ray.direction[0] * ray.direction[0] + ray.direction[1] * ray.direction[1] + ray.direction[2] * ray.direction[2];
+    const auto fourA = L::broadcast(4.0f * a);
+    const auto invTwoA = L::broadcast(1.0f / (2.0f * a));
+    for (size_t i = 0; i < batch.count; i += L::width)
+    {
+      const auto ocx = L::sub(L::broadcast(ray.origin[0]), L::load(batch.center[0] + i));
+      const auto ocy = L::sub(L::broadcast(ray.origin[1]), L::load(batch.center[1] + i));
+      const auto ocz = L::sub(L::broadcast(ray.origin[2]), L::load(batch.center[2] + i));
+      const auto radius = L::load(batch.radius + i);
+      const auto halfB = L::add(L::add(L::mul(ocx, dx), L::mul(ocy, dy)), L::mul(ocz, dz));
+      const auto b = L::add(halfB, halfB);
+      const auto c = L::sub(L::add(L::add(L::mul(ocx, ocx), L::mul(ocy, ocy)), L::mul(ocz, ocz)), L::mul(radius, radius));
+      const auto discriminant = L::sub(L::mul(b, b), L::mul(fourA, c));
+      const auto root = L::sqrt(L::max(discriminant, zero));
+
+      const auto t0 = L::mul(L::sub(L::sub(zero, b), root), invTwoA);
+      const auto t1 = L::mul(L::add(L::sub(zero, b), root), invTwoA);
+      const auto tHit = L::select(L::less(lower, t0), t0, t1);
+      auto hit = L::lessEqual(zero, discriminant);
+      hit = L::bitAnd(hit, L::bitAnd(L::less(lower, tHit), L::less(tHit, upper)));
+      L::store(t + i, L::select(hit, tHit, miss));
+    }
+  }
+
+  template <typename Lanes>
+  void raySpheresStable(const PackedRay& ray, const SphereBatch& batch, float tMin, float tMax, float* t)
+  {
+    using L = Lanes;
+    const auto zero = L::broadcast(0.0f);
+    const auto signBit = L::broadcast(-0.0f);
+    const auto lower = L::broadcast(tMin);
+    const auto upper = L::broadcast(tMax);
+    const auto miss = L::broadcast(std::numeric_limits<float>::infinity());
+    const auto dx = L::broadcast(ray.direction[0]);
+    const auto dy = L::broadcast(ray.direction[1]);
+    const auto dz = L::broadcast(ray.direction[2]);
+    const float a = ray.direction[0] * ray.direction[0] + ray.direction[1] * ray.direction[1] + ray.direction[2] * ray.direction[2];
+    const auto broadcastA = L::broadcast(a);
+    const auto invA = L::broadcast(1.0f / a);
+    for (size_t i = 0; i < batch.count; i += L::width)
+    {
+      const auto fx = L::sub(L::broadcast(ray.origin[0]), L::load(batch.center[0] + i));
+      const auto fy = L::sub(L::broadcast(ray.origin[1]), L::load(batch.center[1] + i));
+      const auto fz = L::sub(L::broadcast(ray.origin[2]), L::load(batch.center[2] + i));
+      const auto radiusSquared = L::mul(L::load(batch.radius + i), L::load(batch.radius + i));
+      const auto b = L::sub(zero, L::add(L::add(L::mul(fx, dx), L::mul(fy, dy)), L::mul(fz, dz)));
+      const auto scale = L::mul(b, invA);
+      const auto lx = L::add(fx, L::mul(scale, dx));
+      const auto ly = L::add(fy, L::mul(scale, dy));
+      const auto lz = L::add(fz, L::mul(scale, dz));
+      const auto discriminant = L::sub(radiusSquared, L::add(L::add(L::mul(lx, lx), L::mul(ly, ly)), L::mul(lz, lz)));
+
+      const auto c = L::sub(L::add(L::add(L::mul(fx, fx), L::mul(fy, fy)), L::mul(fz, fz)), radiusSquared);
+      const auto root = L::sqrt(L::mul(broadcastA, L::max(discriminant, zero)));
+      const auto q = L::add(b, L::bitOr(root, L::bitAnd(b, signBit)));
+      const auto t0 = L::div(c, q);
+      const auto t1 = L::mul(q, invA);
+      const auto tNear = L::min(t0, t1);
+      const auto tFar = L::max(t0, t1);
+      const auto tHit = L::select(L::less(lower, tNear), tNear, tFar);
+      auto hit = L::lessEqual(zero, discriminant);
+      hit = L::bitAnd(hit, L::bitAnd(L::less(lower, tHit), L::less(tHit, upper)));
+      L::store(t + i, L::select(hit, tHit, miss));
+    }
+  }
+
+  template <typename Lanes>
+  void rayBoxesSlab(const PackedRay& ray, const BoxBatch& batch, float tMin, float tMax, float* t)
+  {
+    using L = Lanes;
+    const auto miss = L::broadcast(std::numeric_limits<float>::infinity());
+    for (size_t i = 0; i < batch.count; i += L::width)
+    {
+      auto tNear = L::broadcast(tMin);
+      auto tFar = L::broadcast(tMax);
+      for (int axis = 0; axis < 3; ++axis)
+      {
+        const auto origin = L::broadcast(ray.origin[axis]);
+        const auto invDirection = L::broadcast(ray.invDirection[axis]);
+        const auto t0 = L::mul(L::sub(L::load(batch.lo[axis] + i), origin), invDirection);
+        const auto t1 = L::mul(L::sub(L::load(batch.hi[axis] + i), origin), invDirection);
+        tNear = L::max(tNear, L::min(t0, t1));
+        tFar = L::min(tFar, L::max(t0, t1));
+      }
+      L::store(t + i, L::select(L::lessEqual(tNear, tFar), tNear, miss));
+    }
+  }
+
+  // The direction signs are per ray, so picking the near and far planes only selects the arrays to load
+  template <typename Lanes>
+  void rayBoxesSlabRobust(const PackedRay& ray, const BoxBatch& batch, float tMin, float tMax, float* t)
+  {
+    using L = Lanes;
+    constexpr float epsilon = std::numeric_limits<float>::epsilon() / 2;
+    const auto farScale = L::broadcast(1.0f + 2.0f * (3 * epsilon) / (1.0f - 3 * epsilon));
+    const auto miss = L::broadcast(std::numeric_limits<float>::infinity());
+    const float* nearPlanes[3];
+    const float* farPlanes[3];
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      const bool negative = ray.invDirection[axis] < 0.0f;
+      nearPlanes[axis] = negative ? batch.hi[axis] : batch.lo[axis];
+      farPlanes[axis] = negative ? batch.lo[axis] : batch.hi[axis];
+    }
+    for (size_t i = 0; i < batch.count; i += L::width)
+    {
+      auto tNear = L::broadcast(tMin);
+      auto tFar = L::broadcast(tMax);
+      for (int axis = 0; axis < 3; ++axis)
+      {
+        const auto origin = L::broadcast(ray.origin[axis]);
+        const auto invDirection = L::broadcast(ray.invDirection[axis]);
+        tNear = L::max(tNear, L::mul(L::sub(L::load(nearPlanes[axis] + i), origin), invDirection));
+        tFar = L::min(tFar, L::mul(L::mul(L::sub(L::load(farPlanes[axis] + i), origin), invDirection), farScale));
+      }
+      L::store(t + i, L::select(L::lessEqual(tNear, tFar), tNear, miss));
+    }
+  }
+}
@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <MemoryTracker.h>
+
+
+namespace
+{
+  struct Usage
+  {
+    uint64_t current = 0;
+    uint64_t peak = 0;
+    uint32_t count = 0;
+
+    void add(uint64_t bytes)
+    {
+      current += bytes;
+      peak = std::max(peak, current);
+      ++count;
+    }
+
+    void remove(uint64_t bytes)
+    {
+      current -= bytes;
+      --count;
+    }
+  };
+
+  struct Allocation
+  {
+    std::string name;
+    uint64_t size;
+    bool hostVisible;
+  };
+
+  std::mutex trackerMutex;
+  std::unordered_map<VkDeviceMemory, Allocation> allocations;
+  std::unordered_map<VkBuffer, VkDeviceMemory> bufferMemory;
+  std::map<std::string, Usage> deviceByName;
+  Usage deviceTotal;
+  Usage deviceLocal;
+  Usage hostVisible;
+  std::map<std::string, uint64_t> hostByName;
+  Usage hostTotal;
+
+  std::string megabytes(uint64_t bytes)
+  {
+    char text[32];
+    std::snprintf(text, sizeof(text), "%.1f MB", bytes / (1024.0 * 1024.0));
+    return text;
+  }
+
+  void writeSummary(std::ostream& out)
+  {
+    out << "Device memory " << megabytes(deviceTotal.current) << " (peak " << megabytes(deviceTotal.peak) << "): device local "
+      << megabytes(deviceLocal.current) << " (peak " << megabytes(deviceLocal.peak) << "), host visible "
+      << megabytes(hostVisible.current) << " (peak " << megabytes(hostVisible.peak) << "). Host scene arrays "
+      << megabytes(hostTotal.current) << " (peak " << megabytes(hostTotal.peak) << ")" << std::endl;
+  }
+}
+
+void MemoryTracker::allocated(VkDeviceMemory memory, VkDeviceSize size, VkMemoryPropertyFlags properties, VkBuffer buffer, const std::string& name)
+{
+  std::lock_guard<std::mutex> lock(trackerMutex);
+  const bool isHostVisible = (properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0;
+  allocations[memory] = { name, size, isHostVisible };
+  if (buffer != VK_NULL_HANDLE)
+    bufferMemory[buffer] = memory;
+  deviceByName[name].add(size);
+  deviceTotal.add(size);
+  (isHostVisible ? hostVisible : deviceLocal).add(size);
+}
+
+void MemoryTracker::freed(VkDeviceMemory memory)
+{
+  std::lock_guard<std::mutex> lock(trackerMutex);
+  auto it = allocations.find(memory);
+  if (it == allocations.end())
+    return;
+
+  const Allocation& allocation = it->second;
+  deviceByName[allocation.name].remove(allocation.size);
+  deviceTotal.remove(allocation.size);
+  (allocation.hostVisible ? hostVisible : deviceLocal).remove(allocation.size);
+  std::erase_if(bufferMemory, [memory](const auto& entry) { return entry.second == memory; });
+  allocations.erase(it);
+}
+
+void MemoryTracker::nameBuffer(VkBuffer buffer, const std::string& name)
+{
+  std::lock_guard<std::mutex> lock(trackerMutex);
+  auto bound = bufferMemory.find(buffer);
+  if (bound == bufferMemory.end())
+    return;
+  Allocation& allocation = allocations.at(bound->second);
+  if (allocation.name == name)
+    return;
+
+  // Names are given right after allocation, a name left without allocations would only show a stale peak
+  Usage& previous = deviceByName[allocation.name];
+  previous.remove(allocation.size);
+  if (previous.count == 0)
+    deviceByName.erase(allocation.name);
+  allocation.name = name;
+  deviceByName[name].add(allocation.size);
+}
+
+void MemoryTracker::setHostBytes(const std::string& name, size_t bytes)
+{
+  std::lock_guard<std::mutex> lock(trackerMutex);
+  uint64_t& current = hostByName[name];
+  hostTotal.current = hostTotal.current - current + bytes;
+  hostTotal.peak = std::max(hostTotal.peak, hostTotal.current);
+  current = bytes;
+}
+
+void MemoryTracker::summary(std::ostream& out)
+{
+  std::lock_guard<std::mutex> lock(trackerMutex);
+  writeSummary(out);
+}
+
+void MemoryTracker::report(std::ostream& out)
+{
+  std::lock_guard<std::mutex> lock(trackerMutex);
+  writeSummary(out);
+
+  std::vector<std::pair<std::string, Usage>> device(deviceByName.begin(), deviceByName.end());
+  std::sort(device.begin(), device.end(), [](const auto& a, const auto& b) { return a.second.peak > b.second.peak; });
+  for (const auto& [name, usage] : device)
+  {
+    out << "  device " << name << ": " << megabytes(usage.current) << " in " << usage.count << " allocations (peak "
+      << megabytes(usage.peak) << ")" << std::endl;
+  }
+
+  std::vector<std::pair<std::string, uint64_t>> host(hostByName.begin(), hostByName.end());
+  std::sort(host.begin(), host.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+  for (const auto& [name, bytes] : host)
+  {
+    if (bytes > 0)
+      out << "  host " << name << ": " << megabytes(bytes) << std::endl;
+  }
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+#include "vulkan/vulkan.h"
+
+
+// Accounting of device memory by name and of the scene's host arrays, to find what fills the memory on big
+// scenes. Device allocations are recorded where they are allocated and freed, buffers get their names from
+// VulkanDebug::setBufferName. Current and peak bytes are kept per name, per memory kind and in total
+class MemoryTracker
+{
+public:
+  static void allocated(VkDeviceMemory memory, VkDeviceSize size, VkMemoryPropertyFlags properties,
+    VkBuffer buffer = VK_NULL_HANDLE, const std::string& name = "Unnamed");
+  static void freed(VkDeviceMemory memory);
+  // Names the allocation bound to the buffer, its peak is moved to the new name
+  static void nameBuffer(VkBuffer buffer, const std::string& name);
+  // Host arrays are reported with their current size, set again whenever it changes
+  static void setHostBytes(const std::string& name, size_t bytes);
+
+  // One line with the totals and peaks
+  static void summary(std::ostream& out);
+  // The totals followed by every name, largest first
+  static void report(std::ostream& out);
+};
@@ -1,6 +1,8 @@
 #ifndef PRIMITIVES_H
 #define PRIMITIVES_H
 
+#include <cstdint>
+
 #include <Transform.h>
 
 using namespace Transform;
@@ -77,4 +79,20 @@ struct QuadLight {
   alignas(16) vec4 color;
 };
 
+// Shader side data of a TLAS instance, indexed by gl_InstanceCustomIndexEXT. Must match shaders/raycommon.glsl
+struct MeshInstance {
+  uint32_t firstTriangle;   // first triangle of the instanced mesh in the index pool
+  uint32_t materialOffset;  // material of the first triangle in triangleMaterials
+  uint32_t materialStride;  // 1: a material per triangle, 0: one material for the whole instance
+  uint32_t padding = 0;
+};
+
+// One slot of the alias table used to pick a quad light proportionally to its power
+// (Vose's alias method, constant time per sample regardless of the number of lights)
+struct LightAliasEntry {
+  float probability;  // probability of keeping this slot instead of jumping to alias
+  uint32_t alias;
+  float pdf;          // selection probability of the light stored in this slot
+};
+
 #endif // PRIMITIVES_H
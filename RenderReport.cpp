@@ -0,0 +1,93 @@
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <glm/glm.hpp>
+#include <ImageWriter.h>
+#include <RenderReport.h>
+
+
+bool StopCriteria::parse(const std::vector<std::string>& args, size_t i)
+{
+  if (i + 1 >= args.size())
+    return false;
+  if (args[i] == "-time-budget")
+    timeBudget = std::atof(args[i + 1].c_str());
+  else if (args[i] == "-target-error")
+  {
+    targetError = static_cast<float>(std::atof(args[i + 1].c_str()));
+    stopAtTargetError = true;
+  }
+  else if (args[i] == "-spp")
+    maxSpp = static_cast<uint32_t>(std::atoi(args[i + 1].c_str()));
+  else if (args[i] == "-warmup")
+    warmupSpp = static_cast<uint32_t>(std::atoi(args[i + 1].c_str()));
+  else
+    return false;
+  return true;
+}
+
+uint32_t StopCriteria::warmupPasses(uint32_t lightsamples) const
+{
+  return std::max((warmupSpp + lightsamples - 1) / lightsamples, 2u);
+}
+
+void writeRenderReport(const std::string& filename, const std::string& image, uint32_t width, uint32_t height,
+  uint32_t lightsamples, const StopCriteria& stop, bool hasTarget, const RenderSummary& summary, const RayCounts* rays)
+{
+  std::ofstream report(filename);
+  if (!report)
+  {
+    std::cerr << "Could not write render report " << filename << std::endl;
+    return;
+  }
+  report << "{\n"
+    << "  \"image\": \"" << std::filesystem::path(image).filename().string() << "\",\n"
+    << "  \"width\": " << width << ",\n"
+    << "  \"height\": " << height << ",\n"
+    << "  \"passes\": " << summary.passes << ",\n"
+    << "  \"spp\": " << summary.passes * lightsamples << ",\n"
+    << "  \"meanSpp\": " << summary.meanSpp << ",\n"
+    << "  \"estimatedRelativeError\": " << (summary.error >= 0.0 ? std::to_string(summary.error) : "null") << ",\n"
+    << "  \"targetError\": " << (hasTarget ? std::to_string(stop.targetError) : "null") << ",\n"
+    << "  \"timeBudgetSeconds\": " << (stop.timeBudget > 0.0 ? std::to_string(stop.timeBudget) : "null") << ",\n"
+    << "  \"renderSeconds\": " << summary.seconds << ",\n";
+  if (rays)
+  {
+    report << "  \"rays\": { \"primary\": " << rays->primaryRays << ", \"secondary\": " << rays->secondaryRays
+      << ", \"shadow\": " << rays->shadowRays << ", \"occludedShadow\": " << rays->occludedShadowRays
+      << ", \"hits\": " << rays->hits << ", \"misses\": " << rays->misses << " },\n";
+  }
+  report << "  \"stopReason\": \"" << summary.stopReason << "\"\n"
+    << "}\n";
+}
+
+uint32_t writeHeatmap(const std::string& filename, const uint32_t* counts, uint32_t width, uint32_t height)
+{
+  const size_t pixelsNum = static_cast<size_t>(width) * height;
+  const uint32_t maxCount = std::max(*std::max_element(counts, counts + pixelsNum), 1u);
+
+  // Blue, cyan, green, yellow, red
+  const std::array<glm::vec3, 5> colors = { {
+    { 0.0f, 0.0f, 1.0f }, { 0.0f, 1.0f, 1.0f }, { 0.0f, 1.0f, 0.0f }, { 1.0f, 1.0f, 0.0f }, { 1.0f, 0.0f, 0.0f }
+  } };
+  std::vector<float> rgba(pixelsNum * 4);
+  for (size_t i = 0; i < pixelsNum; ++i)
+  {
+    const float t = static_cast<float>(counts[i]) / maxCount * (colors.size() - 1);
+    const size_t segment = std::min(static_cast<size_t>(t), colors.size() - 2);
+    const glm::vec3 color = glm::mix(colors[segment], colors[segment + 1], t - segment);
+    rgba[i * 4 + 0] = color.r;
+    rgba[i * 4 + 1] = color.g;
+    rgba[i * 4 + 2] = color.b;
+    rgba[i * 4 + 3] = 1.0f;
+  }
+
+  std::unique_ptr<ImageWriter> writer = ImageWriter::create(filename);
+  writer->open(filename, width, height);
+  writer->writeRows(rgba.data(), height);
+  writer->close();
+  return maxCount;
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+// When batch rendering stops adding passes. The Vulkan headless path and the CPU renderer read the same flags:
+// -time-budget <seconds>, -target-error <error>, -spp <samples> and -warmup <samples>
+struct StopCriteria
+{
+  // No pass is started that would end past it (0 = no limit)
+  double timeBudget = 0.0;
+  // Relative standard error of the pixel mean at which a pixel counts as converged
+  float targetError = 0.01f;
+  // Stops once the mean error of the image is below targetError
+  bool stopAtTargetError = false;
+  // Samples per pixel (0 = no limit)
+  uint32_t maxSpp = 0;
+  // Samples every pixel traces before its error estimate is trusted
+  uint32_t warmupSpp = 16;
+
+  // Reads args[i] and its value when it is one of the flags above
+  bool parse(const std::vector<std::string>& args, size_t i);
+
+  bool limited() const { return timeBudget > 0.0 || stopAtTargetError || maxSpp > 0; }
+  // At least two, a single pass has no variance
+  uint32_t warmupPasses(uint32_t lightsamples) const;
+};
+
+// State of the accumulation after a pass
+struct PassProgress
+{
+  uint32_t passes = 0;
+  uint32_t lightsamples = 1;
+  double passSeconds = 0.0;
+  double elapsedSeconds = 0.0;
+  // Adaptive sampling goes on until every pixel converged
+  bool adaptive = false;
+  bool converged = false;
+};
+
+// Why accumulation stops after the pass, empty to add another one. error() is only evaluated past the warmup
+template <typename Error>
+std::string stopReason(const StopCriteria& stop, const PassProgress& progress, Error&& error)
+{
+  if (progress.converged)
+    return "converged";
+  if (stop.stopAtTargetError && progress.passes >= stop.warmupPasses(progress.lightsamples) && error() <= stop.targetError)
+    return "target-error";
+  if (stop.timeBudget > 0.0 && progress.elapsedSeconds + progress.passSeconds > stop.timeBudget)
+    return "time-budget";
+  if (stop.maxSpp > 0 && progress.passes * progress.lightsamples >= stop.maxSpp)
+    return "spp";
+  if (!stop.limited() && !progress.adaptive)
+    return "single-pass";
+  return {};
+}
+
+// Outcome of a headless render, written to the sidecar JSON
+struct RenderSummary
+{
+  // Passes of the pixels that got the most
+  uint32_t passes = 0;
+  double meanSpp = 0.0;
+  // Mean relative error of the pixel means, negative when nothing was accumulated
+  double error = -1.0;
+  double seconds = 0.0;
+  std::string stopReason;
+};
+
+// Rays traced over the passes of a render
+struct RayCounts
+{
+  uint64_t primaryRays = 0;
+  uint64_t secondaryRays = 0;
+  uint64_t shadowRays = 0;
+  uint64_t occludedShadowRays = 0;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+};
+
+// Sidecar JSON next to the saved image for the job scheduler. rays is written when ray statistics were gathered
+void writeRenderReport(const std::string& filename, const std::string& image, uint32_t width, uint32_t height,
+  uint32_t lightsamples, const StopCriteria& stop, bool hasTarget, const RenderSummary& summary, const RayCounts* rays);
+
+// Per pixel counts as a color ramp from blue over cyan, green and yellow to red at the largest count, which is returned
+uint32_t writeHeatmap(const std::string& filename, const uint32_t* counts, uint32_t width, uint32_t height);
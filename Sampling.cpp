@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <Sampling.h>
+#include <CpuProfiler.h>
+
+
+namespace sampling
+{
+  namespace
+  {
+    // Energy of a binary pattern: every set pixel splats a toroidal gaussian onto the field
+    class EnergyField
+    {
+    public:
+      EnergyField(uint size, float sigma) : size(size), filter(size * size), energy(size * size, 0.0f)
+      {
+        for (uint y = 0; y < size; ++y)
+        {
+          for (uint x = 0; x < size; ++x)
+          {
+            float dx = static_cast<float>(std::min(x, size - x));
+            float dy = static_cast<float>(std::min(y, size - y));
+            filter[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2.0f * sigma * sigma));
+          }
+        }
+      }
+
+      void splat(uint pixel, float sign)
+      {
+        uint px = pixel % size, py = pixel / size;
+        for (uint y = 0; y < size; ++y)
+        {
+          const float* row = &filter[((y + size - py) % size) * size];
+          float* dst = &energy[y * size];
+          for (uint x = 0; x < size; ++x)
+            dst[x] += sign * row[(x + size - px) % size];
+        }
+      }
+
+      // Set pixel with the highest energy
+      uint tightestCluster(const std::vector<uint8_t>& pattern) const
+      {
+        uint best = 0;
+        float bestEnergy = -1.0f;
+        for (uint i = 0; i < pattern.size(); ++i)
+        {
+          if (pattern[i] && energy[i] > bestEnergy)
+          {
+            bestEnergy = energy[i];
+            best = i;
+          }
+        }
+        return best;
+      }
+
+      // Empty pixel with the lowest energy
+      uint largestVoid(const std::vector<uint8_t>& pattern) const
+      {
+        uint best = 0;
+        float bestEnergy = std::numeric_limits<float>::max();
+        for (uint i = 0; i < pattern.size(); ++i)
+        {
+          if (!pattern[i] && energy[i] < bestEnergy)
+          {
+            bestEnergy = energy[i];
+            best = i;
+          }
+        }
+        return best;
+      }
+
+    private:
+      uint size;
+      std::vector<float> filter;
+      std::vector<float> energy;
+    };
+  }
+
+  std::vector<float> generateBlueNoise(uint size, uint seed)
+  {
+    PROFILE_SCOPE("generateBlueNoise");
+    const uint pixelsNum = size * size;
+    const uint initialOnes = std::max(pixelsNum / 10, 1u);
+    std::mt19937 rng(seed);
+
+    // Initial binary pattern: random points relaxed by moving the tightest cluster into the largest void
+    std::vector<uint8_t> pattern(pixelsNum, 0);
+    EnergyField field(size, 1.5f);
+    std::uniform_int_distribution<uint> pixelDist(0, pixelsNum - 1);
+    for (uint placed = 0; placed < initialOnes;)
+    {
+      uint p = pixelDist(rng);
+      if (pattern[p])
+        continue;
+      pattern[p] = 1;
+      field.splat(p, 1.0f);
+      ++placed;
+    }
+
+    for (;;)
+    {
+      uint cluster = field.tightestCluster(pattern);
+      pattern[cluster] = 0;
+      field.splat(cluster, -1.0f);
+      uint voidPixel = field.largestVoid(pattern);
+      pattern[voidPixel] = 1;
+      field.splat(voidPixel, 1.0f);
+      if (voidPixel == cluster)
+        break;
+    }
+
+    std::vector<uint> rank(pixelsNum, 0);
+
+    // Ranks below the prototype: remove the tightest clusters one by one
+    {
+      std::vector<uint8_t> prototype = pattern;
+      EnergyField prototypeField = field;
+      for (uint r = initialOnes; r-- > 0;)
+      {
+        uint cluster = prototypeField.tightestCluster(prototype);
+        prototype[cluster] = 0;
+        prototypeField.splat(cluster, -1.0f);
+        rank[cluster] = r;
+      }
+    }
+
+    // Ranks above the prototype: fill the largest voids. With a toroidal filter the tightest cluster of
+    // empty pixels is also the largest void of the set ones, so one rule covers all remaining ranks
+    for (uint r = initialOnes; r < pixelsNum; ++r)
+    {
+      uint voidPixel = field.largestVoid(pattern);
+      pattern[voidPixel] = 1;
+      field.splat(voidPixel, 1.0f);
+      rank[voidPixel] = r;
+    }
+
+    std::vector<float> mask(pixelsNum);
+    for (uint i = 0; i < pixelsNum; ++i)
+      mask[i] = (rank[i] + 0.5f) / pixelsNum;
+    return mask;
+  }
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+// Host side of the samplers in shaders/sampling.glsl: the same source is compiled as C++ here
+// so scene setup and offline tools draw exactly the sequences the shaders do.
+namespace sampling
+{
+  using uint = uint32_t;
+
+  inline uint bitfieldReverse(uint x)
+  {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+  }
+
+#define SHARED_FUNC inline
+#include "shaders/sampling.glsl"
+#undef SHARED_FUNC
+
+  // Generates a size x size tileable blue noise mask with the void-and-cluster method (Ulichney 1993).
+  // Values are the normalized ranks (rank + 0.5) / (size * size), stored row by row
+  std::vector<float> generateBlueNoise(uint size, uint seed = 0x5eed1234u);
+}
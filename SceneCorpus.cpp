@@ -0,0 +1,129 @@
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <sstream>
+#include <SceneCorpus.h>
+#include <SceneLoader.h>
+
+
+namespace
+{
+  // "name": {"mean": .., "stddev": .., "min": ..} over the runs, stddev is the sample standard deviation
+  std::string jsonStats(const std::string& name, const std::vector<double>& values)
+  {
+    const double mean = std::accumulate(values.begin(), values.end(), 0.0) / values.size();
+    double variance = 0.0;
+    for (double v : values)
+      variance += (v - mean) * (v - mean);
+    variance = values.size() > 1 ? variance / (values.size() - 1) : 0.0;
+    std::stringstream ss;
+    ss << "\"" << name << "\": { \"mean\": " << mean << ", \"stddev\": " << std::sqrt(variance)
+      << ", \"min\": " << *std::min_element(values.begin(), values.end()) << " }";
+    return ss.str();
+  }
+}
+
+std::vector<std::filesystem::path> sceneFiles(const std::string& dir)
+{
+  std::vector<std::filesystem::path> scenes;
+  std::error_code error;
+  for (const auto& entry : std::filesystem::directory_iterator(dir, error))
+  {
+    if (entry.path().extension() == ".test")
+      scenes.push_back(entry.path());
+  }
+  std::sort(scenes.begin(), scenes.end());
+  return scenes;
+}
+
+std::filesystem::path referenceImage(const std::filesystem::path& scenePath)
+{
+  std::filesystem::path reference = scenePath;
+  reference.replace_extension(".png");
+  if (!std::filesystem::exists(reference))
+    return {};
+  return reference;
+}
+
+std::vector<std::filesystem::path> jpegReferences(const std::filesystem::path& scenePath)
+{
+  const std::string stem = scenePath.stem().string();
+  std::vector<std::filesystem::path> references;
+  std::error_code error;
+  for (const auto& entry : std::filesystem::directory_iterator(scenePath.parent_path(), error))
+  {
+    const std::string name = entry.path().stem().string();
+    if (entry.path().extension() == ".jpg" && (name == stem || name.rfind(stem + "-", 0) == 0))
+      references.push_back(entry.path());
+  }
+  std::sort(references.begin(), references.end());
+  return references;
+}
+
+uint64_t raysPerSample(const Scene& scene)
+{
+  return scene.depth * (1 + scene.pointLights.size() + scene.directLights.size() + (scene.quadLights.empty() ? 0 : 1));
+}
+
+uint64_t peakResidentBytes()
+{
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters{};
+  if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    return counters.PeakWorkingSetSize;
+#else
+  rusage usage{};
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+#ifdef __APPLE__
+    return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+  return 0;
+}
+
+bool writeBenchmarkResults(const std::string& filename, const std::string& device, uint32_t spp, uint32_t runs,
+  const std::vector<BenchmarkResult>& results)
+{
+  std::ofstream out(filename);
+  if (!out)
+  {
+    std::cerr << "Could not write benchmark results " << filename << std::endl;
+    return false;
+  }
+
+  out << "{\n"
+    << "  \"device\": \"" << device << "\",\n"
+    << "  \"spp\": " << spp << ",\n"
+    << "  \"runs\": " << runs << ",\n"
+    << "  \"scenes\": [";
+  bool first = true;
+  for (const BenchmarkResult& result : results)
+  {
+    out << (first ? "\n" : ",\n")
+      << "    {\n"
+      << "      \"scene\": \"" << result.scene << "\",\n"
+      << "      \"width\": " << result.width << ",\n"
+      << "      \"height\": " << result.height << ",\n"
+      << "      \"triangles\": " << result.triangles << ",\n"
+      << "      \"spheres\": " << result.spheres << ",\n";
+    for (const auto& [name, values] : result.runs)
+      out << "      " << jsonStats(name, values) << ",\n";
+    out << "      \"peakRssBytes\": " << result.peakRssBytes << "\n"
+      << "    }";
+    first = false;
+  }
+  out << "\n  ]\n}\n";
+  return true;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <utility>
+#include <vector>
+
+class Scene;
+
+
+// Directories of .test scenes rendered in batch by the regression and the benchmark, shared by the Vulkan and the
+// CPU renderer
+
+// Scene files of a directory in name order
+std::vector<std::filesystem::path> sceneFiles(const std::string& dir);
+
+// The PNG next to the scene file named after it, <stem>.png, empty when there is none. Matched by the scene file and
+// not its output name, test_scene.test writes scene6.png but doesn't render scene6
+std::filesystem::path referenceImage(const std::filesystem::path& scenePath);
+
+// JPEG references next to the scene file, <stem>.jpg and <stem>-*.jpg like scene1-camera1.jpg. The regression
+// doesn't compare them, their compression error alone is above its tolerance
+std::vector<std::filesystem::path> jpegReferences(const std::filesystem::path& scenePath);
+
+// Scenes of the benchmark corpus, looked up as <name>.test in the benchmark directory
+inline constexpr const char* benchmarkScenes[] = {
+  "scene1", "scene2", "scene3", "scene4-ambient", "scene4-diffuse", "scene4-emission", "scene4-specular",
+  "scene5", "scene6", "scene7", "cornell", "dragon", "analytic", "direct3x3", "direct9"
+};
+inline constexpr uint32_t benchmarkDefaultSpp = 64;
+
+// One benchmark scene with the values of its runs
+struct BenchmarkResult
+{
+  std::string scene;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  size_t triangles = 0;
+  size_t spheres = 0;
+  // Values of every run in the order they are written, e.g. loadMs or mraysPerSecond
+  std::vector<std::pair<std::string, std::vector<double>>> runs;
+  // The process peak so far, scenes later in the corpus include the peaks of the earlier ones
+  uint64_t peakRssBytes = 0;
+};
+
+// Rays traced for one pixel sample, estimated from the scene's lights and depth: a camera ray and one shadow ray
+// per light sample on each bounce. Both renderers compute their benchmark throughput with it
+uint64_t raysPerSample(const Scene& scene);
+
+// Peak resident memory of the process in bytes, 0 where it can't be queried
+uint64_t peakResidentBytes();
+
+// The runs of every scene as {"mean", "stddev", "min"}, device names the GPU or the CPU configuration
+bool writeBenchmarkResults(const std::string& filename, const std::string& device, uint32_t spp, uint32_t runs,
+  const std::vector<BenchmarkResult>& results);
@@ -1,9 +1,19 @@
 #include <iostream>
 #include <unordered_set>
 #include <array>
+#include <algorithm>
+#include <cmath>
 #include <SceneLoader.h>
+#include <CpuProfiler.h>
+#include <MemoryTracker.h>
 
 
+// Transform groups with fewer triangles are merged with their small neighbours, a BLAS per wall
+// of a room would cost more in TLAS traversal than it saves
+constexpr uint32_t minMeshTriangles = 256;
+// M_PI needs _USE_MATH_DEFINES before the first include of cmath on MSVC
+constexpr float pi = 3.14159265358979f;
+
 uint32_t Scene::addToVertices(const Vertex& v)
 {
   auto [it, isInserted] = verticesMap.insert({ v, 0 });
@@ -61,6 +71,7 @@ Aabb calcAabb(const Sphere& s)
 
 void Scene::loadScene(const std::string& filename)
 {
+  PROFILE_SCOPE("loadScene");
   std::vector<vec3> sceneVertices;
   std::vector<std::pair<vec3, vec3>> vertexNormals;
 
@@ -79,6 +90,39 @@ void Scene::loadScene(const std::string& filename)
   std::stack<mat4> transfstack;
   transfstack.push(mat4(1.0)); // identity
 
+  // Objects are stored once and placed by instance lines. Their triangles and the instance materials are
+  // kept apart until the end, so the per-triangle materials of the first mesh stay in triangle order
+  struct ObjectInstance
+  {
+    uint32_t object;
+    mat4 transform;
+    Material material;
+    vec3 spinAxis;
+    float spinSpeed;
+  };
+  struct Object
+  {
+    std::vector<uint32_t> indices;
+    // Deform settings and the vertex range of deforming objects, index range is set on first use
+    Mesh mesh;
+  };
+  std::unordered_map<std::string, uint32_t> objectIds;
+  std::vector<Object> objects;
+  std::vector<ObjectInstance> objectInstances;
+  Object* currentObject = nullptr;
+  vec3 spinAxis{ 0.0f, 1.0f, 0.0f };
+  float spinSpeed = 0.0f;
+
+  // Triangles outside objects are split at every pushTransform and popTransform, so disjoint parts of the
+  // scene like a ground plane and the model standing on it get their own BLAS
+  std::vector<Mesh> transformGroups;
+  auto endTransformGroup = [&]() {
+    uint32_t begin = transformGroups.empty() ? 0 : transformGroups.back().firstIndex + transformGroups.back().indexCount;
+    uint32_t end = static_cast<uint32_t>(indices.size());
+    if (end > begin)
+      transformGroups.push_back({ begin, end - begin });
+  };
+
   while (getline(in, str)) {
     if ((str.find_first_not_of(" \t\r\n") == std::string::npos) || (str[0] == '#'))
       continue;
@@ -148,9 +192,11 @@ void Scene::loadScene(const std::string& filename)
       }
     }
     else if (cmd == "pushTransform") {
+      endTransformGroup();
       transfstack.push(transfstack.top());
     }
     else if (cmd == "popTransform") {
+      endTransformGroup();
       if (transfstack.size() <= 1) {
         std::cerr << "Stack has no elements.  Cannot Pop\n";
       }
@@ -179,13 +225,77 @@ void Scene::loadScene(const std::string& filename)
         vec3 pos1 = transfstack.top() * vec4(sceneVertices[values[1]], 1.0f);
         vec3 pos2 = transfstack.top() * vec4(sceneVertices[values[2]], 1.0f);
         vec3 normal = normalize(cross(pos1 - pos0, pos2 - pos0));
-        uint32_t index0 = addToVertices(Vertex(pos0, normal));
-        uint32_t index1 = addToVertices(Vertex(pos1, normal));
-        uint32_t index2 = addToVertices(Vertex(pos2, normal));
-        indices.push_back(index0);
-        indices.push_back(index1);
-        indices.push_back(index2);
-        triangleMaterials.emplace_back(ambient, diffuse, specular, emission, shininess);
+        // Vertices of deforming objects are not shared, the whole range is rewritten every frame
+        auto addVertex = [&](const Vertex& v) {
+          if (!currentObject || !currentObject->mesh.dynamic)
+            return addToVertices(v);
+          vertices.push_back(v);
+          return static_cast<uint32_t>(vertices.size() - 1);
+        };
+        uint32_t index0 = addVertex(Vertex(pos0, normal));
+        uint32_t index1 = addVertex(Vertex(pos1, normal));
+        uint32_t index2 = addVertex(Vertex(pos2, normal));
+        std::vector<uint32_t>& target = currentObject ? currentObject->indices : indices;
+        target.push_back(index0);
+        target.push_back(index1);
+        target.push_back(index2);
+        if (!currentObject)
+          triangleMaterials.emplace_back(ambient, diffuse, specular, emission, shininess);
+      }
+    }
+    else if (cmd == "object")  // object <name>, triangles up to endObject are stored once in object space
+    {
+      std::string value;
+      if (readvals(ss, 1, &value)) {
+        if (currentObject)
+          std::cerr << "object " << value << " starts inside another object\n";
+        auto [it, isInserted] = objectIds.insert({ value, static_cast<uint32_t>(objects.size()) });
+        if (isInserted)
+          objects.emplace_back();
+        else
+          std::cerr << "object " << value << " is defined twice, adding to the first definition\n";
+        currentObject = &objects[it->second];
+      }
+    }
+    else if (cmd == "endObject") {
+      if (currentObject && currentObject->mesh.dynamic)
+        currentObject->mesh.vertexCount = static_cast<uint32_t>(vertices.size()) - currentObject->mesh.firstVertex;
+      currentObject = nullptr;
+    }
+    else if (cmd == "deform")  // deform <amplitude> <frequency>, first line of an object block
+    {
+      float values[2];
+      if (readvals(ss, 2, values)) {
+        if (!currentObject || !currentObject->indices.empty() || currentObject->mesh.dynamic)
+          std::cerr << "deform has to start an object block, Skipping \n";
+        else if (values[0] > 0.0f) {
+          currentObject->mesh.dynamic = true;
+          currentObject->mesh.deformAmplitude = values[0];
+          currentObject->mesh.deformFrequency = values[1];
+          currentObject->mesh.firstVertex = static_cast<uint32_t>(vertices.size());
+        }
+      }
+    }
+    else if (cmd == "animate")  // animate <axis xyz> <degrees per second>, spin of the following instances
+    {
+      float values[4];
+      if (readvals(ss, 4, values)) {
+        spinAxis = vec3(values[0], values[1], values[2]);
+        spinSpeed = length(spinAxis) > 0.0f ? values[3] : 0.0f;
+        if (spinSpeed != 0.0f)
+          spinAxis = normalize(spinAxis);
+      }
+    }
+    else if (cmd == "instance")  // instance <name>, placed with the current transform and material
+    {
+      std::string value;
+      if (readvals(ss, 1, &value)) {
+        auto it = objectIds.find(value);
+        if (it == objectIds.end())
+          std::cerr << "Unknown object: " << value << " Skipping \n";
+        else
+          objectInstances.push_back({ it->second, transfstack.top(), Material(ambient, diffuse, specular, emission, shininess),
+            spinAxis, spinSpeed });
       }
     }
     else if (cmd == "directional") {
@@ -297,10 +407,175 @@ void Scene::loadScene(const std::string& filename)
           lightstratify = true;
       }
     }
+    else if (cmd == "sampler")  // sampler <pcg/sobol/bluenoise>
+    {
+      std::string value;
+      if (readvals(ss, 1, &value)) {
+        if (value == "pcg")
+          samplerType = sampling::SAMPLER_PCG;
+        else if (value == "sobol")
+          samplerType = sampling::SAMPLER_SOBOL;
+        else if (value == "bluenoise")
+          samplerType = sampling::SAMPLER_BLUE_NOISE;
+        else
+          std::cerr << "Unknown sampler: " << value << " Skipping \n";
+      }
+    }
     else {
       std::cerr << "Unknown Command: " << cmd << " Skipping \n";
     }
   }
+
+  if (currentObject)
+    std::cerr << "Missing endObject at the end of " << filename << "\n";
+
+  PROFILE_SCOPE("groupMeshes");
+  endTransformGroup();
+  for (const Mesh& group : transformGroups)
+  {
+    const bool small = group.indexCount < 3 * minMeshTriangles && !meshes.empty() && meshes.back().indexCount < 3 * minMeshTriangles;
+    if (!meshes.empty() && (!splitMeshes || small))
+      meshes.back().indexCount += group.indexCount;
+    else
+      meshes.push_back(group);
+  }
+  for (uint32_t i = 0; i < meshes.size(); ++i)
+  {
+    meshPlacements.push_back({ i, mat4(1.0f) });
+    meshInstances.push_back({ meshes[i].firstIndex / 3, meshes[i].firstIndex / 3, 1 });
+  }
+  std::vector<uint32_t> objectMeshes(objects.size(), UINT32_MAX);
+  for (const ObjectInstance& instance : objectInstances)
+  {
+    const Object& object = objects[instance.object];
+    if (object.indices.empty())
+      continue;
+    if (objectMeshes[instance.object] == UINT32_MAX)
+    {
+      objectMeshes[instance.object] = static_cast<uint32_t>(meshes.size());
+      Mesh mesh = object.mesh;
+      mesh.firstIndex = static_cast<uint32_t>(indices.size());
+      mesh.indexCount = static_cast<uint32_t>(object.indices.size());
+      meshes.push_back(mesh);
+      indices.insert(indices.end(), object.indices.begin(), object.indices.end());
+    }
+    const Mesh& mesh = meshes[objectMeshes[instance.object]];
+    meshPlacements.push_back({ objectMeshes[instance.object], instance.transform, instance.spinAxis, instance.spinSpeed });
+    meshInstances.push_back({ mesh.firstIndex / 3, static_cast<uint32_t>(triangleMaterials.size()), 0 });
+    triangleMaterials.push_back(instance.material);
+  }
+
+  buildLightAliasTable();
+  if (samplerType == sampling::SAMPLER_BLUE_NOISE)
+    blueNoise = sampling::generateBlueNoise(sampling::BLUE_NOISE_SIZE);
+  trackHostMemory();
+}
+
+void Scene::trackHostMemory() const
+{
+  MemoryTracker::setHostBytes("Vertices", vertices.capacity() * sizeof(Vertex));
+  MemoryTracker::setHostBytes("Indices", indices.capacity() * sizeof(uint32_t));
+  // Node based: every entry is a separate allocation with a next pointer and its cached hash, plus the buckets
+  MemoryTracker::setHostBytes("VertexDedupMap", verticesMap.size() * (sizeof(std::pair<const Vertex, uint32_t>) + 2 * sizeof(void*)) +
+    verticesMap.bucket_count() * sizeof(void*));
+  MemoryTracker::setHostBytes("Spheres", spheres.capacity() * sizeof(Sphere) + aabbs.capacity() * sizeof(Aabb));
+  MemoryTracker::setHostBytes("TriangleMaterials", triangleMaterials.capacity() * sizeof(Material));
+  MemoryTracker::setHostBytes("SphereMaterials", sphereMaterials.capacity() * sizeof(Material));
+  MemoryTracker::setHostBytes("Meshes", meshes.capacity() * sizeof(Mesh) + meshPlacements.capacity() * sizeof(MeshPlacement) +
+    meshInstances.capacity() * sizeof(MeshInstance));
+  MemoryTracker::setHostBytes("Lights", directLights.capacity() * sizeof(DirectionLight) + pointLights.capacity() * sizeof(PointLight) +
+    quadLights.capacity() * sizeof(QuadLight) + lightAliasTable.capacity() * sizeof(LightAliasEntry));
+  MemoryTracker::setHostBytes("BlueNoise", blueNoise.capacity() * sizeof(float));
+}
+
+bool Scene::animated() const
+{
+  return std::any_of(meshes.begin(), meshes.end(), [](const Mesh& m) { return m.dynamic; }) ||
+    std::any_of(meshPlacements.begin(), meshPlacements.end(), [](const MeshPlacement& p) { return p.spinSpeed != 0.0f; });
+}
+
+mat4 Scene::placementTransform(const MeshPlacement& placement, float time) const
+{
+  if (placement.spinSpeed == 0.0f)
+    return placement.transform;
+  return placement.transform * rotate(mat4(1.0f), radians(placement.spinSpeed * time), placement.spinAxis);
+}
+
+void Scene::deformVertices(const Mesh& mesh, float time, Vertex* dst) const
+{
+  // Face normals are left at rest, the amplitudes this is meant for barely tilt them
+  const float phase = 2.0f * pi * mesh.deformFrequency * time;
+  for (uint32_t i = 0; i < mesh.vertexCount; ++i)
+  {
+    const Vertex& v = vertices[mesh.firstVertex + i];
+    float offset = mesh.deformAmplitude * std::sin(phase + 4.0f * (v.pos.x + v.pos.y + v.pos.z));
+    dst[i] = Vertex(v.pos + offset * v.normal, v.normal);
+  }
+}
+
+// Builds an alias table over the quad lights weighted by emitted power (luminance * area),
+// so the shaders pick one light per sample instead of looping over all of them
+void Scene::buildLightAliasTable()
+{
+  PROFILE_SCOPE("buildLightAliasTable");
+  lightAliasTable.clear();
+  if (quadLights.empty())
+    return;
+
+  const size_t lightsNum = quadLights.size();
+  std::vector<float> power(lightsNum);
+  float totalPower = 0.0f;
+  for (size_t i = 0; i < lightsNum; ++i)
+  {
+    const QuadLight& q = quadLights[i];
+    float area = length(cross(q.abSide, q.acSide));
+    float luminance = 0.2126f * q.color.r + 0.7152f * q.color.g + 0.0722f * q.color.b;
+    power[i] = std::max(luminance, 0.0f) * area;
+    totalPower += power[i];
+  }
+
+  // Fall back to uniform selection if all the lights are black
+  if (totalPower <= 0.0f)
+  {
+    std::fill(power.begin(), power.end(), 1.0f);
+    totalPower = static_cast<float>(lightsNum);
+  }
+
+  lightAliasTable.resize(lightsNum, { 1.0f, 0, 0.0f });
+  std::vector<float> scaled(lightsNum);
+  std::vector<uint32_t> small, large;
+  for (size_t i = 0; i < lightsNum; ++i)
+  {
+    lightAliasTable[i].pdf = power[i] / totalPower;
+    lightAliasTable[i].alias = static_cast<uint32_t>(i);
+    scaled[i] = lightAliasTable[i].pdf * lightsNum;
+    if (scaled[i] < 1.0f)
+      small.push_back(static_cast<uint32_t>(i));
+    else
+      large.push_back(static_cast<uint32_t>(i));
+  }
+
+  while (!small.empty() && !large.empty())
+  {
+    uint32_t s = small.back();
+    small.pop_back();
+    uint32_t l = large.back();
+    large.pop_back();
+
+    lightAliasTable[s].probability = scaled[s];
+    lightAliasTable[s].alias = l;
+    scaled[l] = (scaled[l] + scaled[s]) - 1.0f;
+    if (scaled[l] < 1.0f)
+      small.push_back(l);
+    else
+      large.push_back(l);
+  }
+
+  // Whatever is left is 1.0 up to rounding error
+  for (uint32_t i : large)
+    lightAliasTable[i].probability = 1.0f;
+  for (uint32_t i : small)
+    lightAliasTable[i].probability = 1.0f;
 }
 
 // Staging buffer creation, uploading data to device buffer
@@ -324,6 +599,7 @@ void Scene::createBuffer(vks::VulkanDevice* device,
     &staging.buffer,
     &staging.memory,
     data_));
+  MemoryTracker::nameBuffer(staging.buffer, "Staging");
 
   // Create device local buffer
   VK_CHECK_RESULT(device->createBuffer(
@@ -338,9 +614,15 @@ void Scene::createBuffer(vks::VulkanDevice* device,
   vkCmdCopyBuffer(cmdBuf, staging.buffer, *buffer, 1, &region);
 }
 
-void Scene::loadVulkanBuffersForScene(const VulkanDebug& vkDebug, vks::VulkanDevice* device, VkQueue transferQueue)
+void Scene::loadVulkanBuffersForScene(const VulkanDebug& vkDebug, vks::VulkanDevice* device, VkQueue transferQueue, GpuProfiler* profiler)
 {
+  PROFILE_SCOPE("loadVulkanBuffersForScene");
   VkCommandBuffer copyCmd = device->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+  if (profiler)
+  {
+    profiler->reset(copyCmd, profiler->setupSlot());
+    profiler->begin(copyCmd, profiler->setupSlot(), GpuProfiler::PHASE_UPLOAD);
+  }
 
   if (!vertices.empty())
   {
@@ -405,11 +687,53 @@ void Scene::loadVulkanBuffersForScene(const VulkanDebug& vkDebug, vks::VulkanDev
     vkDebug.setBufferName(quadLightsBuf.buffer, "QuadLights");
   }
 
+  if (!lightAliasTable.empty())
+  {
+    createBuffer(device, copyCmd, &lightAliasTableBuf.buffer, &lightAliasTableBuf.memory, lightAliasTable.size() * sizeof(LightAliasEntry), lightAliasTable.data(),
+      VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    vkDebug.setBufferName(lightAliasTableBuf.buffer, "LightAliasTable");
+  }
+
+  if (!blueNoise.empty())
+  {
+    createBuffer(device, copyCmd, &blueNoiseBuf.buffer, &blueNoiseBuf.memory, blueNoise.size() * sizeof(float), blueNoise.data(),
+      VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    vkDebug.setBufferName(blueNoiseBuf.buffer, "BlueNoise");
+  }
+
+  if (!meshInstances.empty())
+  {
+    createBuffer(device, copyCmd, &meshInstancesBuf.buffer, &meshInstancesBuf.memory, meshInstances.size() * sizeof(MeshInstance), meshInstances.data(),
+      VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    vkDebug.setBufferName(meshInstancesBuf.buffer, "MeshInstances");
+  }
+
+  if (profiler)
+  {
+    profiler->end(copyCmd, profiler->setupSlot(), GpuProfiler::PHASE_UPLOAD);
+    profiler->submit(profiler->setupSlot());
+  }
   device->flushCommandBuffer(copyCmd, transferQueue, true);
+  if (profiler)
+    profiler->collect(profiler->setupSlot());
 
   for (auto& i : m_stagingBuffers)
   {
     vkDestroyBuffer(device->logicalDevice, i.buffer, VK_NULL_HANDLE);
+    MemoryTracker::freed(i.memory);
     vkFreeMemory(device->logicalDevice, i.memory, VK_NULL_HANDLE);
   }
+  m_stagingBuffers.clear();
+}
+
+void Scene::destroyVulkanBuffers(VkDevice device)
+{
+  for (BufferDedicated* buf : { &verticesBuf, &indicesBuf, &spheresBuf, &aabbsBuf, &pointLightsBuf, &directLightsBuf,
+    &triangleMaterialsBuf, &sphereMaterialsBuf, &quadLightsBuf, &lightAliasTableBuf, &blueNoiseBuf, &meshInstancesBuf })
+  {
+    vkDestroyBuffer(device, buf->buffer, VK_NULL_HANDLE);
+    MemoryTracker::freed(buf->memory);
+    vkFreeMemory(device, buf->memory, VK_NULL_HANDLE);
+    *buf = BufferDedicated();
+  }
 }
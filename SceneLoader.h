@@ -6,7 +6,9 @@
 
 #include "vulkan/vulkan.h"
 
+#include <GpuProfiler.h>
 #include <Primitives.h>
+#include <Sampling.h>
 #include <Transform.h>
 #include <VulkanDevice.h>
 #include <VulkanDebug.h>
@@ -44,6 +46,31 @@ struct VertexHash<Vertex>
   }
 };
 
+// Range of the index pool built into its own bottom level acceleration structure
+struct Mesh
+{
+  uint32_t firstIndex = 0;
+  uint32_t indexCount = 0;
+  // Updated after the build, its BLAS allows refits instead of preferring fast traversal
+  bool dynamic = false;
+  // Deforming meshes own the vertex range [firstVertex, firstVertex + vertexCount), pushed along their
+  // normals by amplitude * sin(2 pi (frequency * time) + phase of the rest position)
+  uint32_t firstVertex = 0;
+  uint32_t vertexCount = 0;
+  float deformAmplitude = 0.0f;
+  float deformFrequency = 0.0f;
+};
+
+// A mesh placed into the top level acceleration structure
+struct MeshPlacement
+{
+  uint32_t mesh = 0;
+  mat4 transform{ 1.0f };
+  // Spin around the mesh origin, applied before transform
+  vec3 spinAxis{ 0.0f, 1.0f, 0.0f };
+  float spinSpeed = 0.0f; // degrees per second
+};
+
 class Scene
 {
 public:
@@ -58,10 +85,13 @@ public:
   std::string integratorName = "raytracer";
   int lightsamples = 1;
   bool lightstratify = false;
+  uint32_t samplerType = sampling::SAMPLER_SOBOL;
 
   std::vector<DirectionLight> directLights;
   std::vector<PointLight> pointLights;
   std::vector<QuadLight> quadLights;
+  std::vector<LightAliasEntry> lightAliasTable;
+  std::vector<float> blueNoise;
 
   std::vector<Sphere> spheres;
   std::vector<Aabb> aabbs;
@@ -71,11 +101,29 @@ public:
   std::vector<Material> triangleMaterials;
   std::vector<Material> sphereMaterials;
 
+  // Triangle meshes, each gets its own BLAS. Triangles outside object blocks come first, split by transform
+  // groups, then every object follows once no matter how often it is instanced
+  std::vector<Mesh> meshes;
+  // Set before loadScene: false puts all triangles outside objects into a single mesh
+  bool splitMeshes = true;
+  // One TLAS entry each, meshInstances holds the matching data read by the hit shaders
+  std::vector<MeshPlacement> meshPlacements;
+  std::vector<MeshInstance> meshInstances;
+
   BufferDedicated verticesBuf, indicesBuf, spheresBuf, aabbsBuf, pointLightsBuf,
-    directLightsBuf, triangleMaterialsBuf, sphereMaterialsBuf, quadLightsBuf;
+    directLightsBuf, triangleMaterialsBuf, sphereMaterialsBuf, quadLightsBuf, lightAliasTableBuf, blueNoiseBuf,
+    meshInstancesBuf;
 
   void loadScene(const std::string& filename);
-  void loadVulkanBuffersForScene(const VulkanDebug& vkDebug, vks::VulkanDevice* device, VkQueue transferQueue);
+  // The upload copies are timed when a profiler is passed
+  void loadVulkanBuffersForScene(const VulkanDebug& vkDebug, vks::VulkanDevice* device, VkQueue transferQueue, GpuProfiler* profiler = nullptr);
+  void destroyVulkanBuffers(VkDevice device);
+
+  // Anything moves: a spinning placement or a deforming mesh
+  bool animated() const;
+  mat4 placementTransform(const MeshPlacement& placement, float time) const;
+  // Writes mesh.vertexCount vertices of a deforming mesh at the given time
+  void deformVertices(const Mesh& mesh, float time, Vertex* dst) const;
 
 private:
   void createBuffer(vks::VulkanDevice* device,
@@ -87,6 +135,9 @@ private:
     VkBufferUsageFlags     usage_,
     VkMemoryPropertyFlags  memProps = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
   uint32_t addToVertices(const Vertex& v);
+  void buildLightAliasTable();
+  // Reports the sizes of the host arrays to the MemoryTracker
+  void trackHostMemory() const;
 
 private:
   VulkanDebug vkDebug;
@@ -0,0 +1,70 @@
+#include <TileScheduler.h>
+
+
+TileScheduler::TileScheduler(const std::vector<CpuTopology::Worker>& workers, uint32_t nodesNum, bool pinThreads, bool stealing)
+  : workers(workers), queuesNum(nodesNum), queues(std::make_unique<Queue[]>(nodesNum)), pinThreads(pinThreads), stealing(stealing)
+{
+}
+
+void TileScheduler::deal(uint32_t tilesNum)
+{
+  std::vector<uint64_t> workersPerQueue(queuesNum, 0);
+  for (const CpuTopology::Worker& worker : workers)
+    ++workersPerQueue[worker.node];
+
+  // Neighbouring tiles stay on one node
+  uint64_t workersBefore = 0;
+  for (uint32_t queue = 0; queue < queuesNum; ++queue)
+  {
+    const uint64_t front = tilesNum * workersBefore / workers.size();
+    workersBefore += workersPerQueue[queue];
+    const uint64_t back = tilesNum * workersBefore / workers.size();
+    queues[queue].range.store(back << 32 | front, std::memory_order_relaxed);
+  }
+}
+
+bool TileScheduler::takeFront(uint32_t queue, uint32_t& tile)
+{
+  std::atomic<uint64_t>& range = queues[queue].range;
+  uint64_t current = range.load(std::memory_order_relaxed);
+  for (;;)
+  {
+    const uint64_t front = current & 0xffffffffu;
+    const uint64_t back = current >> 32;
+    if (front >= back)
+      return false;
+    if (range.compare_exchange_weak(current, back << 32 | (front + 1), std::memory_order_relaxed))
+    {
+      tile = static_cast<uint32_t>(front);
+      return true;
+    }
+  }
+}
+
+bool TileScheduler::takeBack(uint32_t queue, uint32_t& tile)
+{
+  std::atomic<uint64_t>& range = queues[queue].range;
+  uint64_t current = range.load(std::memory_order_relaxed);
+  for (;;)
+  {
+    const uint64_t front = current & 0xffffffffu;
+    const uint64_t back = current >> 32;
+    if (front >= back)
+      return false;
+    if (range.compare_exchange_weak(current, (back - 1) << 32 | front, std::memory_order_relaxed))
+    {
+      tile = static_cast<uint32_t>(back - 1);
+      return true;
+    }
+  }
+}
+
+bool TileScheduler::steal(uint32_t thief, uint32_t& tile)
+{
+  for (uint32_t i = 1; i < queuesNum; ++i)
+  {
+    if (takeBack((thief + i) % queuesNum, tile))
+      return true;
+  }
+  return false;
+}
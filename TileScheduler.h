@@ -0,0 +1,72 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <CpuTopology.h>
+
+
+// Work stealing over the tiles of an image. Every NUMA node has a queue, dealt a contiguous block of tiles in
+// proportion to its workers. Workers take tiles from the front of their node's queue and, once it runs dry, steal
+// single tiles from the back of the other queues, so nodes that drew cheap tiles (sky) help the ones that didn't
+class TileScheduler
+{
+public:
+  // nodesNum queues, indexed by the node of the workers
+  TileScheduler(const std::vector<CpuTopology::Worker>& workers, uint32_t nodesNum, bool pinThreads, bool stealing);
+
+  // Calls body(worker, tile) for every tile of [0, tilesNum) on one thread per worker, returns how many were stolen
+  template <typename Body>
+  uint64_t run(uint32_t tilesNum, const Body& body);
+
+private:
+  // Tiles [front, back) left in a queue, packed into one word so the owner and thieves claim them with one CAS
+  struct alignas(64) Queue
+  {
+    std::atomic<uint64_t> range{ 0 };
+  };
+
+  void deal(uint32_t tilesNum);
+  bool takeFront(uint32_t queue, uint32_t& tile);
+  bool takeBack(uint32_t queue, uint32_t& tile);
+  bool steal(uint32_t thief, uint32_t& tile);
+
+  std::vector<CpuTopology::Worker> workers;
+  uint32_t queuesNum;
+  std::unique_ptr<Queue[]> queues;
+  bool pinThreads;
+  bool stealing;
+};
+
+template <typename Body>
+uint64_t TileScheduler::run(uint32_t tilesNum, const Body& body)
+{
+  deal(tilesNum);
+  std::atomic<uint64_t> stolen = 0;
+  auto work = [&](uint32_t worker)
+  {
+    if (pinThreads)
+      pinCurrentThread(workers[worker].cpu);
+    const uint32_t queue = workers[worker].node;
+    uint32_t tile;
+    while (takeFront(queue, tile))
+      body(worker, tile);
+
+    uint64_t stolenTiles = 0;
+    while (stealing && steal(queue, tile))
+    {
+      body(worker, tile);
+      ++stolenTiles;
+    }
+    stolen += stolenTiles;
+  };
+
+  std::vector<std::thread> threads;
+  for (uint32_t worker = 0; worker < workers.size(); ++worker)
+    threads.emplace_back(work, worker);
+  for (std::thread& thread : threads)
+    thread.join();
+  return stolen;
+}
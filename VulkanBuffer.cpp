@@ -9,6 +9,7 @@
 */
 
 #include "VulkanBuffer.h"
+#include <MemoryTracker.h>
 
 namespace vks
 {	
@@ -129,6 +130,7 @@ namespace vks
 		}
 		if (memory)
 		{
+			MemoryTracker::freed(memory);
 			vkFreeMemory(device, memory, VK_NULL_HANDLE);
 		}
 	}
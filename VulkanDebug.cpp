@@ -1,4 +1,5 @@
 #include "VulkanDebug.h"
+#include <MemoryTracker.h>
 
 
 void VulkanDebug::setupInstance(VkInstance instance)
@@ -84,6 +85,7 @@ void VulkanDebug::setObjectName(uint64_t object, VkObjectType objectType, const
 
 void VulkanDebug::setBufferName(VkBuffer buffer, const std::string& name) const
 {
+	MemoryTracker::nameBuffer(buffer, name);
 	setObjectName(reinterpret_cast<uint64_t>(buffer), VK_OBJECT_TYPE_BUFFER, name);
 }
 
@@ -9,6 +9,7 @@
 */
 
 #include <VulkanDevice.h>
+#include <MemoryTracker.h>
 #include <unordered_set>
 
 namespace vks
@@ -325,6 +326,7 @@ namespace vks
 			memAlloc.pNext = &allocFlagsInfo;
 		}
 		VK_CHECK_RESULT(vkAllocateMemory(logicalDevice, &memAlloc, VK_NULL_HANDLE, memory));
+		MemoryTracker::allocated(*memory, memReqs.size, memoryPropertyFlags, *buffer);
 			
 		// If a pointer to the buffer data has been passed, map the buffer and copy over the data
 		if (data != nullptr)
@@ -384,6 +386,7 @@ namespace vks
 			memAlloc.pNext = &allocFlagsInfo;
 		}
 		VK_CHECK_RESULT(vkAllocateMemory(logicalDevice, &memAlloc, VK_NULL_HANDLE, &buffer->memory));
+		MemoryTracker::allocated(buffer->memory, memReqs.size, memoryPropertyFlags, buffer->buffer);
 
 		buffer->alignment = memReqs.alignment;
 		buffer->size = size;
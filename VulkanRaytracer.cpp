@@ -1,6 +1,54 @@
 #include "VulkanRaytracer.h"
 
 
+namespace
+{
+	// Written in front of the driver's cache data, which itself starts with VkPipelineCacheHeaderVersionOne
+	struct PipelineCacheFileHeader
+	{
+		uint32_t magic;
+		uint32_t driverVersion;
+		uint64_t dataSize;
+		// Pipeline creation time of the run that started without cached data
+		double coldCompileMs;
+	};
+
+	constexpr uint32_t pipelineCacheMagic = 0x43505256; // "VRPC"
+
+	// Scene animation time step of a camera path frame
+	constexpr float sequenceFrameRate = 24.0f;
+
+	// Keeps the positions a dynamic BLAS was built from, returns the diagonal of their bounds
+	float recordBuiltPositions(const Vertex* vertices, uint32_t count, std::vector<glm::vec3>& positions)
+	{
+		positions.resize(count);
+		glm::vec3 lo(std::numeric_limits<float>::max());
+		glm::vec3 hi(-std::numeric_limits<float>::max());
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			positions[i] = vertices[i].pos;
+			lo = glm::min(lo, positions[i]);
+			hi = glm::max(hi, positions[i]);
+		}
+		return count > 0 ? glm::length(hi - lo) : 0.0f;
+	}
+
+	// Mean distance of the vertices from their built positions relative to the built bounds diagonal
+	float vertexDrift(const Vertex* vertices, const std::vector<glm::vec3>& positions, float diagonal)
+	{
+		if (positions.empty() || diagonal <= 0.0f)
+		{
+			return 0.0f;
+		}
+		double distance = 0.0;
+		for (size_t i = 0; i < positions.size(); ++i)
+		{
+			distance += glm::length(vertices[i].pos - positions[i]);
+		}
+		return static_cast<float>(distance / positions.size() / diagonal);
+	}
+}
+
 VkResult VulkanRaytracer::createInstance()
 {
 	VkApplicationInfo appInfo = {};
@@ -11,10 +59,13 @@ VkResult VulkanRaytracer::createInstance()
 	appInfo.apiVersion = VK_API_VERSION_1_2;
 
 	std::vector<const char*> instanceExtensions;
-	uint32_t glfwExtensionCount = 0;
-	const char** glfwExtensions;
-	glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-	instanceExtensions.insert(instanceExtensions.end(), glfwExtensions, glfwExtensions + glfwExtensionCount);
+	if (!settings.headless)
+	{
+		uint32_t glfwExtensionCount = 0;
+		const char** glfwExtensions;
+		glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+		instanceExtensions.insert(instanceExtensions.end(), glfwExtensions, glfwExtensions + glfwExtensionCount);
+	}
 
 	// Get extensions supported by the instance and store for later use
 	uint32_t extCount = 0;
@@ -88,6 +139,7 @@ void VulkanRaytracer::renderFrame()
 	prepareFrame();
 	submitInfo.commandBufferCount = 1;
 	submitInfo.pCommandBuffers = &drawCmdBuffers[currentBuffer];
+	gpuProfiler.submit(currentBuffer);
 	VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE));
 	submitFrame();
 }
@@ -95,7 +147,7 @@ void VulkanRaytracer::renderFrame()
 void VulkanRaytracer::createCommandBuffers()
 {
 	// Create one command buffer for each swap chain image and reuse for rendering
-	drawCmdBuffers.resize(swapChain.imageCount);
+	drawCmdBuffers.resize(settings.headless ? 1 : swapChain.imageCount);
 
 	VkCommandBufferAllocateInfo cmdBufAllocateInfo =
 		vks::initializers::commandBufferAllocateInfo(
@@ -111,24 +163,128 @@ void VulkanRaytracer::destroyCommandBuffers()
 	vkFreeCommandBuffers(device, cmdPool, static_cast<uint32_t>(drawCmdBuffers.size()), drawCmdBuffers.data());
 }
 
+/*
+	The pipeline cache is seeded from settings.pipelineCacheFile. Data from another GPU or driver is dropped:
+	the driver version is checked against our file header, vendor, device and cache UUID against the header
+	the driver puts at the start of its data
+*/
 void VulkanRaytracer::createPipelineCache()
 {
+	PROFILE_SCOPE("createPipelineCache");
+	std::vector<char> cacheData;
+	std::ifstream in(settings.pipelineCacheFile, std::ios::binary);
+	PipelineCacheFileHeader header{};
+	if (in.read(reinterpret_cast<char*>(&header), sizeof(header)) && header.magic == pipelineCacheMagic)
+	{
+		// The size is checked against the file before anything is allocated for it
+		std::error_code error;
+		const uintmax_t fileSize = std::filesystem::file_size(settings.pipelineCacheFile, error);
+		VkPipelineCacheHeaderVersionOne driverHeader{};
+		const bool sizeValid = !error && header.dataSize >= sizeof(driverHeader) && header.dataSize <= fileSize - sizeof(header);
+		if (sizeValid)
+		{
+			cacheData.resize(static_cast<size_t>(header.dataSize));
+		}
+		if (!sizeValid || !in.read(cacheData.data(), cacheData.size()))
+		{
+			std::cerr << "Pipeline cache " << settings.pipelineCacheFile << " is truncated, starting empty" << std::endl;
+			cacheData.clear();
+		}
+		else
+		{
+			memcpy(&driverHeader, cacheData.data(), sizeof(driverHeader));
+			if (header.driverVersion != deviceProperties.driverVersion ||
+				driverHeader.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+				driverHeader.vendorID != deviceProperties.vendorID ||
+				driverHeader.deviceID != deviceProperties.deviceID ||
+				memcmp(driverHeader.pipelineCacheUUID, deviceProperties.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+			{
+				std::cout << "Pipeline cache " << settings.pipelineCacheFile << " is from another device or driver, starting empty" << std::endl;
+				cacheData.clear();
+			}
+			else
+			{
+				pipelineCacheStats.coldCompileMs = header.coldCompileMs;
+			}
+		}
+	}
+	pipelineCacheStats.loaded = !cacheData.empty();
+
 	VkPipelineCacheCreateInfo pipelineCacheCreateInfo = {};
 	pipelineCacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	pipelineCacheCreateInfo.initialDataSize = cacheData.size();
+	pipelineCacheCreateInfo.pInitialData = cacheData.empty() ? nullptr : cacheData.data();
 	VK_CHECK_RESULT(vkCreatePipelineCache(device, &pipelineCacheCreateInfo, VK_NULL_HANDLE, &pipelineCache));
 }
 
+void VulkanRaytracer::savePipelineCache()
+{
+	PROFILE_SCOPE("savePipelineCache");
+	// Runs on shutdown, a failure only costs the next start its warm cache
+	size_t dataSize = 0;
+	VkResult result = vkGetPipelineCacheData(device, pipelineCache, &dataSize, nullptr);
+	std::vector<char> cacheData(dataSize);
+	if (result == VK_SUCCESS)
+	{
+		result = vkGetPipelineCacheData(device, pipelineCache, &dataSize, cacheData.data());
+	}
+	if (result != VK_SUCCESS)
+	{
+		std::cerr << "Could not read the pipeline cache data: " << vks::tools::errorString(result) << std::endl;
+		return;
+	}
+
+	// Written under a temporary name first, so a crash never leaves a half written cache behind
+	const std::string tmpFile = settings.pipelineCacheFile + ".tmp";
+	{
+		std::ofstream out(tmpFile, std::ios::binary | std::ios::trunc);
+		PipelineCacheFileHeader header{ pipelineCacheMagic, deviceProperties.driverVersion, dataSize, pipelineCacheStats.coldCompileMs };
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(cacheData.data(), dataSize);
+		if (!out)
+		{
+			std::cerr << "Could not write pipeline cache " << tmpFile << std::endl;
+			return;
+		}
+	}
+	// Renaming onto an existing file can fail depending on the platform and standard library, the old cache is
+	// removed and the rename tried again then
+	std::error_code error;
+	std::filesystem::rename(tmpFile, settings.pipelineCacheFile, error);
+	if (error)
+	{
+		error.clear();
+		std::filesystem::remove(settings.pipelineCacheFile, error);
+		std::filesystem::rename(tmpFile, settings.pipelineCacheFile, error);
+	}
+	if (error)
+	{
+		std::cerr << "Could not write pipeline cache " << settings.pipelineCacheFile << ": " << error.message() << std::endl;
+	}
+}
+
 void VulkanRaytracer::prepare()
 {
-	initSwapchain();
-	createCommandPool();
-	setupSwapChain();
-	createCommandBuffers();
-	createSynchronizationPrimitives();
-	setupDepthStencil();
-	setupRenderPass();
-	createPipelineCache();
-	setupFrameBuffer();
+	PROFILE_SCOPE("prepare");
+	if (settings.headless)
+	{
+		createCommandPool();
+		createCommandBuffers();
+		createSynchronizationPrimitives();
+		createPipelineCache();
+	}
+	else
+	{
+		initSwapchain();
+		createCommandPool();
+		setupSwapChain();
+		createCommandBuffers();
+		createSynchronizationPrimitives();
+		setupDepthStencil();
+		setupRenderPass();
+		createPipelineCache();
+		setupFrameBuffer();
+	}
 
 	// Query the ray tracing properties of the current implementation, we will need them later on
 	rayTracingPipelineProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR;
@@ -160,30 +316,182 @@ void VulkanRaytracer::prepare()
 	vkGetRayTracingShaderGroupHandlesKHR = reinterpret_cast<PFN_vkGetRayTracingShaderGroupHandlesKHR>(vkGetDeviceProcAddr(device, "vkGetRayTracingShaderGroupHandlesKHR"));
 	vkCreateRayTracingPipelinesKHR = reinterpret_cast<PFN_vkCreateRayTracingPipelinesKHR>(vkGetDeviceProcAddr(device, "vkCreateRayTracingPipelinesKHR"));
 
+	if (!settings.gpuTimingsFile.empty())
+	{
+		gpuProfiler.create(physicalDevice, device, vulkanDevice->queueFamilyIndices.graphics, static_cast<uint32_t>(drawCmdBuffers.size()), settings.gpuTimingsFile);
+	}
+
 	// Create the acceleration structures used to render the ray traced scene
-	scene.loadVulkanBuffersForScene(vkDebug, vulkanDevice, queue);
-	createBottomLevelAccelerationStructureTriangles();
-	createBottomLevelAccelerationStructureSpheres();
-	createTopLevelAccelerationStructure();
+	uploadScene();
 
+	updateRenderExtent();
 	createStorageImage();
+	createAccumulationBuffers();
 	createUniformBuffers();
+	createPipelineLayout();
+
+	const auto tPipelineStart = std::chrono::high_resolution_clock::now();
 	createRayTracingPipeline();
+	const double compileMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tPipelineStart).count();
+	sceneTimings.pipelineMs = compileMs;
+	if (pipelineCacheStats.loaded && pipelineCacheStats.coldCompileMs > 0.0)
+	{
+		std::cout << "Ray tracing pipeline created in " << compileMs << " ms from the pipeline cache, "
+			<< pipelineCacheStats.coldCompileMs << " ms without it (" << pipelineCacheStats.coldCompileMs - compileMs << " ms saved)" << std::endl;
+	}
+	else
+	{
+		std::cout << "Ray tracing pipeline created in " << compileMs << " ms" << (pipelineCacheStats.loaded ? " from the pipeline cache" : "") << std::endl;
+		if (!pipelineCacheStats.loaded)
+		{
+			pipelineCacheStats.coldCompileMs = compileMs;
+		}
+	}
+
 	createShaderBindingTables();
 	createDescriptorSets();
 	buildCommandBuffers();
+	printMemoryUsage();
+	if (settings.updateBenchmarkFrames > 0)
+	{
+		benchmarkSceneUpdates();
+	}
 	prepared = true;
 }
 
+void VulkanRaytracer::setupScene(const std::string& scenePath)
+{
+	PROFILE_SCOPE("setupScene");
+	std::cout << scenePath << std::endl;
+	scene.splitMeshes = settings.splitMeshes;
+	const auto tStart = std::chrono::high_resolution_clock::now();
+	scene.loadScene(scenePath);
+	sceneTimings.loadMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tStart).count();
+
+	height = scene.height;
+	width = scene.width;
+
+	//!!!!!!!!!!!!!!!!!!!!!!!!!!!
+	// The regression keeps the maxdepth of the scene, its references are rendered with the reflections
+	if (settings.regressionDir.empty())
+	{
+		scene.depth = 1;  // for direct light shading turn it off
+	}
+
+	camera.setPerspective(scene.fovy, (float)width / (float)height, 0.1f, 512.0f);
+	camera.setLookAt(scene.eyeInit, scene.center, scene.upInit);
+}
+
+/*
+	Scene geometry, materials, lights and the acceleration structures built over them
+*/
+void VulkanRaytracer::destroySceneResources()
+{
+	for (auto& blas : meshBlases)
+	{
+		deleteAccelerationStructure(blas);
+	}
+	meshBlases.clear();
+	if (!scene.spheres.empty())
+	{
+		deleteAccelerationStructure(spheresBlas);
+	}
+	deleteAccelerationStructure(topLevelAS);
+	destroyAnimationResources();
+	scene.destroyVulkanBuffers(device);
+}
+
+/*
+	Replaces the scene of a prepared renderer. Instance, device, command buffers, uniform buffer, shader
+	modules, pipeline cache and pipeline variants stay, the scene buffers, acceleration structures, SBT and
+	descriptors are rebuilt. The storage image and accumulation buffers are only recreated when the image size changes
+*/
+void VulkanRaytracer::swapScene(const std::string& scenePath)
+{
+	PROFILE_SCOPE("swapScene");
+	VK_CHECK_RESULT(vkDeviceWaitIdle(device));
+	destroySceneResources();
+	vkDestroyDescriptorPool(device, descriptorPool, VK_NULL_HANDLE);
+	shaderBindingTable.destroy();
+
+	scene = Scene();
+	setupScene(scenePath);
+	if (rayTracingPipelineProperties.maxRayRecursionDepth < scene.depth) {
+		throw std::runtime_error("Device fails to support maxRecursionDepth = " + std::to_string(scene.depth));
+	}
+
+	uploadScene();
+
+	const VkExtent2D previousExtent = storageExtent;
+	updateRenderExtent();
+	if (storageExtent.width != previousExtent.width || storageExtent.height != previousExtent.height)
+	{
+		vkDestroyImageView(device, storageImage.view, VK_NULL_HANDLE);
+		vkDestroyImage(device, storageImage.image, VK_NULL_HANDLE);
+		MemoryTracker::freed(storageImage.memory);
+		vkFreeMemory(device, storageImage.memory, VK_NULL_HANDLE);
+		createStorageImage();
+		destroyAccumulationBuffers();
+		createAccumulationBuffers();
+	}
+	else
+	{
+		resetAccumulation();
+	}
+
+	const auto tPipelineStart = std::chrono::high_resolution_clock::now();
+	createRayTracingPipeline();
+	sceneTimings.pipelineMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tPipelineStart).count();
+	createShaderBindingTables();
+	createDescriptorSets();
+	updateUniformBuffers();
+	buildCommandBuffers();
+	printMemoryUsage();
+}
+
+void VulkanRaytracer::printMemoryUsage() const
+{
+	if (settings.memoryReport)
+	{
+		MemoryTracker::report(std::cout);
+	}
+	else
+	{
+		MemoryTracker::summary(std::cout);
+	}
+}
+
+/*
+	Scene buffers and acceleration structures of the loaded scene
+*/
+void VulkanRaytracer::uploadScene()
+{
+	PROFILE_SCOPE("uploadScene");
+	const auto tStart = std::chrono::high_resolution_clock::now();
+	scene.loadVulkanBuffersForScene(vkDebug, vulkanDevice, queue, &gpuProfiler);
+	const auto tUploaded = std::chrono::high_resolution_clock::now();
+	createBottomLevelAccelerationStructureTriangles();
+	createBottomLevelAccelerationStructureSpheres();
+	createTopLevelAccelerationStructure();
+	const auto tEnd = std::chrono::high_resolution_clock::now();
+	sceneTimings.uploadMs = std::chrono::duration<double, std::milli>(tUploaded - tStart).count();
+	sceneTimings.accelerationStructureMs = std::chrono::duration<double, std::milli>(tEnd - tUploaded).count();
+}
+
 VkPipelineShaderStageCreateInfo VulkanRaytracer::loadShader(std::string fileName, VkShaderStageFlagBits stage)
 {
 	VkPipelineShaderStageCreateInfo shaderStage = {};
 	shaderStage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
 	shaderStage.stage = stage;
-	shaderStage.module = vks::tools::loadShader(fileName.c_str(), device);
+	// Modules are kept for the lifetime of the device, rebuilding the pipeline for another scene reuses them
+	auto cached = shaderModules.find(fileName);
+	if (cached == shaderModules.end())
+	{
+		cached = shaderModules.emplace(fileName, vks::tools::loadShader(fileName.c_str(), device)).first;
+	}
+	shaderStage.module = cached->second;
 	shaderStage.pName = "main";
 	assert(shaderStage.module != VK_NULL_HANDLE);
-	shaderModules.push_back(shaderStage.module);
 	return shaderStage;
 }
 
@@ -228,6 +536,27 @@ void VulkanRaytracer::nextFrame()
 
 void VulkanRaytracer::renderLoop()
 {
+	if (settings.headless)
+	{
+		if (!settings.benchmarkFile.empty())
+		{
+			renderBenchmark();
+		}
+		else if (!settings.regressionDir.empty())
+		{
+			renderRegression();
+		}
+		else if (settings.server)
+		{
+			renderServer();
+		}
+		else
+		{
+			renderHeadless();
+		}
+		return;
+	}
+
 	destWidth = width;
 	destHeight = height;
 	lastTimestamp = std::chrono::high_resolution_clock::now();
@@ -299,6 +628,114 @@ VulkanRaytracer::VulkanRaytracer(const std::vector<std::string>& args)
 		{
 			scenePath = args[i + 1];
 		}
+		else if (args[i] == "-accumulate")
+		{
+			settings.accumulation = ACCUMULATION_ON;
+		}
+		else if (args[i] == "-adaptive")
+		{
+			settings.accumulation = ACCUMULATION_ADAPTIVE;
+		}
+		// -warmup, -target-error, -time-budget and -spp, the CPU renderer reads them the same way
+		else if (settings.stop.parse(args, i))
+		{
+		}
+		else if (args[i] == "-headless")
+		{
+			settings.headless = true;
+		}
+		else if (args[i] == "-tile")
+		{
+			settings.tileSize = std::atoi(args[i + 1].c_str());
+			settings.headless = true;
+		}
+		else if (args[i] == "-half")
+		{
+			settings.halfFloat = true;
+		}
+		else if (args[i] == "-srgb")
+		{
+			settings.srgb = true;
+		}
+		else if (args[i] == "-camera-path")
+		{
+			settings.cameraPath = args[i + 1];
+			settings.headless = true;
+		}
+		else if (args[i] == "-pipeline-cache")
+		{
+			settings.pipelineCacheFile = args[i + 1];
+		}
+		else if (args[i] == "-single-blas")
+		{
+			settings.splitMeshes = false;
+		}
+		else if (args[i] == "-server")
+		{
+			settings.server = true;
+			settings.headless = true;
+		}
+		else if (args[i] == "-refit-limit")
+		{
+			settings.refitLimit = std::atoi(args[i + 1].c_str());
+		}
+		else if (args[i] == "-refit-drift")
+		{
+			settings.refitDrift = static_cast<float>(std::atof(args[i + 1].c_str()));
+		}
+		else if (args[i] == "-update-benchmark")
+		{
+			settings.updateBenchmarkFrames = std::atoi(args[i + 1].c_str());
+		}
+		else if (args[i] == "-gpu-timings")
+		{
+			settings.gpuTimingsFile = args[i + 1];
+		}
+		else if (args[i] == "-benchmark")
+		{
+			settings.benchmarkFile = args[i + 1];
+			settings.headless = true;
+		}
+		else if (args[i] == "-benchmark-dir")
+		{
+			settings.benchmarkDir = args[i + 1];
+		}
+		else if (args[i] == "-benchmark-runs")
+		{
+			settings.benchmarkRuns = std::max(std::atoi(args[i + 1].c_str()), 1);
+		}
+		else if (args[i] == "-regression")
+		{
+			settings.regressionDir = args[i + 1];
+			settings.headless = true;
+		}
+		else if (args[i] == "-reference")
+		{
+			settings.referenceImage = args[i + 1];
+			settings.headless = true;
+		}
+		else if (args[i] == "-regression-tolerance")
+		{
+			settings.regressionTolerance = std::atoi(args[i + 1].c_str());
+		}
+		else if (args[i] == "-regression-max-bad")
+		{
+			settings.regressionMaxBadPixels = std::atof(args[i + 1].c_str());
+		}
+		else if (args[i] == "-memory-report")
+		{
+			settings.memoryReport = true;
+		}
+		else if (args[i] == "-ray-stats")
+		{
+			settings.rayStats = true;
+		}
+		else if (args[i] == "-heatmap")
+		{
+			settings.heatmapFile = args[i + 1];
+			settings.rayStats = true;
+			settings.headless = true;
+		}
 	}
 
 	//scenePath = "E:\\Programming\\edx_cse168\\hw2\\data\\test_scene.test";
@@ -319,17 +756,68 @@ VulkanRaytracer::VulkanRaytracer(const std::vector<std::string>& args)
 	//scenePath = "E:\\Programming\\edx_cse168\\hw2\\data\\cornell.test";
 	//scenePath = "E:\\Programming\\edx_cse168\\hw2\\data\\dragon.test";
 
-	std::cout << scenePath << std::endl;
-	scene.loadScene(scenePath);
-
-	height = scene.height;
-	width = scene.width;
+	// The benchmark renders a fixed number of samples and ignores budgets, camera paths and tiles
+	if (!settings.benchmarkFile.empty())
+	{
+		settings.stop.maxSpp = settings.stop.maxSpp > 0 ? settings.stop.maxSpp : benchmarkDefaultSpp;
+		settings.stop.timeBudget = 0.0;
+		settings.stop.stopAtTargetError = false;
+		settings.cameraPath.clear();
+		settings.tileSize = 0;
+		if (settings.accumulation == ACCUMULATION_ADAPTIVE)
+		{
+			settings.accumulation = ACCUMULATION_ON;
+		}
+		if (scenePath.empty())
+		{
+			scenePath = (std::filesystem::path(settings.benchmarkDir) / (std::string(benchmarkScenes[0]) + ".test")).string();
+		}
+	}
+	// The regression compares whole frames of the scenes in its directory
+	if (!settings.regressionDir.empty())
+	{
+		settings.cameraPath.clear();
+		settings.tileSize = 0;
+		settings.server = false;
+		if (scenePath.empty())
+		{
+			const std::vector<std::filesystem::path> scenes = sceneFiles(settings.regressionDir);
+			if (scenes.empty())
+			{
+				throw std::runtime_error("-regression found no .test scenes in " + settings.regressionDir);
+			}
+			scenePath = scenes.front().string();
+		}
+	}
+	// Budgets are met by adding passes, so they need accumulation
+	if (settings.headless && settings.stop.limited() && settings.accumulation == ACCUMULATION_OFF)
+	{
+		settings.accumulation = ACCUMULATION_ON;
+	}
+	// Sequence frames are read back whole, so the storage image has to cover the frame
+	if (!settings.cameraPath.empty() && settings.tileSize > 0)
+	{
+		std::cerr << "-tile is ignored when rendering a camera path" << std::endl;
+		settings.tileSize = 0;
+	}
+	// The heatmap is read from the per-pixel counts of one storage image covering the frame
+	if (!settings.heatmapFile.empty() && (settings.tileSize > 0 || !settings.cameraPath.empty()))
+	{
+		std::cerr << "-heatmap is ignored with tiles and camera paths" << std::endl;
+		settings.heatmapFile.clear();
+	}
+	if (settings.server && !settings.cameraPath.empty())
+	{
+		std::cerr << "-camera-path is ignored in server mode" << std::endl;
+		settings.cameraPath.clear();
+	}
 
-	//!!!!!!!!!!!!!!!!!!!!!!!!!!!
-	scene.depth = 1;  // for direct light shading turn it off
+	if (settings.server && scenePath.empty())
+	{
+		throw std::runtime_error("-server needs a startup scene given with -s");
+	}
 
-	camera.setPerspective(scene.fovy, (float)width / (float)height, 0.1f, 512.0f);
-	camera.setLookAt(scene.eyeInit, scene.center, scene.upInit);
+	setupScene(scenePath);
 
 	// Enable instance and device extensions required to use VK_KHR_ray_tracing
 	enabledInstanceExtensions.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
@@ -345,40 +833,20 @@ VulkanRaytracer::VulkanRaytracer(const std::vector<std::string>& args)
 
 VulkanRaytracer::~VulkanRaytracer()
 {
-	vkDestroyPipeline(device, pipeline, VK_NULL_HANDLE);
+	gpuProfiler.destroy();
+	for (auto& variant : pipelineVariants)
+	{
+		vkDestroyPipeline(device, variant.second, VK_NULL_HANDLE);
+	}
 	vkDestroyPipelineLayout(device, pipelineLayout, VK_NULL_HANDLE);
 	vkDestroyDescriptorSetLayout(device, descriptorSetLayout, VK_NULL_HANDLE);
 	vkDestroyImageView(device, storageImage.view, VK_NULL_HANDLE);
 	vkDestroyImage(device, storageImage.image, VK_NULL_HANDLE);
+	MemoryTracker::freed(storageImage.memory);
 	vkFreeMemory(device, storageImage.memory, VK_NULL_HANDLE);
-	if (!scene.vertices.empty())
-	{
-		deleteAccelerationStructure(trianglesBlas);
-	}
-	if (!scene.spheres.empty())
-	{
-		deleteAccelerationStructure(spheresBlas);
-	}
-	deleteAccelerationStructure(topLevelAS);
-
-	vkDestroyBuffer(device, scene.verticesBuf.buffer, VK_NULL_HANDLE);
-	vkFreeMemory(device, scene.verticesBuf.memory, VK_NULL_HANDLE);
-	vkDestroyBuffer(device, scene.indicesBuf.buffer, VK_NULL_HANDLE);
-	vkFreeMemory(device, scene.indicesBuf.memory, VK_NULL_HANDLE);
-	vkDestroyBuffer(device, scene.spheresBuf.buffer, VK_NULL_HANDLE);
-	vkFreeMemory(device, scene.spheresBuf.memory, VK_NULL_HANDLE);
-	vkDestroyBuffer(device, scene.aabbsBuf.buffer, VK_NULL_HANDLE);
-	vkFreeMemory(device, scene.aabbsBuf.memory, VK_NULL_HANDLE);
-	vkDestroyBuffer(device, scene.pointLightsBuf.buffer, VK_NULL_HANDLE);
-	vkFreeMemory(device, scene.pointLightsBuf.memory, VK_NULL_HANDLE);
-	vkDestroyBuffer(device, scene.directLightsBuf.buffer, VK_NULL_HANDLE);
-	vkFreeMemory(device, scene.directLightsBuf.memory, VK_NULL_HANDLE);
-	vkDestroyBuffer(device, scene.triangleMaterialsBuf.buffer, VK_NULL_HANDLE);
-	vkFreeMemory(device, scene.triangleMaterialsBuf.memory, VK_NULL_HANDLE);
-	vkDestroyBuffer(device, scene.sphereMaterialsBuf.buffer, VK_NULL_HANDLE);
-	vkFreeMemory(device, scene.sphereMaterialsBuf.memory, VK_NULL_HANDLE);
-	vkDestroyBuffer(device, scene.quadLightsBuf.buffer, VK_NULL_HANDLE);
-	vkFreeMemory(device, scene.quadLightsBuf.memory, VK_NULL_HANDLE);
+	destroyAccumulationBuffers();
+	destroyCaptureResources();
+	destroySceneResources();
 
 	uboData.destroy();
 
@@ -397,13 +865,18 @@ VulkanRaytracer::~VulkanRaytracer()
 
 	for (auto& shaderModule : shaderModules)
 	{
-		vkDestroyShaderModule(device, shaderModule, VK_NULL_HANDLE);
+		vkDestroyShaderModule(device, shaderModule.second, VK_NULL_HANDLE);
 	}
 	vkDestroyImageView(device, depthStencil.view, VK_NULL_HANDLE);
 	vkDestroyImage(device, depthStencil.image, VK_NULL_HANDLE);
+	MemoryTracker::freed(depthStencil.mem);
 	vkFreeMemory(device, depthStencil.mem, VK_NULL_HANDLE);
 
-	vkDestroyPipelineCache(device, pipelineCache, VK_NULL_HANDLE);
+	if (pipelineCache != VK_NULL_HANDLE)
+	{
+		savePipelineCache();
+		vkDestroyPipelineCache(device, pipelineCache, VK_NULL_HANDLE);
+	}
 
 	vkDestroyCommandPool(device, cmdPool, VK_NULL_HANDLE);
 
@@ -422,17 +895,54 @@ VulkanRaytracer::~VulkanRaytracer()
 
 	vkDestroyInstance(instance, VK_NULL_HANDLE);
 
-	FreeImage_DeInitialise();
-
-	glfwDestroyWindow(window);
-	glfwTerminate();
+	if (!settings.headless)
+	{
+		glfwDestroyWindow(window);
+		glfwTerminate();
+	}
 }
 
-bool VulkanRaytracer::initAPIs()
+bool VulkanRaytracer::rayTracingDeviceAvailable()
 {
-	glfwInit();
-
-	FreeImage_Initialise();
+	VkApplicationInfo appInfo = {};
+	appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+	appInfo.apiVersion = VK_API_VERSION_1_2;
+	VkInstanceCreateInfo instanceCreateInfo = {};
+	instanceCreateInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+	instanceCreateInfo.pApplicationInfo = &appInfo;
+	VkInstance probe = VK_NULL_HANDLE;
+	if (vkCreateInstance(&instanceCreateInfo, nullptr, &probe) != VK_SUCCESS)
+	{
+		return false;
+	}
+
+	uint32_t gpuCount = 0;
+	vkEnumeratePhysicalDevices(probe, &gpuCount, nullptr);
+	std::vector<VkPhysicalDevice> physicalDevices(gpuCount);
+	vkEnumeratePhysicalDevices(probe, &gpuCount, physicalDevices.data());
+	bool found = false;
+	for (VkPhysicalDevice device : physicalDevices)
+	{
+		uint32_t extCount = 0;
+		vkEnumerateDeviceExtensionProperties(device, nullptr, &extCount, nullptr);
+		std::vector<VkExtensionProperties> extensions(extCount);
+		vkEnumerateDeviceExtensionProperties(device, nullptr, &extCount, extensions.data());
+		for (const VkExtensionProperties& extension : extensions)
+		{
+			found = found || std::string(extension.extensionName) == VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME;
+		}
+	}
+	vkDestroyInstance(probe, nullptr);
+	return found;
+}
+
+bool VulkanRaytracer::initAPIs()
+{
+	PROFILE_SCOPE("initAPIs");
+	if (!settings.headless)
+	{
+		glfwInit();
+	}
 
 	 VkResult err = createInstance();
 	if (err) {
@@ -486,7 +996,7 @@ bool VulkanRaytracer::initAPIs()
 	// This is handled by a separate class that gets a logical device representation
 	// and encapsulates functions related to a device
 	vulkanDevice = new vks::VulkanDevice(physicalDevice);
-	VkResult res = vulkanDevice->createLogicalDevice(enabledFeatures, enabledDeviceExtensions, deviceCreatepNextChain);
+	VkResult res = vulkanDevice->createLogicalDevice(enabledFeatures, enabledDeviceExtensions, deviceCreatepNextChain, !settings.headless);
 	if (res != VK_SUCCESS) {
 		vks::tools::exitFatal("Could not create Vulkan device: \n" + vks::tools::errorString(res), res);
 		return false;
@@ -530,6 +1040,11 @@ bool VulkanRaytracer::initAPIs()
 
 void VulkanRaytracer::setupWindow()
 {
+	if (settings.headless)
+	{
+		return;
+	}
+
 	glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
 
 	window = glfwCreateWindow(width, height, applicationName.c_str(), nullptr, nullptr);
@@ -555,8 +1070,8 @@ void VulkanRaytracer::createCommandPool()
 {
 	VkCommandPoolCreateInfo cmdPoolInfo = {};
 	cmdPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-	cmdPoolInfo.queueFamilyIndex = swapChain.queueNodeIndex;
-	//cmdPoolInfo.queueFamilyIndex = vulkanDevice->queueFamilyIndices.graphics;
+	// Without a swap chain there is no present queue, the graphics queue is used for everything
+	cmdPoolInfo.queueFamilyIndex = settings.headless ? vulkanDevice->queueFamilyIndices.graphics : swapChain.queueNodeIndex;
 	cmdPoolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
 	VK_CHECK_RESULT(vkCreateCommandPool(device, &cmdPoolInfo, VK_NULL_HANDLE, &cmdPool));
 }
@@ -583,6 +1098,7 @@ void VulkanRaytracer::setupDepthStencil()
 	memAllloc.allocationSize = memReqs.size;
 	memAllloc.memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 	VK_CHECK_RESULT(vkAllocateMemory(device, &memAllloc, VK_NULL_HANDLE, &depthStencil.mem));
+	MemoryTracker::allocated(depthStencil.mem, memReqs.size, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_NULL_HANDLE, "DepthStencil");
 	VK_CHECK_RESULT(vkBindImageMemory(device, depthStencil.image, depthStencil.mem, 0));
 
 	VkImageViewCreateInfo imageViewCI{};
@@ -702,191 +1218,166 @@ void VulkanRaytracer::setupRenderPass()
 
 void VulkanRaytracer::saveScreenshot(const std::string& filename)
 {
-	bool supportsBlit = true;
-
-	// Check blit support for source and destination
-	VkFormatProperties formatProps;
-
-	// Check if the device supports blitting from optimal images (the swapchain images are in optimal format)
-	vkGetPhysicalDeviceFormatProperties(physicalDevice, swapChain.colorFormat, &formatProps);
-	if (!(formatProps.optimalTilingFeatures & VK_FORMAT_FEATURE_BLIT_SRC_BIT)) {
-		std::cerr << "Device does not support blitting from optimal tiled images, using copy instead of blit!" << std::endl;
-		supportsBlit = false;
-	}
-
-	// Check if the device supports blitting to linear images
-	vkGetPhysicalDeviceFormatProperties(physicalDevice, VK_FORMAT_R8G8B8A8_UNORM, &formatProps);
-	if (!(formatProps.linearTilingFeatures & VK_FORMAT_FEATURE_BLIT_DST_BIT)) {
-		std::cerr << "Device does not support blitting to linear tiled images, using copy instead of blit!" << std::endl;
-		supportsBlit = false;
-	}
-
-	// Source for the copy is the last rendered swapchain image
-	VkImage srcImage = swapChain.images[currentBuffer];
-
-	// Create the linear tiled destination image to copy to and to read the memory from
-	VkImageCreateInfo imageCreateCI(vks::initializers::imageCreateInfo());
-	imageCreateCI.imageType = VK_IMAGE_TYPE_2D;
-	// Note that vkCmdBlitImage (if supported) will also do format conversions if the swapchain color format would differ
-	imageCreateCI.format = VK_FORMAT_R8G8B8A8_UNORM;
-	imageCreateCI.extent.width = width;
-	imageCreateCI.extent.height = height;
-	imageCreateCI.extent.depth = 1;
-	imageCreateCI.arrayLayers = 1;
-	imageCreateCI.mipLevels = 1;
-	imageCreateCI.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-	imageCreateCI.samples = VK_SAMPLE_COUNT_1_BIT;
-	imageCreateCI.tiling = VK_IMAGE_TILING_LINEAR;
-	imageCreateCI.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
-	// Create the image
-	VkImage dstImage;
-	VK_CHECK_RESULT(vkCreateImage(device, &imageCreateCI, nullptr, &dstImage));
-	// Create memory to back up the image
-	VkMemoryRequirements memRequirements;
-	VkMemoryAllocateInfo memAllocInfo(vks::initializers::memoryAllocateInfo());
-	VkDeviceMemory dstImageMemory;
-	vkGetImageMemoryRequirements(device, dstImage, &memRequirements);
-	memAllocInfo.allocationSize = memRequirements.size;
-	// Memory must be host visible to copy from
-	memAllocInfo.memoryTypeIndex = vulkanDevice->getMemoryType(memRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-	VK_CHECK_RESULT(vkAllocateMemory(device, &memAllocInfo, nullptr, &dstImageMemory));
-	VK_CHECK_RESULT(vkBindImageMemory(device, dstImage, dstImageMemory, 0));
-
-	// Do the actual blit from the swapchain image to our host visible destination image
-	VkCommandBuffer copyCmd = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+	PROFILE_SCOPE("saveScreenshot");
+	vks::Buffer readback;
+	VK_CHECK_RESULT(vulkanDevice->createBuffer(
+		VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&readback,
+		static_cast<VkDeviceSize>(width) * height * 4 * sizeof(float)));
+	vkDebug.setBufferName(readback.buffer, "ImageReadback");
+	VK_CHECK_RESULT(readback.map());
+	readbackStorageImage(readback, { width, height });
+
+	// Rows go from the mapped memory straight into the encoder
+	std::unique_ptr<ImageWriter> writer = ImageWriter::create(filename, settings.halfFloat, settings.srgb);
+	writer->open(filename, width, height);
+	writer->writeRows(static_cast<const float*>(readback.mapped), height);
+	writer->close();
+	readback.destroy();
 
-	// Transition destination image to transfer destination layout
-	vks::tools::insertImageMemoryBarrier(
-		copyCmd,
-		dstImage,
-		0,
-		VK_ACCESS_TRANSFER_WRITE_BIT,
-		VK_IMAGE_LAYOUT_UNDEFINED,
-		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-		VK_PIPELINE_STAGE_TRANSFER_BIT,
-		VK_PIPELINE_STAGE_TRANSFER_BIT,
-		VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+	std::cout << "Screenshot " << filename << " saved to disk" << std::endl;
+}
+
+void VulkanRaytracer::readbackStorageImage(const vks::Buffer& buffer, VkExtent2D extent)
+{
+	PROFILE_SCOPE("readbackStorageImage");
+	VkCommandBuffer copyCmd = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+	gpuProfiler.reset(copyCmd, gpuProfiler.setupSlot());
+	gpuProfiler.begin(copyCmd, gpuProfiler.setupSlot(), GpuProfiler::PHASE_COPY);
 
-	// Transition swapchain image from present to transfer source layout
+	// The storage image stays in general layout, only the ray tracing writes have to be visible to the copy
 	vks::tools::insertImageMemoryBarrier(
 		copyCmd,
-		srcImage,
-		VK_ACCESS_MEMORY_READ_BIT,
+		storageImage.image,
+		VK_ACCESS_SHADER_WRITE_BIT,
 		VK_ACCESS_TRANSFER_READ_BIT,
-		VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_IMAGE_LAYOUT_GENERAL,
+		VK_IMAGE_LAYOUT_GENERAL,
+		VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
 		VK_PIPELINE_STAGE_TRANSFER_BIT,
 		VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
 
-	// If source and destination support blit we'll blit as this also does automatic format conversion (e.g. from BGR to RGB)
-	if (supportsBlit)
-	{
-		// Define the region to blit (we will blit the whole swapchain image)
-		VkOffset3D blitSize;
-		blitSize.x = width;
-		blitSize.y = height;
-		blitSize.z = 1;
-		VkImageBlit imageBlitRegion{};
-		imageBlitRegion.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		imageBlitRegion.srcSubresource.layerCount = 1;
-		imageBlitRegion.srcOffsets[1] = blitSize;
-		imageBlitRegion.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		imageBlitRegion.dstSubresource.layerCount = 1;
-		imageBlitRegion.dstOffsets[1] = blitSize;
-
-		// Issue the blit command
-		vkCmdBlitImage(
-			copyCmd,
-			srcImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-			dstImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-			1,
-			&imageBlitRegion,
-			VK_FILTER_NEAREST);
-	}
-	else
+	VkBufferImageCopy copyRegion{};
+	copyRegion.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+	copyRegion.imageExtent = { extent.width, extent.height, 1 };
+	vkCmdCopyImageToBuffer(copyCmd, storageImage.image, VK_IMAGE_LAYOUT_GENERAL, buffer.buffer, 1, &copyRegion);
+	gpuProfiler.end(copyCmd, gpuProfiler.setupSlot(), GpuProfiler::PHASE_COPY);
+	flushSetupCommandBuffer(copyCmd);
+}
+
+/*
+	Submits a one-off command buffer and waits for it, its GPU timings are written right after
+*/
+void VulkanRaytracer::flushSetupCommandBuffer(VkCommandBuffer commandBuffer)
+{
+	gpuProfiler.submit(gpuProfiler.setupSlot());
+	vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+	gpuProfiler.collect(gpuProfiler.setupSlot());
+}
+
+void VulkanRaytracer::requestScreenshot(const std::string& filename)
+{
+	if (capture.requested || capture.submitted || capture.encoding)
 	{
-		// Otherwise use image copy (requires us to manually flip components)
-		VkImageCopy imageCopyRegion{};
-		imageCopyRegion.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		imageCopyRegion.srcSubresource.layerCount = 1;
-		imageCopyRegion.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		imageCopyRegion.dstSubresource.layerCount = 1;
-		imageCopyRegion.extent.width = width;
-		imageCopyRegion.extent.height = height;
-		imageCopyRegion.extent.depth = 1;
-
-		// Issue the copy command
-		vkCmdCopyImage(
-			copyCmd,
-			srcImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-			dstImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-			1,
-			&imageCopyRegion);
+		std::cout << "Screenshot " << capture.filename << " is still being saved" << std::endl;
+		return;
 	}
+	capture.filename = filename;
+	capture.requested = true;
+}
 
-	// Transition destination image to general layout, which is the required layout for mapping the image memory later on
-	vks::tools::insertImageMemoryBarrier(
-		copyCmd,
-		dstImage,
-		VK_ACCESS_TRANSFER_WRITE_BIT,
-		VK_ACCESS_MEMORY_READ_BIT,
-		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-		VK_IMAGE_LAYOUT_GENERAL,
-		VK_PIPELINE_STAGE_TRANSFER_BIT,
-		VK_PIPELINE_STAGE_TRANSFER_BIT,
-		VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+void VulkanRaytracer::createCaptureResources()
+{
+	capture.extent = { width, height };
+	VK_CHECK_RESULT(vulkanDevice->createBuffer(
+		VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&capture.readback,
+		static_cast<VkDeviceSize>(width) * height * 4 * sizeof(float)));
+	VK_CHECK_RESULT(capture.readback.map());
+	vkDebug.setBufferName(capture.readback.buffer, "ScreenshotReadback");
+
+	VkFenceCreateInfo fenceCI = vks::initializers::fenceCreateInfo();
+	VK_CHECK_RESULT(vkCreateFence(device, &fenceCI, VK_NULL_HANDLE, &capture.fence));
 
-	// Transition back the swap chain image after the blit is done
+	// Recorded once, the storage image only changes on resize
+	capture.copyCmd = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, cmdPool, true);
 	vks::tools::insertImageMemoryBarrier(
-		copyCmd,
-		srcImage,
+		capture.copyCmd,
+		storageImage.image,
+		VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_READ_BIT,
 		VK_ACCESS_TRANSFER_READ_BIT,
-		VK_ACCESS_MEMORY_READ_BIT,
-		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-		VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_IMAGE_LAYOUT_GENERAL,
+		VK_IMAGE_LAYOUT_GENERAL,
+		VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_TRANSFER_BIT,
 		VK_PIPELINE_STAGE_TRANSFER_BIT,
 		VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+	VkBufferImageCopy copyRegion{};
+	copyRegion.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+	copyRegion.imageExtent = { width, height, 1 };
+	vkCmdCopyImageToBuffer(capture.copyCmd, storageImage.image, VK_IMAGE_LAYOUT_GENERAL, capture.readback.buffer, 1, &copyRegion);
+	// Make the transfer write visible to the host mapping
+	VkBufferMemoryBarrier hostBarrier = vks::initializers::bufferMemoryBarrier();
+	hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	hostBarrier.buffer = capture.readback.buffer;
+	hostBarrier.size = VK_WHOLE_SIZE;
+	vkCmdPipelineBarrier(capture.copyCmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &hostBarrier, 0, nullptr);
+	VK_CHECK_RESULT(vkEndCommandBuffer(capture.copyCmd));
+}
 
-	vulkanDevice->flushCommandBuffer(copyCmd, queue);
-
-	// Get layout of the image (including row pitch)
-	VkImageSubresource subResource{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 0 };
-	VkSubresourceLayout subResourceLayout;
-	vkGetImageSubresourceLayout(device, dstImage, &subResource, &subResourceLayout);
+void VulkanRaytracer::destroyCaptureResources()
+{
+	if (capture.worker.joinable())
+	{
+		capture.worker.join();
+	}
+	if (capture.submitted)
+	{
+		VK_CHECK_RESULT(vkWaitForFences(device, 1, &capture.fence, VK_TRUE, UINT64_MAX));
+		capture.submitted = false;
+	}
+	if (capture.copyCmd != VK_NULL_HANDLE)
+	{
+		vkFreeCommandBuffers(device, cmdPool, 1, &capture.copyCmd);
+		vkDestroyFence(device, capture.fence, VK_NULL_HANDLE);
+		capture.readback.destroy();
+		capture.copyCmd = VK_NULL_HANDLE;
+		capture.fence = VK_NULL_HANDLE;
+		capture.readback = vks::Buffer();
+	}
+}
 
-	// Map image memory so we can start copying from it
-	void* data;
-	vkMapMemory(device, dstImageMemory, 0, VK_WHOLE_SIZE, 0, &data);
-	auto* byteData = static_cast<uint8_t*>(data);
-	byteData += subResourceLayout.offset;
-	std::vector<uint8_t> buffer;
-	buffer.resize(height * width * 3, 0);
+void VulkanRaytracer::pollCapture()
+{
+	if (!capture.submitted || vkGetFenceStatus(device, capture.fence) != VK_SUCCESS)
+	{
+		return;
+	}
+	VK_CHECK_RESULT(vkResetFences(device, 1, &capture.fence));
+	capture.submitted = false;
 
-	for (uint32_t y = 0; y < height; ++y)
+	if (capture.worker.joinable())
 	{
-		auto* row = reinterpret_cast<uint32_t*>(byteData);
-		for (uint32_t x = 0; x < width; ++x)
+		capture.worker.join();
+	}
+	capture.encoding = true;
+	capture.worker = std::thread([this, filename = capture.filename, extent = capture.extent, halfFloat = settings.halfFloat, srgb = settings.srgb]() {
+		try
 		{
-			uint32_t pixelPos = (y * width + x) * 3;
-			buffer[pixelPos] = *(reinterpret_cast<uint8_t*>(row));
-			buffer[pixelPos + 1] = *(reinterpret_cast<uint8_t*>(row) + 1);
-			buffer[pixelPos + 2] = *(reinterpret_cast<uint8_t*>(row) + 2);
-			++row;
+			std::unique_ptr<ImageWriter> writer = ImageWriter::create(filename, halfFloat, srgb);
+			writer->open(filename, extent.width, extent.height);
+			writer->writeRows(static_cast<const float*>(capture.readback.mapped), extent.height);
+			writer->close();
+			std::cout << "Screenshot " << filename << " saved to disk" << std::endl;
 		}
-		byteData += subResourceLayout.rowPitch;
-	}
-
-	FIBITMAP* img = FreeImage_ConvertFromRawBits(buffer.data(), width, height, width * 3, 24, 0xFF0000, 0x00FF00, 0x0000FF, true);
-	FreeImage_Save(FIF_PNG, img, filename.c_str(), 0);
-
-	std::cout << "Screenshot " << filename << " saved to disk" << std::endl;
-
-	// Clean up resources
-	vkUnmapMemory(device, dstImageMemory);
-	vkFreeMemory(device, dstImageMemory, nullptr);
-	vkDestroyImage(device, dstImage, nullptr);
+		catch (const std::exception& e)
+		{
+			std::cerr << e.what() << std::endl;
+		}
+		capture.encoding = false;
+	});
 }
 
 void VulkanRaytracer::windowResize()
@@ -909,6 +1400,7 @@ void VulkanRaytracer::windowResize()
 	// Recreate the frame buffers
 	vkDestroyImageView(device, depthStencil.view, VK_NULL_HANDLE);
 	vkDestroyImage(device, depthStencil.image, VK_NULL_HANDLE);
+	MemoryTracker::freed(depthStencil.mem);
 	vkFreeMemory(device, depthStencil.mem, VK_NULL_HANDLE);
 	setupDepthStencil();
 	for (uint32_t i = 0; i < frameBuffers.size(); i++) {
@@ -964,6 +1456,7 @@ ScratchBuffer VulkanRaytracer::createScratchBuffer(VkDeviceSize size)
 	memoryAllocateInfo.allocationSize = memoryRequirements.size;
 	memoryAllocateInfo.memoryTypeIndex = vulkanDevice->getMemoryType(memoryRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 	VK_CHECK_RESULT(vkAllocateMemory(vulkanDevice->logicalDevice, &memoryAllocateInfo, VK_NULL_HANDLE, &scratchBuffer.memory));
+	MemoryTracker::allocated(scratchBuffer.memory, memoryRequirements.size, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, scratchBuffer.handle, "Scratch");
 	VK_CHECK_RESULT(vkBindBufferMemory(vulkanDevice->logicalDevice, scratchBuffer.handle, scratchBuffer.memory, 0));
 	scratchBuffer.deviceAddress = getBufferDeviceAddress(scratchBuffer.handle);
 	return scratchBuffer;
@@ -972,6 +1465,7 @@ ScratchBuffer VulkanRaytracer::createScratchBuffer(VkDeviceSize size)
 void VulkanRaytracer::deleteScratchBuffer(ScratchBuffer& scratchBuffer)
 {
 	if (scratchBuffer.memory != VK_NULL_HANDLE) {
+		MemoryTracker::freed(scratchBuffer.memory);
 		vkFreeMemory(device, scratchBuffer.memory, VK_NULL_HANDLE);
 	}
 	if (scratchBuffer.handle != VK_NULL_HANDLE) {
@@ -995,11 +1489,14 @@ VkDeviceAddress VulkanRaytracer::getBufferDeviceAddress(VkBuffer buffer)
 */
 void VulkanRaytracer::createStorageImage()
 {
+	// Full float radiance, quantization only happens when a PNG is written or the image is blitted for display
+	storageImage.format = VK_FORMAT_R32G32B32A32_SFLOAT;
+
 	VkImageCreateInfo image = vks::initializers::imageCreateInfo();
 	image.imageType = VK_IMAGE_TYPE_2D;
-	image.format = swapChain.colorFormat;
-	image.extent.width = width;
-	image.extent.height = height;
+	image.format = storageImage.format;
+	image.extent.width = storageExtent.width;
+	image.extent.height = storageExtent.height;
 	image.extent.depth = 1;
 	image.mipLevels = 1;
 	image.arrayLayers = 1;
@@ -1015,11 +1512,12 @@ void VulkanRaytracer::createStorageImage()
 	memoryAllocateInfo.allocationSize = memReqs.size;
 	memoryAllocateInfo.memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 	VK_CHECK_RESULT(vkAllocateMemory(device, &memoryAllocateInfo, VK_NULL_HANDLE, &storageImage.memory));
+	MemoryTracker::allocated(storageImage.memory, memReqs.size, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_NULL_HANDLE, "StorageImage");
 	VK_CHECK_RESULT(vkBindImageMemory(device, storageImage.image, storageImage.memory, 0));
 
 	VkImageViewCreateInfo colorImageView = vks::initializers::imageViewCreateInfo();
 	colorImageView.viewType = VK_IMAGE_VIEW_TYPE_2D;
-	colorImageView.format = swapChain.colorFormat;
+	colorImageView.format = storageImage.format;
 	colorImageView.subresourceRange = {};
 	colorImageView.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
 	colorImageView.subresourceRange.baseMipLevel = 0;
@@ -1056,6 +1554,7 @@ void VulkanRaytracer::createAccelerationStructure(AccelerationStructure& acceler
 	memoryAllocateInfo.allocationSize = memoryRequirements.size;
 	memoryAllocateInfo.memoryTypeIndex = vulkanDevice->getMemoryType(memoryRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 	VK_CHECK_RESULT(vkAllocateMemory(vulkanDevice->logicalDevice, &memoryAllocateInfo, VK_NULL_HANDLE, &accelerationStructure.memory));
+	MemoryTracker::allocated(accelerationStructure.memory, memoryRequirements.size, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, accelerationStructure.buffer, "AccelerationStructure");
 	VK_CHECK_RESULT(vkBindBufferMemory(vulkanDevice->logicalDevice, accelerationStructure.buffer, accelerationStructure.memory, 0));
 	// Acceleration structure
 	VkAccelerationStructureCreateInfoKHR accelerationStructureCreate_info{};
@@ -1073,26 +1572,64 @@ void VulkanRaytracer::createAccelerationStructure(AccelerationStructure& acceler
 
 void VulkanRaytracer::deleteAccelerationStructure(AccelerationStructure& accelerationStructure)
 {
+	MemoryTracker::freed(accelerationStructure.memory);
 	vkFreeMemory(device, accelerationStructure.memory, VK_NULL_HANDLE);
 	vkDestroyBuffer(device, accelerationStructure.buffer, VK_NULL_HANDLE);
 	vkDestroyAccelerationStructureKHR(device, accelerationStructure.handle, VK_NULL_HANDLE);
 }
 
 /*
-	Create the bottom level acceleration structure contains the scene's actual geometry (vertices, triangles)
+	Create the bottom level acceleration structures that contain the scene's actual geometry (vertices, triangles),
+	one per mesh. All of them index into the shared vertex and index buffers
 */
 void VulkanRaytracer::createBottomLevelAccelerationStructureTriangles()
 {
-	uint32_t numTriangles = scene.indices.size() / 3;
-	if (!numTriangles)
-		return;
+	PROFILE_SCOPE("createBottomLevelAccelerationStructureTriangles");
+	const auto tStart = std::chrono::high_resolution_clock::now();
+	meshBlases.resize(scene.meshes.size());
+	animation.blasScratch.assign(scene.meshes.size(), ScratchBuffer{});
+	animation.refitsSinceBuild.assign(scene.meshes.size(), 0);
+	animation.builtPositions.assign(scene.meshes.size(), {});
+	animation.builtDiagonal.assign(scene.meshes.size(), 0.0f);
+	for (size_t i = 0; i < scene.meshes.size(); ++i)
+	{
+		const Mesh& mesh = scene.meshes[i];
+		createMeshBlas(mesh, meshBlases[i], mesh.dynamic ? &animation.blasScratch[i] : nullptr);
+		if (mesh.dynamic)
+		{
+			animation.builtDiagonal[i] = recordBuiltPositions(scene.vertices.data() + mesh.firstVertex, mesh.vertexCount, animation.builtPositions[i]);
+		}
+	}
+	// Deformed vertices of all dynamic meshes are staged together for one copy per frame
+	VkDeviceSize deformedSize = 0;
+	for (const Mesh& mesh : scene.meshes)
+	{
+		deformedSize += mesh.vertexCount * sizeof(Vertex);
+	}
+	if (deformedSize > 0)
+	{
+		VK_CHECK_RESULT(vulkanDevice->createBuffer(
+			VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			&animation.vertexStaging,
+			deformedSize));
+		vkDebug.setBufferName(animation.vertexStaging.buffer, "DeformStaging");
+		VK_CHECK_RESULT(animation.vertexStaging.map());
+	}
+	if (!scene.meshes.empty())
+	{
+		const double buildMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tStart).count();
+		std::cout << "Built " << scene.meshes.size() << " triangle BLAS (" << scene.indices.size() / 3 << " triangles) in " << buildMs << " ms" << std::endl;
+	}
+}
 
+VkAccelerationStructureGeometryKHR VulkanRaytracer::trianglesGeometry()
+{
 	VkDeviceOrHostAddressConstKHR vertexBufferDeviceAddress{};
-  vertexBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(scene.verticesBuf.buffer);
+	vertexBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(scene.verticesBuf.buffer);
 	VkDeviceOrHostAddressConstKHR indexBufferDeviceAddress{};
 	indexBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(scene.indicesBuf.buffer);
 
-	// Build
 	VkAccelerationStructureGeometryKHR accelerationStructureGeometry{};
 	accelerationStructureGeometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
 	accelerationStructureGeometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
@@ -1106,12 +1643,26 @@ void VulkanRaytracer::createBottomLevelAccelerationStructureTriangles()
 	accelerationStructureGeometry.geometry.triangles.indexData = indexBufferDeviceAddress;
 	accelerationStructureGeometry.geometry.triangles.transformData.deviceAddress = 0;
 	accelerationStructureGeometry.geometry.triangles.transformData.hostAddress = VK_NULL_HANDLE;
+	return accelerationStructureGeometry;
+}
+
+void VulkanRaytracer::createMeshBlas(const Mesh& mesh, AccelerationStructure& blas, ScratchBuffer* updateScratch)
+{
+	uint32_t numTriangles = mesh.indexCount / 3;
+
+	// Build
+	VkAccelerationStructureGeometryKHR accelerationStructureGeometry = trianglesGeometry();
+
+	// Static meshes are traced far more often than built, dynamic ones are refit in place
+	const VkBuildAccelerationStructureFlagsKHR buildFlags = mesh.dynamic ?
+		VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR :
+		VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
 
 	// Get size info
 	VkAccelerationStructureBuildGeometryInfoKHR accelerationStructureBuildGeometryInfo{};
 	accelerationStructureBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
 	accelerationStructureBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-	accelerationStructureBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+	accelerationStructureBuildGeometryInfo.flags = buildFlags;
 	accelerationStructureBuildGeometryInfo.geometryCount = 1;
 	accelerationStructureBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
 
@@ -1124,25 +1675,28 @@ void VulkanRaytracer::createBottomLevelAccelerationStructureTriangles()
 		&numTriangles,
 		&accelerationStructureBuildSizesInfo);
 
-	createAccelerationStructure(trianglesBlas, VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, accelerationStructureBuildSizesInfo);
-	vkDebug.setBufferName(trianglesBlas.buffer, "TrianglesBLAS");
+	createAccelerationStructure(blas, VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, accelerationStructureBuildSizesInfo);
+	vkDebug.setBufferName(blas.buffer, "TrianglesBLAS");
 
 	// Create a small scratch buffer used during build of the bottom level acceleration structure
-	ScratchBuffer scratchBuffer = createScratchBuffer(accelerationStructureBuildSizesInfo.buildScratchSize);
+	ScratchBuffer scratchBuffer = createScratchBuffer(updateScratch ?
+		std::max(accelerationStructureBuildSizesInfo.buildScratchSize, accelerationStructureBuildSizesInfo.updateScratchSize) :
+		accelerationStructureBuildSizesInfo.buildScratchSize);
 
 	VkAccelerationStructureBuildGeometryInfoKHR accelerationBuildGeometryInfo{};
 	accelerationBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
 	accelerationBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-	accelerationBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+	accelerationBuildGeometryInfo.flags = buildFlags;
 	accelerationBuildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-	accelerationBuildGeometryInfo.dstAccelerationStructure = trianglesBlas.handle;
+	accelerationBuildGeometryInfo.dstAccelerationStructure = blas.handle;
 	accelerationBuildGeometryInfo.geometryCount = 1;
 	accelerationBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
 	accelerationBuildGeometryInfo.scratchData.deviceAddress = scratchBuffer.deviceAddress;
 
+	// For indexed triangles the primitive offset is the byte offset of the mesh in the index buffer
 	VkAccelerationStructureBuildRangeInfoKHR accelerationStructureBuildRangeInfo{};
 	accelerationStructureBuildRangeInfo.primitiveCount = numTriangles;
-	accelerationStructureBuildRangeInfo.primitiveOffset = 0;
+	accelerationStructureBuildRangeInfo.primitiveOffset = mesh.firstIndex * sizeof(uint32_t);
 	accelerationStructureBuildRangeInfo.firstVertex = 0;
 	accelerationStructureBuildRangeInfo.transformOffset = 0;
 	std::vector<VkAccelerationStructureBuildRangeInfoKHR*> accelerationBuildStructureRangeInfos = { &accelerationStructureBuildRangeInfo };
@@ -1161,19 +1715,30 @@ void VulkanRaytracer::createBottomLevelAccelerationStructureTriangles()
 	{
 		// Acceleration structure needs to be build on the device
 		VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+		gpuProfiler.reset(commandBuffer, gpuProfiler.setupSlot());
+		gpuProfiler.begin(commandBuffer, gpuProfiler.setupSlot(), GpuProfiler::PHASE_AS_BUILD);
 		vkCmdBuildAccelerationStructuresKHR(
 			commandBuffer,
 			1,
 			&accelerationBuildGeometryInfo,
 			accelerationBuildStructureRangeInfos.data());
-		vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+		gpuProfiler.end(commandBuffer, gpuProfiler.setupSlot(), GpuProfiler::PHASE_AS_BUILD);
+		flushSetupCommandBuffer(commandBuffer);
 	}
 
-	deleteScratchBuffer(scratchBuffer);
+	if (updateScratch)
+	{
+		*updateScratch = scratchBuffer;
+	}
+	else
+	{
+		deleteScratchBuffer(scratchBuffer);
+	}
 }
 
 void VulkanRaytracer::createBottomLevelAccelerationStructureSpheres()
 {
+	PROFILE_SCOPE("createBottomLevelAccelerationStructureSpheres");
 	uint32_t numAabbs = scene.aabbs.size();
 	if (!numAabbs)
 		return;
@@ -1244,21 +1809,21 @@ void VulkanRaytracer::createBottomLevelAccelerationStructureSpheres()
 	{
 		// Acceleration structure needs to be build on the device
 		VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+		gpuProfiler.reset(commandBuffer, gpuProfiler.setupSlot());
+		gpuProfiler.begin(commandBuffer, gpuProfiler.setupSlot(), GpuProfiler::PHASE_AS_BUILD);
 		vkCmdBuildAccelerationStructuresKHR(
 			commandBuffer,
 			1,
 			&accelerationBuildGeometryInfo,
 			accelerationBuildStructureRangeInfos.data());
-		vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+		gpuProfiler.end(commandBuffer, gpuProfiler.setupSlot(), GpuProfiler::PHASE_AS_BUILD);
+		flushSetupCommandBuffer(commandBuffer);
 	}
 
 	deleteScratchBuffer(scratchBuffer);
 }
 
-/*
-	The top level acceleration structure contains the scene's object instances
-*/
-void VulkanRaytracer::createTopLevelAccelerationStructure()
+std::vector<VkAccelerationStructureInstanceKHR> VulkanRaytracer::tlasInstances(float time) const
 {
 	VkTransformMatrixKHR transformMatrix = {
 		1.0f, 0.0f, 0.0f, 0.0f,
@@ -1268,24 +1833,49 @@ void VulkanRaytracer::createTopLevelAccelerationStructure()
 
 	std::vector<VkAccelerationStructureInstanceKHR> instances;
 	VkAccelerationStructureInstanceKHR instance{};
-	instance.transform = transformMatrix;
 	instance.mask = 0xFF;
 	instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
-	if (!scene.vertices.empty())
+	// The custom index selects the instance data of the triangle hit shaders
+	for (uint32_t i = 0; i < scene.meshPlacements.size(); ++i)
 	{
-		instance.instanceCustomIndex = 0;
+		const MeshPlacement& placement = scene.meshPlacements[i];
+		const mat4 transform = scene.placementTransform(placement, time);
+		// VkTransformMatrixKHR is a row major 3x4 matrix, glm stores columns
+		for (int row = 0; row < 3; ++row)
+		{
+			for (int column = 0; column < 4; ++column)
+			{
+				instance.transform.matrix[row][column] = transform[column][row];
+			}
+		}
+		instance.instanceCustomIndex = i;
 		instance.instanceShaderBindingTableRecordOffset = 0;
-		instance.accelerationStructureReference = trianglesBlas.deviceAddress;
+		instance.accelerationStructureReference = meshBlases[placement.mesh].deviceAddress;
 		instances.push_back(instance);
 	}
 
 	if (!scene.spheres.empty())
 	{
-		instance.instanceCustomIndex = 1;
+		instance.transform = transformMatrix;
+		instance.instanceCustomIndex = 0;
 		instance.instanceShaderBindingTableRecordOffset = 1;
 		instance.accelerationStructureReference = spheresBlas.deviceAddress;
 		instances.push_back(instance);
 	}
+	return instances;
+}
+
+/*
+	The top level acceleration structure contains the scene's object instances
+*/
+void VulkanRaytracer::createTopLevelAccelerationStructure()
+{
+	PROFILE_SCOPE("createTopLevelAccelerationStructure");
+	std::vector<VkAccelerationStructureInstanceKHR> instances = tlasInstances(animation.time);
+	// Animated scenes rebuild the TLAS every frame, a fast build pays off over a few traced passes
+	const bool animated = scene.animated();
+	const VkBuildAccelerationStructureFlagsKHR buildFlags = animated ?
+		VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR : VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
 
 	// Buffer for instance data
 	vks::Buffer instancesBuffer;
@@ -1295,6 +1885,7 @@ void VulkanRaytracer::createTopLevelAccelerationStructure()
 		&instancesBuffer,
 		sizeof(VkAccelerationStructureInstanceKHR) * instances.size(),
 		instances.data()));
+	vkDebug.setBufferName(instancesBuffer.buffer, "TlasInstances");
 
 	VkDeviceOrHostAddressConstKHR instanceDataDeviceAddress{};
 	instanceDataDeviceAddress.deviceAddress = getBufferDeviceAddress(instancesBuffer.buffer);
@@ -1311,7 +1902,7 @@ void VulkanRaytracer::createTopLevelAccelerationStructure()
 	VkAccelerationStructureBuildGeometryInfoKHR accelerationStructureBuildGeometryInfo{};
 	accelerationStructureBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
 	accelerationStructureBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-	accelerationStructureBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+	accelerationStructureBuildGeometryInfo.flags = buildFlags;
 	accelerationStructureBuildGeometryInfo.geometryCount = 1;
 	accelerationStructureBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
 
@@ -1334,7 +1925,7 @@ void VulkanRaytracer::createTopLevelAccelerationStructure()
 	VkAccelerationStructureBuildGeometryInfoKHR accelerationBuildGeometryInfo{};
 	accelerationBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
 	accelerationBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-	accelerationBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+	accelerationBuildGeometryInfo.flags = buildFlags;
 	accelerationBuildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
 	accelerationBuildGeometryInfo.dstAccelerationStructure = topLevelAS.handle;
 	accelerationBuildGeometryInfo.geometryCount = 1;
@@ -1362,16 +1953,192 @@ void VulkanRaytracer::createTopLevelAccelerationStructure()
 	{
 		// Acceleration structure needs to be build on the device
 		VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+		gpuProfiler.reset(commandBuffer, gpuProfiler.setupSlot());
+		gpuProfiler.begin(commandBuffer, gpuProfiler.setupSlot(), GpuProfiler::PHASE_AS_BUILD);
 		vkCmdBuildAccelerationStructuresKHR(
 			commandBuffer,
 			1,
 			&accelerationBuildGeometryInfo,
 			accelerationBuildStructureRangeInfos.data());
-		vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+		gpuProfiler.end(commandBuffer, gpuProfiler.setupSlot(), GpuProfiler::PHASE_AS_BUILD);
+		flushSetupCommandBuffer(commandBuffer);
 	}
 
-	deleteScratchBuffer(scratchBuffer);
-	instancesBuffer.destroy();
+	if (animated)
+	{
+		animation.instances = instancesBuffer;
+		VK_CHECK_RESULT(animation.instances.map());
+		animation.tlasScratch = scratchBuffer;
+	}
+	else
+	{
+		deleteScratchBuffer(scratchBuffer);
+		instancesBuffer.destroy();
+	}
+}
+
+void VulkanRaytracer::destroyAnimationResources()
+{
+	for (ScratchBuffer& scratchBuffer : animation.blasScratch)
+	{
+		deleteScratchBuffer(scratchBuffer);
+	}
+	deleteScratchBuffer(animation.tlasScratch);
+	animation.instances.destroy();
+	animation.vertexStaging.destroy();
+	animation = decltype(animation){};
+}
+
+void VulkanRaytracer::updateSceneAnimation(float time, bool fullRebuild)
+{
+	PROFILE_SCOPE("updateSceneAnimation");
+	// The previous frame may still trace the structures and vertices rewritten here
+	VK_CHECK_RESULT(vkQueueWaitIdle(queue));
+	animation.time = time;
+
+	std::vector<VkAccelerationStructureInstanceKHR> instances = tlasInstances(time);
+	memcpy(animation.instances.mapped, instances.data(), instances.size() * sizeof(VkAccelerationStructureInstanceKHR));
+
+	VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+	gpuProfiler.reset(commandBuffer, gpuProfiler.setupSlot());
+
+	// Refits keep the tree of the last build and only move its bounds, which grow looser the further the vertices
+	// drift from where they were built. Past settings.refitDrift or settings.refitLimit refits the BLAS is built again
+	std::vector<VkBufferCopy> vertexCopies;
+	std::vector<bool> refits(scene.meshes.size(), false);
+	Vertex* staged = static_cast<Vertex*>(animation.vertexStaging.mapped);
+	for (size_t i = 0; i < scene.meshes.size(); ++i)
+	{
+		const Mesh& mesh = scene.meshes[i];
+		if (mesh.vertexCount == 0)
+		{
+			continue;
+		}
+		scene.deformVertices(mesh, time, staged);
+		if (mesh.dynamic)
+		{
+			refits[i] = !fullRebuild && animation.refitsSinceBuild[i] < settings.refitLimit &&
+				vertexDrift(staged, animation.builtPositions[i], animation.builtDiagonal[i]) < settings.refitDrift;
+			animation.refitsSinceBuild[i] = refits[i] ? animation.refitsSinceBuild[i] + 1 : 0;
+			if (!refits[i])
+			{
+				++animation.rebuilds;
+				animation.builtDiagonal[i] = recordBuiltPositions(staged, mesh.vertexCount, animation.builtPositions[i]);
+			}
+		}
+		vertexCopies.push_back({ (staged - static_cast<Vertex*>(animation.vertexStaging.mapped)) * sizeof(Vertex), mesh.firstVertex * sizeof(Vertex), mesh.vertexCount * sizeof(Vertex) });
+		staged += mesh.vertexCount;
+	}
+	if (!vertexCopies.empty())
+	{
+		gpuProfiler.begin(commandBuffer, gpuProfiler.setupSlot(), GpuProfiler::PHASE_UPLOAD);
+		vkCmdCopyBuffer(commandBuffer, animation.vertexStaging.buffer, scene.verticesBuf.buffer, static_cast<uint32_t>(vertexCopies.size()), vertexCopies.data());
+		gpuProfiler.end(commandBuffer, gpuProfiler.setupSlot(), GpuProfiler::PHASE_UPLOAD);
+		VkMemoryBarrier barrier{};
+		barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+			0, 1, &barrier, 0, nullptr, 0, nullptr);
+	}
+
+	const VkAccelerationStructureGeometryKHR geometry = trianglesGeometry();
+	gpuProfiler.begin(commandBuffer, gpuProfiler.setupSlot(), GpuProfiler::PHASE_AS_BUILD);
+	uint32_t dynamicMeshes = 0;
+	for (size_t i = 0; i < scene.meshes.size(); ++i)
+	{
+		const Mesh& mesh = scene.meshes[i];
+		if (!mesh.dynamic)
+		{
+			continue;
+		}
+		const bool refit = refits[i];
+
+		VkAccelerationStructureBuildGeometryInfoKHR buildGeometryInfo{};
+		buildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+		buildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+		buildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR;
+		buildGeometryInfo.mode = refit ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR : VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+		buildGeometryInfo.srcAccelerationStructure = refit ? meshBlases[i].handle : VK_NULL_HANDLE;
+		buildGeometryInfo.dstAccelerationStructure = meshBlases[i].handle;
+		buildGeometryInfo.geometryCount = 1;
+		buildGeometryInfo.pGeometries = &geometry;
+		buildGeometryInfo.scratchData.deviceAddress = animation.blasScratch[i].deviceAddress;
+
+		VkAccelerationStructureBuildRangeInfoKHR buildRangeInfo{};
+		buildRangeInfo.primitiveCount = mesh.indexCount / 3;
+		buildRangeInfo.primitiveOffset = mesh.firstIndex * sizeof(uint32_t);
+		const VkAccelerationStructureBuildRangeInfoKHR* buildRangeInfos = &buildRangeInfo;
+		vkCmdBuildAccelerationStructuresKHR(commandBuffer, 1, &buildGeometryInfo, &buildRangeInfos);
+		++dynamicMeshes;
+	}
+	if (dynamicMeshes > 0)
+	{
+		VkMemoryBarrier barrier{};
+		barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+		barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+			0, 1, &barrier, 0, nullptr, 0, nullptr);
+	}
+
+	// The TLAS is rebuilt rather than refit, moved instances would stretch its bounds the most
+	VkAccelerationStructureGeometryKHR instancesGeometry{};
+	instancesGeometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+	instancesGeometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+	instancesGeometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+	instancesGeometry.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+	instancesGeometry.geometry.instances.arrayOfPointers = VK_FALSE;
+	instancesGeometry.geometry.instances.data.deviceAddress = getBufferDeviceAddress(animation.instances.buffer);
+
+	VkAccelerationStructureBuildGeometryInfoKHR buildGeometryInfo{};
+	buildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+	buildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+	buildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR;
+	buildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+	buildGeometryInfo.dstAccelerationStructure = topLevelAS.handle;
+	buildGeometryInfo.geometryCount = 1;
+	buildGeometryInfo.pGeometries = &instancesGeometry;
+	buildGeometryInfo.scratchData.deviceAddress = animation.tlasScratch.deviceAddress;
+
+	VkAccelerationStructureBuildRangeInfoKHR buildRangeInfo{};
+	buildRangeInfo.primitiveCount = static_cast<uint32_t>(instances.size());
+	const VkAccelerationStructureBuildRangeInfoKHR* buildRangeInfos = &buildRangeInfo;
+	vkCmdBuildAccelerationStructuresKHR(commandBuffer, 1, &buildGeometryInfo, &buildRangeInfos);
+	gpuProfiler.end(commandBuffer, gpuProfiler.setupSlot(), GpuProfiler::PHASE_AS_BUILD);
+
+	flushSetupCommandBuffer(commandBuffer);
+}
+
+void VulkanRaytracer::benchmarkSceneUpdates()
+{
+	if (!scene.animated())
+	{
+		std::cout << "Update benchmark skipped, the scene has nothing animated" << std::endl;
+		return;
+	}
+
+	// Frames advance like camera path frames, both runs see the same motion
+	const uint32_t frames = settings.updateBenchmarkFrames;
+	const float startTime = animation.time;
+	auto timeUpdates = [&](bool fullRebuild) {
+		const auto tStart = std::chrono::high_resolution_clock::now();
+		for (uint32_t frame = 1; frame <= frames; ++frame)
+		{
+			updateSceneAnimation(startTime + frame / sequenceFrameRate, fullRebuild);
+		}
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tStart).count() / frames;
+	};
+	const uint64_t rebuildsBefore = animation.rebuilds;
+	const double refitMs = timeUpdates(false);
+	const uint64_t driftRebuilds = animation.rebuilds - rebuildsBefore;
+	const double rebuildMs = timeUpdates(true);
+	updateSceneAnimation(startTime, true);
+
+	const size_t dynamicMeshes = std::count_if(scene.meshes.begin(), scene.meshes.end(), [](const Mesh& mesh) { return mesh.dynamic; });
+	std::cout << "Scene update over " << frames << " frames (" << dynamicMeshes << " dynamic BLAS, " << scene.meshPlacements.size() << " instances): "
+		<< refitMs << " ms/frame with refits (" << driftRebuilds << " of " << frames * dynamicMeshes << " BLAS updates rebuilt at drift "
+		<< settings.refitDrift << " or after " << settings.refitLimit << " refits), " << rebuildMs << " ms/frame with full rebuilds" << std::endl;
 }
 
 template <class integral>
@@ -1385,6 +2152,7 @@ constexpr integral alignedSize(integral x, size_t a) noexcept
 */
 void VulkanRaytracer::createShaderBindingTables()
 {
+	PROFILE_SCOPE("createShaderBindingTables");
 	const uint32_t handleSize = rayTracingPipelineProperties.shaderGroupHandleSize;
 	const uint32_t handleSizeAligned = alignedSize(rayTracingPipelineProperties.shaderGroupHandleSize, rayTracingPipelineProperties.shaderGroupBaseAlignment); //shaderGroupHandleAlignment????
 	const uint32_t groupCount = static_cast<uint32_t>(shaderGroups.size());
@@ -1398,6 +2166,7 @@ void VulkanRaytracer::createShaderBindingTables()
 		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
 		&shaderBindingTable,
 		sbtSize));
+	vkDebug.setBufferName(shaderBindingTable.buffer, "ShaderBindingTable");
 
 	shaderBindingTable.map();
 	auto* data = reinterpret_cast<uint8_t*>(shaderBindingTable.mapped);
@@ -1414,11 +2183,12 @@ void VulkanRaytracer::createShaderBindingTables()
 */
 void VulkanRaytracer::createDescriptorSets()
 {
+	PROFILE_SCOPE("createDescriptorSets");
 	std::vector<VkDescriptorPoolSize> poolSizes = {
 		{ VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1 },
 		{ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1 },
 		{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1 },
-		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 7 }
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 15 }
 	};
 	VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = vks::initializers::descriptorPoolCreateInfo(poolSizes, 1);
 	VK_CHECK_RESULT(vkCreateDescriptorPool(device, &descriptorPoolCreateInfo, VK_NULL_HANDLE, &descriptorPool));
@@ -1449,11 +2219,18 @@ void VulkanRaytracer::createDescriptorSets()
 	VkDescriptorBufferInfo triangleMaterialsBufferDescriptor{ scene.triangleMaterialsBuf.buffer , 0, VK_WHOLE_SIZE };
 	VkDescriptorBufferInfo sphereMaterialsBufferDescriptor{ scene.sphereMaterialsBuf.buffer , 0, VK_WHOLE_SIZE };
 	VkDescriptorBufferInfo quadLightsBufferDescriptor{ scene.quadLightsBuf.buffer , 0, VK_WHOLE_SIZE };
+	VkDescriptorBufferInfo lightAliasTableBufferDescriptor{ scene.lightAliasTableBuf.buffer , 0, VK_WHOLE_SIZE };
+	VkDescriptorBufferInfo blueNoiseBufferDescriptor{ scene.blueNoiseBuf.buffer , 0, VK_WHOLE_SIZE };
+	VkDescriptorBufferInfo meshInstancesBufferDescriptor{ scene.meshInstancesBuf.buffer , 0, VK_WHOLE_SIZE };
 
 	std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
 	accelerationStructureWrite,
 		vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, descriptorSetBindings["resultImage"], &storageImageDescriptor),
-		vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, descriptorSetBindings["uniformBuffer"], &uboData.descriptor)
+		vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, descriptorSetBindings["uniformBuffer"], &uboData.descriptor),
+		vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, descriptorSetBindings["pixelStatsBuffer"], &pixelStatsBuffer.descriptor),
+		vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, descriptorSetBindings["tileStatsBuffer"], &tileStatsBuffer.descriptor),
+		vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, descriptorSetBindings["activeTilesBuffer"], &activeTilesBuffer.descriptor),
+		vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, descriptorSetBindings["rayStatsBuffer"], &rayStatsBuffer.descriptor)
 	};
 
 	if (!scene.vertices.empty())
@@ -1494,6 +2271,21 @@ void VulkanRaytracer::createDescriptorSets()
 		writeDescriptorSets.push_back(vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
 			descriptorSetBindings["quadLightsBuffer"], &quadLightsBufferDescriptor));
 	}
+	if (!scene.lightAliasTable.empty())
+	{
+		writeDescriptorSets.push_back(vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			descriptorSetBindings["lightAliasTableBuffer"], &lightAliasTableBufferDescriptor));
+	}
+	if (!scene.blueNoise.empty())
+	{
+		writeDescriptorSets.push_back(vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			descriptorSetBindings["blueNoiseBuffer"], &blueNoiseBufferDescriptor));
+	}
+	if (!scene.meshInstances.empty())
+	{
+		writeDescriptorSets.push_back(vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			descriptorSetBindings["meshInstancesBuffer"], &meshInstancesBufferDescriptor));
+	}
 
 	vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, VK_NULL_HANDLE);
 }
@@ -1534,10 +2326,11 @@ inline VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo(
 }
 
 /*
-	Create our ray tracing pipeline
+	Create the layouts of our ray tracing pipelines
 */
-void VulkanRaytracer::createRayTracingPipeline()
+void VulkanRaytracer::createPipelineLayout()
 {
+	PROFILE_SCOPE("createPipelineLayout");
 	std::vector<VkDescriptorSetLayoutBinding> bindings({
 		descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, descriptorSetBindings["accelerationStructure"]),
 		descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_RAYGEN_BIT_KHR, descriptorSetBindings["resultImage"]),
@@ -1549,31 +2342,50 @@ void VulkanRaytracer::createRayTracingPipeline()
 		descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, descriptorSetBindings["directLightsBuffer"]),
 		descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, descriptorSetBindings["triangleMaterialsBuffer"]),
 		descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, descriptorSetBindings["sphereMaterialsBuffer"]),
-		descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, descriptorSetBindings["quadLightsBuffer"])
+		descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, descriptorSetBindings["quadLightsBuffer"]),
+		descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, descriptorSetBindings["lightAliasTableBuffer"]),
+		descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, descriptorSetBindings["blueNoiseBuffer"]),
+		descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, descriptorSetBindings["pixelStatsBuffer"]),
+		descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, descriptorSetBindings["tileStatsBuffer"]),
+		descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, descriptorSetBindings["activeTilesBuffer"]),
+		descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, descriptorSetBindings["meshInstancesBuffer"]),
+		descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, descriptorSetBindings["rayStatsBuffer"])
 	});
 
 	VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCI = descriptorSetLayoutCreateInfo(bindings);
 	VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &descriptorSetLayoutCI, VK_NULL_HANDLE, &descriptorSetLayout));
 
+	// Placement of the traced region inside the full image, see updateRenderExtent
+	VkPushConstantRange renderTileRange{ VK_SHADER_STAGE_RAYGEN_BIT_KHR, 0, sizeof(RenderTile) };
 	VkPipelineLayoutCreateInfo pPipelineLayoutCI = pipelineLayoutCreateInfo(&descriptorSetLayout, 1);
+	pPipelineLayoutCI.pushConstantRangeCount = 1;
+	pPipelineLayoutCI.pPushConstantRanges = &renderTileRange;
 	VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pPipelineLayoutCI, VK_NULL_HANDLE, &pipelineLayout));
+}
+
+/*
+	Selects the pipeline variant for the features of the current scene. Every variant is specialized through
+	constants, so shading code for lights and samplers the scene doesn't use is compiled out. Variants are
+	kept for the lifetime of the renderer, a later scene with the same features reuses the pipeline
+*/
+void VulkanRaytracer::createRayTracingPipeline()
+{
+	PROFILE_SCOPE("createRayTracingPipeline");
+	PipelineVariant variant{};
+	variant.maxRecursion = scene.depth;
+	variant.hasDirectLights = !scene.directLights.empty();
+	variant.hasPointLights = !scene.pointLights.empty();
+	variant.hasQuadLights = !scene.quadLights.empty();
+	variant.samplerType = scene.samplerType;
+	variant.lightStratify = scene.lightstratify;
+	variant.rayStats = settings.rayStats;
 
 	std::vector<VkPipelineShaderStageCreateInfo> shaderStages;
+	shaderGroups.clear();
 
 	// Ray generation group
 	shaderStages.push_back(loadShader("shaders/raygen.rgen.spv", VK_SHADER_STAGE_RAYGEN_BIT_KHR));
 
-	VkSpecializationMapEntry specializationMapEntry{};
-	specializationMapEntry.constantID = 0;
-	specializationMapEntry.offset = 0;
-	specializationMapEntry.size = sizeof(uint32_t);
-	VkSpecializationInfo specializationInfo{};
-	specializationInfo.mapEntryCount = 1;
-	specializationInfo.pMapEntries = &specializationMapEntry;
-	specializationInfo.dataSize = sizeof(scene.depth);
-	specializationInfo.pData = &scene.depth;
-	shaderStages.back().pSpecializationInfo = &specializationInfo;
-
 	VkRayTracingShaderGroupCreateInfoKHR rayGenShaderGroup{};
 	rayGenShaderGroup.sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR;
 	rayGenShaderGroup.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
@@ -1644,6 +2456,34 @@ void VulkanRaytracer::createRayTracingPipeline()
 	intersecShaderGroup.intersectionShader = static_cast<uint32_t>(shaderStages.size()) - 1;
 	shaderGroups.push_back(intersecShaderGroup);
 
+	const auto variantKey = std::make_pair(scene.integratorName, variant.features());
+	auto cached = pipelineVariants.find(variantKey);
+	if (cached != pipelineVariants.end())
+	{
+		pipeline = cached->second;
+		return;
+	}
+
+	// Stages ignore the constants they don't declare, so all of them share one specialization
+	const std::array<VkSpecializationMapEntry, 7> specializationMapEntries = { {
+		{ 0, offsetof(PipelineVariant, maxRecursion), sizeof(uint32_t) },
+		{ 1, offsetof(PipelineVariant, hasDirectLights), sizeof(VkBool32) },
+		{ 2, offsetof(PipelineVariant, hasPointLights), sizeof(VkBool32) },
+		{ 3, offsetof(PipelineVariant, hasQuadLights), sizeof(VkBool32) },
+		{ 4, offsetof(PipelineVariant, samplerType), sizeof(uint32_t) },
+		{ 5, offsetof(PipelineVariant, lightStratify), sizeof(VkBool32) },
+		{ 6, offsetof(PipelineVariant, rayStats), sizeof(VkBool32) }
+	} };
+	VkSpecializationInfo specializationInfo{};
+	specializationInfo.mapEntryCount = static_cast<uint32_t>(specializationMapEntries.size());
+	specializationInfo.pMapEntries = specializationMapEntries.data();
+	specializationInfo.dataSize = sizeof(variant);
+	specializationInfo.pData = &variant;
+	for (auto& shaderStage : shaderStages)
+	{
+		shaderStage.pSpecializationInfo = &specializationInfo;
+	}
+
 	VkRayTracingPipelineCreateInfoKHR rayTracingPipelineCI{};
 	rayTracingPipelineCI.sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR;
 	rayTracingPipelineCI.stageCount = static_cast<uint32_t>(shaderStages.size());
@@ -1652,7 +2492,8 @@ void VulkanRaytracer::createRayTracingPipeline()
 	rayTracingPipelineCI.pGroups = shaderGroups.data();
 	rayTracingPipelineCI.maxPipelineRayRecursionDepth = scene.depth;
 	rayTracingPipelineCI.layout = pipelineLayout;
-	VK_CHECK_RESULT(vkCreateRayTracingPipelinesKHR(device, VK_NULL_HANDLE, VK_NULL_HANDLE, 1, &rayTracingPipelineCI, VK_NULL_HANDLE, &pipeline));
+	VK_CHECK_RESULT(vkCreateRayTracingPipelinesKHR(device, VK_NULL_HANDLE, pipelineCache, 1, &rayTracingPipelineCI, VK_NULL_HANDLE, &pipeline));
+	pipelineVariants.emplace(variantKey, pipeline);
 }
 
 /*
@@ -1666,6 +2507,7 @@ void VulkanRaytracer::createUniformBuffers()
 		&uboData,
 		sizeof(uniformData),
 		&uniformData));
+	vkDebug.setBufferName(uboData.buffer, "Uniforms");
 	VK_CHECK_RESULT(uboData.map());
 
 	updateUniformBuffers();
@@ -1679,13 +2521,744 @@ void VulkanRaytracer::handleResize()
 	// Delete allocated resources
 	vkDestroyImageView(device, storageImage.view, VK_NULL_HANDLE);
 	vkDestroyImage(device, storageImage.image, VK_NULL_HANDLE);
+	MemoryTracker::freed(storageImage.memory);
 	vkFreeMemory(device, storageImage.memory, VK_NULL_HANDLE);
-	// Recreate image
+	// Recreate image, the capture copy is recorded against the old one
+	destroyCaptureResources();
+	updateRenderExtent();
 	createStorageImage();
 	// Update descriptor
 	VkDescriptorImageInfo storageImageDescriptor{ VK_NULL_HANDLE, storageImage.view, VK_IMAGE_LAYOUT_GENERAL };
 	VkWriteDescriptorSet resultImageWrite = vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, &storageImageDescriptor);
 	vkUpdateDescriptorSets(device, 1, &resultImageWrite, 0, VK_NULL_HANDLE);
+
+	// The accumulated statistics are per pixel, so they start over at the new size
+	destroyAccumulationBuffers();
+	createAccumulationBuffers();
+	std::vector<VkWriteDescriptorSet> accumulationWrites = {
+		vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, descriptorSetBindings["pixelStatsBuffer"], &pixelStatsBuffer.descriptor),
+		vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, descriptorSetBindings["tileStatsBuffer"], &tileStatsBuffer.descriptor),
+		vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, descriptorSetBindings["activeTilesBuffer"], &activeTilesBuffer.descriptor),
+		vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, descriptorSetBindings["rayStatsBuffer"], &rayStatsBuffer.descriptor)
+	};
+	vkUpdateDescriptorSets(device, static_cast<uint32_t>(accumulationWrites.size()), accumulationWrites.data(), 0, VK_NULL_HANDLE);
+	updateUniformBuffers();
+}
+
+/*
+	Per-pixel running statistics of the accumulated passes and the tile bookkeeping of adaptive sampling
+*/
+void VulkanRaytracer::createAccumulationBuffers()
+{
+	adaptive.tilesX = (storageExtent.width + adaptiveTileSize - 1) / adaptiveTileSize;
+	adaptive.tilesY = (storageExtent.height + adaptiveTileSize - 1) / adaptiveTileSize;
+	const uint32_t tilesNum = adaptive.tilesX * adaptive.tilesY;
+
+	VK_CHECK_RESULT(vulkanDevice->createBuffer(
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		&pixelStatsBuffer,
+		static_cast<VkDeviceSize>(storageExtent.width) * storageExtent.height * sizeof(PixelStats)));
+	vkDebug.setBufferName(pixelStatsBuffer.buffer, "PixelStats");
+
+	// Read and cleared by the host after every pass
+	VK_CHECK_RESULT(vulkanDevice->createBuffer(
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&tileStatsBuffer,
+		tilesNum * sizeof(TileStats)));
+	VK_CHECK_RESULT(tileStatsBuffer.map());
+	vkDebug.setBufferName(tileStatsBuffer.buffer, "TileStats");
+
+	VK_CHECK_RESULT(vulkanDevice->createBuffer(
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&activeTilesBuffer,
+		tilesNum * sizeof(uint32_t)));
+	VK_CHECK_RESULT(activeTilesBuffer.map());
+	vkDebug.setBufferName(activeTilesBuffer.buffer, "ActiveTiles");
+
+	// The per-pixel ray counts are only written by pipelines with ray statistics
+	const VkDeviceSize rayCountsNum = settings.rayStats ? static_cast<VkDeviceSize>(storageExtent.width) * storageExtent.height : 1;
+	VK_CHECK_RESULT(vulkanDevice->createBuffer(
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&rayStatsBuffer,
+		sizeof(RayStats) + rayCountsNum * sizeof(uint32_t)));
+	VK_CHECK_RESULT(rayStatsBuffer.map());
+	vkDebug.setBufferName(rayStatsBuffer.buffer, "RayStats");
+
+	resetAccumulation();
+}
+
+float VulkanRaytracer::estimatedError() const
+{
+	uint64_t errorSum = 0;
+	for (uint32_t tileError : adaptive.tileErrorSums)
+	{
+		errorSum += tileError;
+	}
+	return static_cast<float>(errorSum / tileErrorScale / (static_cast<double>(traceExtent.width) * traceExtent.height));
+}
+
+/*
+	With tiled rendering only a tile sized storage image and its statistics live on the GPU, the raygen
+	shader offsets its launch by renderTile.offset to find the pixel in the full image
+*/
+void VulkanRaytracer::updateRenderExtent()
+{
+	if (settings.tileSize > 0)
+	{
+		storageExtent = { std::min(settings.tileSize, width), std::min(settings.tileSize, height) };
+	}
+	else
+	{
+		storageExtent = { width, height };
+	}
+	traceExtent = storageExtent;
+	renderTile.offset = { 0, 0 };
+	renderTile.imageSize = { width, height };
+}
+
+void VulkanRaytracer::destroyAccumulationBuffers()
+{
+	pixelStatsBuffer.destroy();
+	tileStatsBuffer.destroy();
+	activeTilesBuffer.destroy();
+	rayStatsBuffer.destroy();
+}
+
+void VulkanRaytracer::resetAccumulation()
+{
+	const uint32_t tilesNum = adaptive.tilesX * adaptive.tilesY;
+	uniformData.frameIndex = 0;
+	adaptive.activeTiles.resize(tilesNum);
+	std::iota(adaptive.activeTiles.begin(), adaptive.activeTiles.end(), 0);
+	memcpy(activeTilesBuffer.mapped, adaptive.activeTiles.data(), tilesNum * sizeof(uint32_t));
+	memset(tileStatsBuffer.mapped, 0, tilesNum * sizeof(TileStats));
+	adaptive.tileErrorSums.assign(tilesNum, 0);
+	adaptive.tracedPixelSamples = 0;
+	adaptive.uniformPixelSamples = 0;
+	adaptive.converged = false;
+	memset(rayStatsBuffer.mapped, 0, static_cast<size_t>(rayStatsBuffer.size));
+	rayStats = {};
+}
+
+/*
+	Called after a pass has finished on the GPU. Keeps only the tiles that still have unconverged pixels
+	for the next pass and reports the saved work once the whole image has converged
+*/
+void VulkanRaytracer::updateAccumulation()
+{
+	if (settings.accumulation == ACCUMULATION_OFF || adaptive.converged)
+	{
+		return;
+	}
+
+	auto* tileStats = static_cast<TileStats*>(tileStatsBuffer.mapped);
+	std::vector<uint32_t> nextTiles;
+	for (uint32_t tile : adaptive.activeTiles)
+	{
+		adaptive.tracedPixelSamples += static_cast<uint64_t>(tileStats[tile].tracedPixels) * scene.lightsamples;
+		adaptive.tileErrorSums[tile] = tileStats[tile].relErrorSum;
+		if (tileStats[tile].unconvergedPixels > 0)
+		{
+			nextTiles.push_back(tile);
+		}
+	}
+	adaptive.uniformPixelSamples += static_cast<uint64_t>(traceExtent.width) * traceExtent.height * scene.lightsamples;
+	memset(tileStats, 0, adaptive.tilesX * adaptive.tilesY * sizeof(TileStats));
+	uniformData.frameIndex++;
+
+	if (settings.accumulation != ACCUMULATION_ADAPTIVE)
+	{
+		return;
+	}
+
+	adaptive.activeTiles = std::move(nextTiles);
+	memcpy(activeTilesBuffer.mapped, adaptive.activeTiles.data(), adaptive.activeTiles.size() * sizeof(uint32_t));
+	if (adaptive.activeTiles.empty())
+	{
+		adaptive.converged = true;
+
+		const uint64_t savedSamples = adaptive.uniformPixelSamples - adaptive.tracedPixelSamples;
+		std::cout << "Adaptive sampling converged after " << uniformData.frameIndex << " passes ("
+			<< uniformData.frameIndex * scene.lightsamples << " spp max): traced " << adaptive.tracedPixelSamples
+			<< " of " << adaptive.uniformPixelSamples << " pixel samples, ~" << savedSamples * raysPerSample()
+			<< " rays saved (" << 100.0 * savedSamples / adaptive.uniformPixelSamples << "%)" << std::endl;
+	}
+}
+
+uint64_t VulkanRaytracer::raysPerSample() const
+{
+	return ::raysPerSample(scene);
+}
+
+void VulkanRaytracer::collectRayStats()
+{
+	if (!settings.rayStats)
+	{
+		return;
+	}
+
+	auto* counters = static_cast<RayStats*>(rayStatsBuffer.mapped);
+	rayStats.lastPass = *counters;
+	rayStats.primaryRays += counters->primaryRays;
+	rayStats.secondaryRays += counters->secondaryRays;
+	rayStats.shadowRays += counters->shadowRays;
+	rayStats.occludedShadowRays += counters->occludedShadowRays;
+	rayStats.hits += counters->hits;
+	rayStats.misses += counters->misses;
+	rayStats.passes++;
+	memset(counters, 0, sizeof(RayStats));
+}
+
+void VulkanRaytracer::printRayStats() const
+{
+	const uint64_t rays = rayStats.primaryRays + rayStats.secondaryRays + rayStats.shadowRays;
+	const double pixelPasses = std::max(static_cast<double>(width) * height * rayStats.passes, 1.0);
+	std::cout << "Rays over " << rayStats.passes << " passes: " << rayStats.primaryRays << " primary, " << rayStats.secondaryRays
+		<< " secondary, " << rayStats.shadowRays << " shadow (" << 100.0 * rayStats.occludedShadowRays / std::max<uint64_t>(rayStats.shadowRays, 1)
+		<< "% occluded), " << 100.0 * rayStats.hits / std::max<uint64_t>(rayStats.hits + rayStats.misses, 1)
+		<< "% of camera and reflection rays hit, " << rays / pixelPasses << " rays per pixel and pass" << std::endl;
+}
+
+void VulkanRaytracer::writeRayHeatmap(const std::string& filename) const
+{
+	const auto* pixelRays = reinterpret_cast<const uint32_t*>(static_cast<const uint8_t*>(rayStatsBuffer.mapped) + sizeof(RayStats));
+	const uint32_t maxRays = writeHeatmap(filename, pixelRays, storageExtent.width, storageExtent.height);
+	std::cout << "Ray heatmap " << filename << " saved to disk, red is " << static_cast<double>(maxRays) / std::max(rayStats.passes, 1u)
+		<< " rays per pass" << std::endl;
+}
+
+/*
+	Offscreen rendering for batch jobs: passes are added until the time budget would be exceeded by the
+	next pass, the estimated error drops below the target, the spp limit is reached or adaptive sampling has converged
+*/
+std::string VulkanRaytracer::accumulatePasses(double timeBudget)
+{
+	VkSubmitInfo headlessSubmitInfo = vks::initializers::submitInfo();
+	headlessSubmitInfo.commandBufferCount = 1;
+	headlessSubmitInfo.pCommandBuffers = &drawCmdBuffers[0];
+
+	// Tiles split the time budget between them
+	StopCriteria stop = settings.stop;
+	stop.timeBudget = timeBudget;
+
+	const auto tStart = std::chrono::high_resolution_clock::now();
+	std::string stopReason;
+	while (stopReason.empty())
+	{
+		PROFILE_SCOPE("pass");
+		const auto tPassStart = std::chrono::high_resolution_clock::now();
+		gpuProfiler.submit(0);
+		VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &headlessSubmitInfo, VK_NULL_HANDLE));
+		VK_CHECK_RESULT(vkQueueWaitIdle(queue));
+		collectRayStats();
+
+		const auto tPassEnd = std::chrono::high_resolution_clock::now();
+		const double passTime = std::chrono::duration<double>(tPassEnd - tPassStart).count();
+		const double elapsed = std::chrono::duration<double>(tPassEnd - tStart).count();
+
+		if (settings.accumulation == ACCUMULATION_OFF)
+		{
+			return "single-pass";
+		}
+
+		updateAccumulation();
+		PassProgress progress;
+		progress.passes = uniformData.frameIndex;
+		progress.lightsamples = scene.lightsamples;
+		progress.passSeconds = passTime;
+		progress.elapsedSeconds = elapsed;
+		progress.adaptive = settings.accumulation == ACCUMULATION_ADAPTIVE;
+		progress.converged = adaptive.converged;
+		stopReason = ::stopReason(stop, progress, [this]() { return estimatedError(); });
+
+		updateUniformBuffers();
+		buildCommandBuffers();
+	}
+	return stopReason;
+}
+
+RenderSummary VulkanRaytracer::renderImage(double timeBudget)
+{
+	const auto tStart = std::chrono::high_resolution_clock::now();
+	RenderSummary summary;
+	summary.stopReason = accumulatePasses(timeBudget);
+	summary.seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tStart).count();
+	summary.passes = std::max(uniformData.frameIndex, 1u);
+	summary.meanSpp = summary.passes * scene.lightsamples;
+	if (settings.accumulation != ACCUMULATION_OFF)
+	{
+		summary.meanSpp = adaptive.tracedPixelSamples / (static_cast<double>(width) * height);
+		summary.error = estimatedError();
+	}
+	return summary;
+}
+
+void VulkanRaytracer::renderHeadless()
+{
+	if (!settings.cameraPath.empty())
+	{
+		renderSequence();
+		return;
+	}
+	if (settings.tileSize > 0)
+	{
+		renderTiled();
+		return;
+	}
+
+	const RenderSummary summary = renderImage(settings.stop.timeBudget);
+	std::cout << "Rendered " << summary.passes << " passes in " << summary.seconds << " s, stopped by " << summary.stopReason;
+	if (settings.rayStats)
+	{
+		// Counted by the shaders, the counting itself slows the passes down a little
+		const uint64_t rays = rayStats.primaryRays + rayStats.secondaryRays + rayStats.shadowRays;
+		std::cout << ", " << rays / summary.seconds * 1e-6 << " Mrays/s" << std::endl;
+		printRayStats();
+	}
+	else
+	{
+		// Upper bound from the light counts, shadow rays behind the surface are not traced. -ray-stats counts them
+		const double rays = summary.meanSpp * width * height * raysPerSample();
+		std::cout << ", ~" << rays / summary.seconds * 1e-6 << " Mrays/s estimated" << std::endl;
+	}
+	saveScreenshot(scene.screenshotName);
+	if (!settings.heatmapFile.empty())
+	{
+		writeRayHeatmap(settings.heatmapFile);
+	}
+	writeRenderReport(std::filesystem::path(scene.screenshotName).replace_extension(".json").string(), summary);
+	if (!settings.referenceImage.empty() &&
+		!compareWithReference(settings.referenceImage, std::filesystem::path(scene.screenshotName).stem().string() + "_diff.png"))
+	{
+		failed = true;
+	}
+}
+
+/*
+	Renders the frame in storageExtent sized tiles. Every tile is accumulated on its own, the time budget is
+	shared evenly by the tiles that are left. Only one row of tiles is ever kept on the host: it is read back
+	tile by tile into a band of scanlines that goes to the image writer once the row is complete
+*/
+void VulkanRaytracer::renderTiled()
+{
+	const uint32_t tileWidth = storageExtent.width;
+	const uint32_t tileHeight = storageExtent.height;
+	const uint32_t tilesX = (width + tileWidth - 1) / tileWidth;
+	const uint32_t tilesY = (height + tileHeight - 1) / tileHeight;
+
+	vks::Buffer readback;
+	VK_CHECK_RESULT(vulkanDevice->createBuffer(
+		VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&readback,
+		static_cast<VkDeviceSize>(tileWidth) * tileHeight * 4 * sizeof(float)));
+	vkDebug.setBufferName(readback.buffer, "TileReadback");
+	VK_CHECK_RESULT(readback.map());
+
+	std::vector<float> band(static_cast<size_t>(width) * tileHeight * 4);
+	std::unique_ptr<ImageWriter> writer = ImageWriter::create(scene.screenshotName, settings.halfFloat, settings.srgb);
+	writer->open(scene.screenshotName, width, height);
+
+	const auto tStart = std::chrono::high_resolution_clock::now();
+	RenderSummary summary;
+	double errorSum = 0.0;
+	double tracedSamples = 0.0;
+	for (uint32_t ty = 0; ty < tilesY; ++ty)
+	{
+		for (uint32_t tx = 0; tx < tilesX; ++tx)
+		{
+			PROFILE_SCOPE("tile");
+			renderTile.offset = { tx * tileWidth, ty * tileHeight };
+			traceExtent = { std::min(tileWidth, width - renderTile.offset.x), std::min(tileHeight, height - renderTile.offset.y) };
+
+			double tileBudget = 0.0;
+			if (settings.stop.timeBudget > 0.0)
+			{
+				const double elapsed = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tStart).count();
+				const uint32_t tilesLeft = tilesX * tilesY - (ty * tilesX + tx);
+				tileBudget = std::max(settings.stop.timeBudget - elapsed, 0.0) / tilesLeft;
+			}
+
+			resetAccumulation();
+			updateUniformBuffers();
+			buildCommandBuffers();
+			std::string stopReason = accumulatePasses(tileBudget);
+			if (summary.stopReason.empty() || summary.stopReason == stopReason)
+				summary.stopReason = stopReason;
+			else
+				summary.stopReason = "mixed";
+
+			const double tilePixels = static_cast<double>(traceExtent.width) * traceExtent.height;
+			summary.passes = std::max(summary.passes, std::max(uniformData.frameIndex, 1u));
+			if (settings.accumulation != ACCUMULATION_OFF)
+			{
+				errorSum += estimatedError() * tilePixels;
+				tracedSamples += static_cast<double>(adaptive.tracedPixelSamples);
+			}
+			else
+			{
+				tracedSamples += tilePixels * scene.lightsamples;
+			}
+
+			// Read the tile back and put its rows into the band
+			readbackStorageImage(readback, traceExtent);
+			const auto* src = static_cast<const float*>(readback.mapped);
+			for (uint32_t y = 0; y < traceExtent.height; ++y)
+			{
+				std::copy_n(src + static_cast<size_t>(y) * traceExtent.width * 4, traceExtent.width * 4,
+					&band[(static_cast<size_t>(y) * width + renderTile.offset.x) * 4]);
+			}
+		}
+
+		{
+			PROFILE_SCOPE("writeTileRow");
+			writer->writeRows(band.data(), std::min(tileHeight, height - ty * tileHeight));
+		}
+		std::cout << "Tile row " << ty + 1 << "/" << tilesY << " written" << std::endl;
+	}
+	writer->close();
+	readback.destroy();
+
+	const double pixelsNum = static_cast<double>(width) * height;
+	summary.seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tStart).count();
+	summary.meanSpp = tracedSamples / pixelsNum;
+	if (settings.accumulation != ACCUMULATION_OFF)
+	{
+		summary.error = errorSum / pixelsNum;
+	}
+
+	std::cout << "Rendered " << tilesX * tilesY << " tiles of " << tileWidth << "x" << tileHeight << " in " << summary.seconds
+		<< " s, image " << scene.screenshotName << " saved to disk" << std::endl;
+	writeRenderReport(std::filesystem::path(scene.screenshotName).replace_extension(".json").string(), summary);
+}
+
+void VulkanRaytracer::renderSequence()
+{
+	CameraPath path;
+	if (!path.load(settings.cameraPath))
+	{
+		return;
+	}
+	// The scene's screenshot name can be a pattern as well, reject it before any frame is traced
+	try
+	{
+		path.frameFilename(path.firstFrame(), scene.screenshotName);
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return;
+	}
+
+	vks::Buffer readback;
+	VK_CHECK_RESULT(vulkanDevice->createBuffer(
+		VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&readback,
+		static_cast<VkDeviceSize>(width) * height * 4 * sizeof(float)));
+	vkDebug.setBufferName(readback.buffer, "ImageReadback");
+	VK_CHECK_RESULT(readback.map());
+
+	// Encodes the frame in the readback buffer, joined before the buffer is overwritten by the next frame
+	std::thread encoder;
+	std::string encodeError;
+
+	const auto tStart = std::chrono::high_resolution_clock::now();
+	for (uint32_t frame = path.firstFrame(); frame <= path.lastFrame(); ++frame)
+	{
+		const CameraKeyframe k = path.evaluate(frame);
+		camera.setPerspective(k.fovy, static_cast<float>(width) / static_cast<float>(height), 0.1f, 512.0f);
+		camera.setLookAt(k.eye, k.center, k.up);
+
+		const auto tFrameStart = std::chrono::high_resolution_clock::now();
+		if (scene.animated())
+		{
+			updateSceneAnimation(frame / sequenceFrameRate);
+		}
+		resetAccumulation();
+		updateUniformBuffers();
+		buildCommandBuffers();
+		const std::string stopReason = accumulatePasses(settings.stop.timeBudget);
+		const double traceTime = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tFrameStart).count();
+
+		if (encoder.joinable())
+		{
+			encoder.join();
+		}
+		if (!encodeError.empty())
+		{
+			std::cerr << encodeError << std::endl;
+			break;
+		}
+		readbackStorageImage(readback, { width, height });
+
+		const std::string filename = path.frameFilename(frame, scene.screenshotName);
+		encoder = std::thread([this, &readback, &encodeError, filename]() {
+			try
+			{
+				std::unique_ptr<ImageWriter> writer = ImageWriter::create(filename, settings.halfFloat, settings.srgb);
+				writer->open(filename, width, height);
+				writer->writeRows(static_cast<const float*>(readback.mapped), height);
+				writer->close();
+			}
+			catch (const std::exception& e)
+			{
+				encodeError = e.what();
+			}
+		});
+		std::cout << "Frame " << frame << " traced in " << traceTime << " s (" << std::max(uniformData.frameIndex, 1u)
+			<< " passes, " << stopReason << "), writing " << filename << std::endl;
+	}
+
+	if (encoder.joinable())
+	{
+		encoder.join();
+	}
+	if (!encodeError.empty())
+	{
+		std::cerr << encodeError << std::endl;
+	}
+	readback.destroy();
+
+	const double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tStart).count();
+	std::cout << "Rendered " << path.lastFrame() - path.firstFrame() + 1 << " frames in " << seconds << " s" << std::endl;
+}
+
+/*
+	Render server for farms with many small jobs. Every stdin line is a job "<scene.test> [output] [spp]",
+	"-" as output keeps the name from the scene file, "quit" or the end of input stops the server. Jobs
+	only pay for the scene swap and the render, the process startup is paid once
+*/
+void VulkanRaytracer::renderServer()
+{
+	const double startupSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTimestamp).count();
+	// Every job loads, uploads and builds its scene and creates its pipeline in swapScene. Of the startup, only
+	// the rest (instance, device, pipeline cache, window or command buffers) would be paid again by a process per job
+	const double sceneSetupSeconds = (sceneTimings.loadMs + sceneTimings.uploadMs + sceneTimings.accelerationStructureMs + sceneTimings.pipelineMs) * 1e-3;
+	const double processStartupSeconds = std::max(startupSeconds - sceneSetupSeconds, 0.0);
+	std::cout << "Server ready after " << startupSeconds << " s (" << processStartupSeconds << " s without the scene), reading jobs from stdin" << std::endl;
+
+	const uint32_t defaultSpp = settings.stop.maxSpp;
+	const AccumulationMode defaultAccumulation = settings.accumulation;
+	uint32_t jobsNum = 0;
+	uint32_t failedNum = 0;
+	double jobsSeconds = 0.0;
+
+	std::string line;
+	while (std::getline(std::cin, line))
+	{
+		if ((line.find_first_not_of(" \t\r\n") == std::string::npos) || (line[0] == '#'))
+			continue;
+
+		std::stringstream ss(line);
+		std::string scenePath, output, spp;
+		ss >> scenePath >> output >> spp;
+		if (scenePath == "quit")
+			break;
+		if (scenePath == "memory")
+		{
+			MemoryTracker::report(std::cout);
+			continue;
+		}
+		if (!std::filesystem::exists(scenePath))
+		{
+			std::cerr << "Job skipped, scene " << scenePath << " not found" << std::endl;
+			++failedNum;
+			continue;
+		}
+
+		// A job spp count is met by adding passes, like the time budget
+		settings.stop.maxSpp = spp.empty() ? defaultSpp : static_cast<uint32_t>(std::atoi(spp.c_str()));
+		settings.accumulation = (settings.stop.maxSpp > 0 && defaultAccumulation == ACCUMULATION_OFF) ? ACCUMULATION_ON : defaultAccumulation;
+
+		const auto tJobStart = std::chrono::high_resolution_clock::now();
+		try
+		{
+			swapScene(scenePath);
+			if (!output.empty() && output != "-")
+			{
+				scene.screenshotName = output;
+			}
+			renderHeadless();
+		}
+		catch (const std::exception& e)
+		{
+			// Device errors leave the renderer in an unknown state, nothing more can be rendered
+			std::cerr << "Job " << scenePath << " failed: " << e.what() << std::endl;
+			++failedNum;
+			break;
+		}
+		const double jobSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tJobStart).count();
+		jobsSeconds += jobSeconds;
+		++jobsNum;
+		std::cout << "Job " << jobsNum << " " << scenePath << " done in " << jobSeconds << " s" << std::endl;
+	}
+	settings.stop.maxSpp = defaultSpp;
+	settings.accumulation = defaultAccumulation;
+
+	if (jobsNum == 0)
+	{
+		std::cout << "Server rendered no jobs (" << failedNum << " failed)" << std::endl;
+		return;
+	}
+	// A process per job would pay the scene independent startup for every job on top of the same job time, its scene
+	// setup is already part of the job time. The estimate leaves out a cold pipeline cache and driver startup outside the process
+	const double jobsPerHour = 3600.0 * jobsNum / jobsSeconds;
+	const double processJobsPerHour = 3600.0 * jobsNum / (jobsSeconds + jobsNum * processStartupSeconds);
+	std::cout << "Server rendered " << jobsNum << " jobs (" << failedNum << " failed) in " << jobsSeconds << " s: "
+		<< jobsPerHour << " jobs/hour, ~" << processJobsPerHour << " jobs/hour with a process per job ("
+		<< processStartupSeconds << " s scene independent startup)" << std::endl;
+}
+
+/*
+	Renders every scene of the corpus settings.benchmarkRuns times at a fixed sample count and writes load,
+	upload, acceleration structure build and pipeline times, render time and Mrays/s with their run to run
+	spread to settings.benchmarkFile. Images are not saved, the scene is swapped in like a server job for
+	every run so each run pays the full scene setup
+*/
+void VulkanRaytracer::renderBenchmark()
+{
+	std::vector<BenchmarkResult> results;
+	for (const char* name : benchmarkScenes)
+	{
+		const std::filesystem::path scenePath = std::filesystem::path(settings.benchmarkDir) / (std::string(name) + ".test");
+		if (!std::filesystem::exists(scenePath))
+		{
+			std::cerr << "Benchmark scene " << scenePath.string() << " not found, skipped" << std::endl;
+			continue;
+		}
+
+		std::vector<double> loadMs, uploadMs, buildMs, pipelineMs, renderSeconds, mrays;
+		for (uint32_t run = 0; run < settings.benchmarkRuns; ++run)
+		{
+			swapScene(scenePath.string());
+			const RenderSummary summary = renderImage(0.0);
+			const double rays = summary.meanSpp * width * height * raysPerSample();
+			loadMs.push_back(sceneTimings.loadMs);
+			uploadMs.push_back(sceneTimings.uploadMs);
+			buildMs.push_back(sceneTimings.accelerationStructureMs);
+			pipelineMs.push_back(sceneTimings.pipelineMs);
+			renderSeconds.push_back(summary.seconds);
+			mrays.push_back(rays / summary.seconds * 1e-6);
+		}
+		std::cout << name << ": " << std::accumulate(mrays.begin(), mrays.end(), 0.0) / mrays.size() << " Mrays/s, "
+			<< std::accumulate(buildMs.begin(), buildMs.end(), 0.0) / buildMs.size() << " ms AS build" << std::endl;
+
+		BenchmarkResult result;
+		result.scene = name;
+		result.width = width;
+		result.height = height;
+		result.triangles = scene.indices.size() / 3;
+		result.spheres = scene.spheres.size();
+		result.runs = { { "loadMs", loadMs }, { "uploadMs", uploadMs }, { "accelerationStructureMs", buildMs },
+			{ "pipelineMs", pipelineMs }, { "renderSeconds", renderSeconds }, { "mraysPerSecond", mrays } };
+		result.peakRssBytes = peakResidentBytes();
+		results.push_back(std::move(result));
+	}
+	if (writeBenchmarkResults(settings.benchmarkFile, deviceProperties.deviceName, settings.stop.maxSpp, settings.benchmarkRuns, results))
+	{
+		std::cout << "Benchmark results written to " << settings.benchmarkFile << std::endl;
+	}
+}
+
+/*
+	Renders every scene of settings.regressionDir that has a PNG reference named after the scene file and compares
+	the two. Failed scenes also keep their render next to the difference image, the run fails if any scene did
+*/
+void VulkanRaytracer::renderRegression()
+{
+	uint32_t passedNum = 0, failedNum = 0, skippedNum = 0;
+	std::vector<std::string> jpegOnly;
+	for (const std::filesystem::path& scenePath : sceneFiles(settings.regressionDir))
+	{
+		const std::filesystem::path reference = referenceImage(scenePath);
+		if (reference.empty())
+		{
+			const std::vector<std::filesystem::path> jpegs = jpegReferences(scenePath);
+			if (jpegs.empty())
+			{
+				std::cout << "SKIP " << scenePath.string() << ": no PNG reference" << std::endl;
+			}
+			else
+			{
+				std::cout << "SKIP " << scenePath.string() << ": only " << jpegs.size() << " JPEG references, not compared" << std::endl;
+				jpegOnly.push_back(scenePath.stem().string());
+			}
+			++skippedNum;
+			continue;
+		}
+
+		swapScene(scenePath.string());
+		renderImage(settings.stop.timeBudget);
+		const std::string stem = reference.stem().string();
+		if (compareWithReference(reference.string(), stem + "_diff.png"))
+		{
+			++passedNum;
+		}
+		else
+		{
+			saveScreenshot(stem + "_render.png");
+			++failedNum;
+		}
+	}
+
+	std::cout << "Regression: " << passedNum << " passed, " << failedNum << " failed, " << skippedNum << " skipped";
+	if (!jpegOnly.empty())
+	{
+		std::cout << ", " << jpegOnly.size() << " of them only have JPEG references:";
+		for (const std::string& name : jpegOnly)
+		{
+			std::cout << " " << name;
+		}
+	}
+	std::cout << std::endl;
+	if (failedNum > 0 || passedNum == 0)
+	{
+		failed = true;
+	}
+}
+
+/*
+	Compares the storage image, rounded to 8 bits the way it would be saved, with a PNG reference and writes
+	the difference image
+*/
+bool VulkanRaytracer::compareWithReference(const std::string& reference, const std::string& diffName)
+{
+	vks::Buffer readback;
+	VK_CHECK_RESULT(vulkanDevice->createBuffer(
+		VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&readback,
+		static_cast<VkDeviceSize>(width) * height * 4 * sizeof(float)));
+	vkDebug.setBufferName(readback.buffer, "ImageReadback");
+	VK_CHECK_RESULT(readback.map());
+	readbackStorageImage(readback, { width, height });
+	std::vector<uint8_t> rgb(static_cast<size_t>(width) * height * 3);
+	for (uint32_t y = 0; y < height; ++y)
+	{
+		const float* row = static_cast<const float*>(readback.mapped) + static_cast<size_t>(y) * width * 4;
+		if (settings.srgb)
+			convertRowSrgb(row, &rgb[static_cast<size_t>(y) * width * 3], width);
+		else
+			convertRowEdx(row, &rgb[static_cast<size_t>(y) * width * 3], width);
+	}
+	readback.destroy();
+
+	return ::compareWithReference(rgb.data(), width, height, reference, diffName, settings.regressionTolerance, settings.regressionMaxBadPixels);
+}
+
+/*
+	Sidecar JSON next to the saved image for the job scheduler
+*/
+void VulkanRaytracer::writeRenderReport(const std::string& filename, const RenderSummary& summary) const
+{
+	const bool hasTarget = settings.stop.stopAtTargetError || settings.accumulation == ACCUMULATION_ADAPTIVE;
+	::writeRenderReport(filename, scene.screenshotName, width, height, scene.lightsamples, settings.stop, hasTarget, summary,
+		settings.rayStats ? &rayStats : nullptr);
 }
 
 /*
@@ -1693,6 +3266,7 @@ void VulkanRaytracer::handleResize()
 */
 void VulkanRaytracer::buildCommandBuffers()
 {
+	PROFILE_SCOPE("buildCommandBuffers");
 	if (resized)
 	{
 		handleResize();
@@ -1705,10 +3279,12 @@ void VulkanRaytracer::buildCommandBuffers()
 	for (int32_t i = 0; i < drawCmdBuffers.size(); ++i)
 	{
 		VK_CHECK_RESULT(vkBeginCommandBuffer(drawCmdBuffers[i], &cmdBufInfo));
+		gpuProfiler.reset(drawCmdBuffers[i], i);
 
 		// Dispatch the ray tracing commands
 		vkCmdBindPipeline(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipeline);
 		vkCmdBindDescriptorSets(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipelineLayout, 0, 1, &descriptorSet, 0, 0);
+		vkCmdPushConstants(drawCmdBuffers[i], pipelineLayout, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 0, sizeof(RenderTile), &renderTile);
 
 		const uint32_t handleSizeAligned = alignedSize(rayTracingPipelineProperties.shaderGroupHandleSize, rayTracingPipelineProperties.shaderGroupBaseAlignment);
 		VkDeviceAddress sbtAddress = getBufferDeviceAddress(shaderBindingTable.buffer);
@@ -1730,57 +3306,84 @@ void VulkanRaytracer::buildCommandBuffers()
 
 		VkStridedDeviceAddressRegionKHR emptySbtEntry = {};
 
-		vkCmdTraceRaysKHR(
-			drawCmdBuffers[i],
-			&raygenStride,
-			&missStride,
-			&hitStride,
-			&emptySbtEntry,
-			width,
-			height,
-			1);
-
-		// Copy ray tracing output to swap chain image
-
-		// Prepare current swap chain image as transfer destination
-		vks::tools::setImageLayout(
-			drawCmdBuffers[i],
-			swapChain.images[i],
-			VK_IMAGE_LAYOUT_UNDEFINED,
-			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-			subresourceRange);
-
-		// Prepare ray tracing output image as transfer source
-		vks::tools::setImageLayout(
-			drawCmdBuffers[i],
-			storageImage.image,
-			VK_IMAGE_LAYOUT_GENERAL,
-			VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-			subresourceRange);
-
-		VkImageCopy copyRegion{};
-		copyRegion.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
-		copyRegion.srcOffset = { 0, 0, 0 };
-		copyRegion.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
-		copyRegion.dstOffset = { 0, 0, 0 };
-		copyRegion.extent = { width, height, 1 };
-		vkCmdCopyImage(drawCmdBuffers[i], storageImage.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, swapChain.images[i], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
-
-		// Transition swap chain image back for presentation
-		vks::tools::setImageLayout(
-			drawCmdBuffers[i],
-			swapChain.images[i],
-			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-			VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-			subresourceRange);
-
-		// Transition ray tracing output image back to general layout
-		vks::tools::setImageLayout(
-			drawCmdBuffers[i],
-			storageImage.image,
-			VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-			VK_IMAGE_LAYOUT_GENERAL,
-			subresourceRange);
+		gpuProfiler.begin(drawCmdBuffers[i], i, GpuProfiler::PHASE_TRACE);
+		if (settings.accumulation == ACCUMULATION_ADAPTIVE)
+		{
+			// One tile-sized grid per unconverged tile, nothing left to trace once the image converged
+			if (!adaptive.activeTiles.empty())
+			{
+				vkCmdTraceRaysKHR(
+					drawCmdBuffers[i],
+					&raygenStride,
+					&missStride,
+					&hitStride,
+					&emptySbtEntry,
+					adaptiveTileSize,
+					adaptiveTileSize,
+					static_cast<uint32_t>(adaptive.activeTiles.size()));
+			}
+		}
+		else
+		{
+			vkCmdTraceRaysKHR(
+				drawCmdBuffers[i],
+				&raygenStride,
+				&missStride,
+				&hitStride,
+				&emptySbtEntry,
+				traceExtent.width,
+				traceExtent.height,
+				1);
+		}
+		gpuProfiler.end(drawCmdBuffers[i], i, GpuProfiler::PHASE_TRACE);
+
+		// Headless rendering reads the storage image directly
+		if (!settings.headless)
+		{
+			// Copy ray tracing output to swap chain image
+			gpuProfiler.begin(drawCmdBuffers[i], i, GpuProfiler::PHASE_COPY);
+
+			// Prepare current swap chain image as transfer destination
+			vks::tools::setImageLayout(
+				drawCmdBuffers[i],
+				swapChain.images[i],
+				VK_IMAGE_LAYOUT_UNDEFINED,
+				VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				subresourceRange);
+
+			// Prepare ray tracing output image as transfer source
+			vks::tools::setImageLayout(
+				drawCmdBuffers[i],
+				storageImage.image,
+				VK_IMAGE_LAYOUT_GENERAL,
+				VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+				subresourceRange);
+
+			// The blit converts the float output to the swap chain format, values above 1 are clamped
+			VkImageBlit blitRegion{};
+			blitRegion.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+			blitRegion.srcOffsets[1] = { static_cast<int32_t>(width), static_cast<int32_t>(height), 1 };
+			blitRegion.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+			blitRegion.dstOffsets[1] = { static_cast<int32_t>(width), static_cast<int32_t>(height), 1 };
+			vkCmdBlitImage(drawCmdBuffers[i], storageImage.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, swapChain.images[i], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blitRegion, VK_FILTER_NEAREST);
+
+			// Transition swap chain image back for presentation
+			vks::tools::setImageLayout(
+				drawCmdBuffers[i],
+				swapChain.images[i],
+				VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+				subresourceRange);
+
+			// Transition ray tracing output image back to general layout
+			vks::tools::setImageLayout(
+				drawCmdBuffers[i],
+				storageImage.image,
+				VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+				VK_IMAGE_LAYOUT_GENERAL,
+				subresourceRange);
+			gpuProfiler.end(drawCmdBuffers[i], i, GpuProfiler::PHASE_COPY);
+		}
 
 		VK_CHECK_RESULT(vkEndCommandBuffer(drawCmdBuffers[i]));
 	}
@@ -1795,6 +3398,11 @@ void VulkanRaytracer::updateUniformBuffers()
 	uniformData.quadLightsNum = scene.quadLights.size();
 	uniformData.lightsamples = scene.lightsamples;
 	uniformData.lightstratify = scene.lightstratify;
+	uniformData.samplerType = scene.samplerType;
+	uniformData.accumulation = settings.accumulation;
+	// Pixels need two passes for a variance estimate
+	uniformData.warmupPasses = settings.stop.warmupPasses(scene.lightsamples);
+	uniformData.targetError = settings.stop.targetError;
 	memcpy(uboData.mapped, &uniformData, sizeof(uniformData));
 }
 
@@ -1818,9 +3426,27 @@ void VulkanRaytracer::getEnabledFeatures()
 void VulkanRaytracer::draw()
 {
 	prepareFrame();
+	std::array<VkCommandBuffer, 2> commandBuffers = { drawCmdBuffers[currentBuffer], VK_NULL_HANDLE };
+	VkFence fence = VK_NULL_HANDLE;
 	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &drawCmdBuffers[currentBuffer];
-	VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE));
+
+	// A requested screenshot is copied out right behind the frame in the same submission
+	if (capture.requested && !capture.submitted && !capture.encoding)
+	{
+		if (capture.copyCmd == VK_NULL_HANDLE)
+		{
+			createCaptureResources();
+		}
+		commandBuffers[1] = capture.copyCmd;
+		submitInfo.commandBufferCount = 2;
+		fence = capture.fence;
+		capture.requested = false;
+		capture.submitted = true;
+	}
+
+	submitInfo.pCommandBuffers = commandBuffers.data();
+	gpuProfiler.submit(currentBuffer);
+	VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &submitInfo, fence));
 	submitFrame();
 }
 
@@ -1829,14 +3455,48 @@ void VulkanRaytracer::render()
 	if (!prepared)
 		return;
 	draw();
-	if (camera.updated)
+	collectRayStats();
+	pollCapture();
+	const size_t activeTilesBefore = adaptive.activeTiles.size();
+	if (scene.animated() && !paused)
+	{
+		updateSceneAnimation(animation.time + frameTimer);
+		resetAccumulation();
+		updateUniformBuffers();
+	}
+	else if (camera.updated)
+	{
+		resetAccumulation();
 		updateUniformBuffers();
+	}
+	else if (settings.accumulation != ACCUMULATION_OFF)
+	{
+		updateAccumulation();
+		updateUniformBuffers();
+	}
+
+	// The adaptive launch is recorded with the number of active tiles, stale command buffers would trace
+	// converged tiles and the leftover tail of the list. The queue is idle after draw()
+	if (settings.accumulation == ACCUMULATION_ADAPTIVE && adaptive.activeTiles.size() != activeTilesBefore)
+	{
+		buildCommandBuffers();
+	}
 }
 
 void VulkanRaytracer::updateTitle()
 {
 	std::stringstream ss;
 	ss << applicationName << " " << (1000.0f / lastFPS) << " ms/frame" << " (" << lastFPS << " fps)";
+	if (gpuProfiler.enabled())
+	{
+		ss << ", GPU trace " << gpuProfiler.lastMs(GpuProfiler::PHASE_TRACE) << " ms";
+	}
+	if (settings.rayStats)
+	{
+		const RayStats& pass = rayStats.lastPass;
+		ss << ", " << (pass.primaryRays + pass.secondaryRays + pass.shadowRays) * 1e-6 << " Mrays/frame ("
+			<< pass.shadowRays * 1e-6 << " M shadow)";
+	}
 	glfwSetWindowTitle(window, ss.str().c_str());
 }
 
@@ -1894,5 +3554,7 @@ void VulkanRaytracer::keyCallback(GLFWwindow* window, int key, int scancode, int
 		glfwSetWindowShouldClose(window, GL_TRUE);
 
 	else if (key == GLFW_KEY_F1 && action == GLFW_RELEASE)
-		app->saveScreenshot(app->scene.screenshotName);
+		app->requestScreenshot(app->scene.screenshotName);
+	else if (key == GLFW_KEY_F2 && action == GLFW_RELEASE)
+		MemoryTracker::report(std::cout);
 }
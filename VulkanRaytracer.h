@@ -6,7 +6,13 @@
 #include <array>
 #include <chrono>
 #include <numeric>
+#include <algorithm>
 #include <map>
+#include <fstream>
+#include <filesystem>
+#include <limits>
+#include <atomic>
+#include <thread>
 
 #define NOMINMAX
 //#define VK_ENABLE_BETA_EXTENSIONS
@@ -21,7 +27,6 @@
 #include <glm/gtc/matrix_inverse.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
-#include <FreeImage.h>
 
 #include "VulkanTools.h"
 #include "VulkanDebug.h"
@@ -31,6 +36,14 @@
 #include "VulkanInitializers.hpp"
 #include "camera.hpp"
 #include <SceneLoader.h>
+#include <ImageWriter.h>
+#include <CameraPath.h>
+#include <GpuProfiler.h>
+#include <ImageCompare.h>
+#include <CpuProfiler.h>
+#include <MemoryTracker.h>
+#include <RenderReport.h>
+#include <SceneCorpus.h>
 
 
 // Holds data for a ray tracing scratch buffer that is used as a temporary storage
@@ -49,6 +62,58 @@ struct AccelerationStructure {
 	VkBuffer buffer;
 };
 
+// Accumulation modes and per-pixel/per-tile statistics, must match shaders/raycommon.glsl
+enum AccumulationMode : uint32_t {
+	ACCUMULATION_OFF = 0,
+	ACCUMULATION_ON = 1,
+	ACCUMULATION_ADAPTIVE = 2
+};
+
+struct PixelStats {
+	glm::vec3 mean;
+	float m2;
+	uint32_t count;
+	float relError;
+	uint32_t padding[2];
+};
+
+struct TileStats {
+	uint32_t unconvergedPixels;
+	uint32_t tracedPixels;
+	uint32_t relErrorSum;
+};
+
+// Must match TILE_ERROR_SCALE in shaders/raycommon.glsl
+constexpr float tileErrorScale = 65536.0f;
+
+// Ray counters of one pass, must match RayStats in shaders/raycommon.glsl
+struct RayStats {
+	uint32_t primaryRays;
+	uint32_t secondaryRays;
+	uint32_t shadowRays;
+	uint32_t occludedShadowRays;
+	uint32_t hits;
+	uint32_t misses;
+};
+
+// Scene features a ray tracing pipeline is specialized for, the members are the specialization
+// constants 0-6 (MAX_RECURSION in shaders/raygen.rgen, the others in shaders/raycommon.glsl)
+struct PipelineVariant {
+	uint32_t maxRecursion;
+	VkBool32 hasDirectLights;
+	VkBool32 hasPointLights;
+	VkBool32 hasQuadLights;
+	uint32_t samplerType;
+	VkBool32 lightStratify;
+	VkBool32 rayStats;
+
+	// Feature bits identifying the variant together with the integrator
+	uint32_t features() const
+	{
+		return hasDirectLights | hasPointLights << 1 | hasQuadLights << 2 | lightStratify << 3 | samplerType << 4 | rayStats << 7 | maxRecursion << 8;
+	}
+};
+
 class ShaderBindingTable : public vks::Buffer {
 public:
 	VkStridedDeviceAddressRegionKHR stridedDeviceAddressRegion{};
@@ -62,6 +127,8 @@ public:
 
 	// Init GLFW, setup the vulkan instance, enable required extensions and connect to the physical device (GPU)
 	bool initAPIs();
+	// Whether a Vulkan device with ray tracing pipelines exists, checked without creating the renderer
+	static bool rayTracingDeviceAvailable();
 	void setupWindow();
 
 	// Prepares all Vulkan resources and functions required to run the sample
@@ -70,6 +137,22 @@ public:
 	// Entry point for the main render loop
 	void renderLoop();
 
+	// Renders without a window until one of the budgets is reached, then saves the image and its sidecar JSON
+	void renderHeadless();
+	// Headless rendering of a huge image tile by tile, finished tile rows are streamed to the image writer
+	void renderTiled();
+	// Headless rendering of a camera path: scene, acceleration structures and pipeline stay resident,
+	// every frame is encoded on a worker thread while the next one is traced
+	void renderSequence();
+	// Headless job queue: renders the scenes listed on stdin one after another in this process
+	void renderServer();
+	// Headless benchmark over the scene corpus in settings.benchmarkDir
+	void renderBenchmark();
+	// Headless image regression against the reference images in settings.regressionDir
+	void renderRegression();
+	// False when a reference comparison failed, the process should exit with an error
+	bool succeeded() const { return !failed; }
+
 private:
 	// Creates the application wide Vulkan instance
 	VkResult createInstance();
@@ -81,6 +164,14 @@ private:
 	/** @brief (Virtual) Setup a default renderpass */
 	virtual void setupRenderPass();
 
+	// Loads the scene file and sets the image size and camera from it
+	void setupScene(const std::string& scenePath);
+	void destroySceneResources();
+	// Replaces the scene of a prepared renderer, device level objects stay warm
+	void swapScene(const std::string& scenePath);
+	// Uploads the scene buffers and builds the acceleration structures
+	void uploadScene();
+
 	/** @brief Loads a SPIR-V shader file for the given shader stage */
 	VkPipelineShaderStageCreateInfo loadShader(std::string fileName, VkShaderStageFlagBits stage);
 
@@ -91,7 +182,17 @@ private:
 	/** @brief (Virtual) Default image acquire + submission and command buffer submission function */
 	virtual void renderFrame();
 
+	// Writes the float storage image as PNG, EXR or PFM depending on the extension
 	void saveScreenshot(const std::string& filename);
+	// Copies the top left extent of the storage image into a host visible buffer as tightly packed RGBA floats
+	void readbackStorageImage(const vks::Buffer& buffer, VkExtent2D extent);
+	void flushSetupCommandBuffer(VkCommandBuffer commandBuffer);
+	// Windowed screenshots: the copy is submitted with the next frame and encoded on a worker thread
+	void requestScreenshot(const std::string& filename);
+	void createCaptureResources();
+	void destroyCaptureResources();
+	// Starts the encoder once the fence of a submitted capture has signaled, never waits for the GPU
+	void pollCapture();
 
 	ScratchBuffer createScratchBuffer(VkDeviceSize size);
 	void deleteScratchBuffer(ScratchBuffer& scratchBuffer);
@@ -103,13 +204,27 @@ private:
 	void createAccelerationStructure(AccelerationStructure& accelerationStructure, VkAccelerationStructureTypeKHR type, VkAccelerationStructureBuildSizesInfoKHR buildSizeInfo);
 	void deleteAccelerationStructure(AccelerationStructure& accelerationStructure);
 	void createBottomLevelAccelerationStructureTriangles();
+	// updateScratch receives a scratch buffer large enough for both builds and refits of the mesh, kept for its updates
+	void createMeshBlas(const Mesh& mesh, AccelerationStructure& blas, ScratchBuffer* updateScratch = nullptr);
+	// Vertex and index buffers as BLAS input, meshes select their triangles through the build range
+	VkAccelerationStructureGeometryKHR trianglesGeometry();
 	void createBottomLevelAccelerationStructureSpheres();
+	// TLAS entries with the placements at the given animation time
+	std::vector<VkAccelerationStructureInstanceKHR> tlasInstances(float time) const;
 	void createTopLevelAccelerationStructure();
+	void destroyAnimationResources();
+	// Moves animated scenes to the given time: deformed vertices are uploaded, dynamic BLAS refit (or rebuilt
+	// after settings.refitLimit refits or when fullRebuild is set) and the TLAS is rebuilt over the new transforms
+	void updateSceneAnimation(float time, bool fullRebuild = false);
+	// Times settings.updateBenchmarkFrames scene updates with refits against the same number with full rebuilds
+	void benchmarkSceneUpdates();
 
 	void createShaderBindingTables();
 
 	void createDescriptorSets();
 
+	// Descriptor set and pipeline layouts, shared by all pipeline variants
+	void createPipelineLayout();
 	void createRayTracingPipeline();
 
 	void createUniformBuffers();
@@ -121,6 +236,33 @@ private:
 
 	void updateUniformBuffers();
 
+	void createAccumulationBuffers();
+	void destroyAccumulationBuffers();
+	// Starts accumulation over from the first pass, e.g. after the camera moved
+	void resetAccumulation();
+	// Reads back the tile statistics of the finished pass and picks the tiles traced by the next one
+	void updateAccumulation();
+	// Mean relative error of the pixel means over the image, from the last pass that traced each tile
+	float estimatedError() const;
+	// Rays traced for one pixel sample, estimated from the scene's lights and depth
+	uint64_t raysPerSample() const;
+	// Adds the ray counters of the finished pass to the totals and clears them for the next one
+	void collectRayStats();
+	void printRayStats() const;
+	// Rays traced per pixel and pass as a false color image, blue for the cheapest pixels and red for the most expensive
+	void writeRayHeatmap(const std::string& filename) const;
+	// Traces passes into the storage image until a budget is reached, returns the stop reason
+	std::string accumulatePasses(double timeBudget);
+	// Accumulates the image until a budget is reached and summarizes the passes
+	RenderSummary renderImage(double timeBudget);
+	void writeRenderReport(const std::string& filename, const RenderSummary& summary) const;
+	// Compares the storage image with a PNG reference, writes the difference image and prints the metrics
+	bool compareWithReference(const std::string& reference, const std::string& diffName);
+	// Sizes the storage image and per-pixel buffers for the frame, or for one tile in tiled mode
+	void updateRenderExtent();
+	// Memory totals after a scene is loaded, every allocation name with -memory-report
+	void printMemoryUsage() const;
+
 	//Called after the physical device features have been read, can be used to set features to enable on the device
 	void getEnabledFeatures();
 
@@ -142,6 +284,7 @@ private:
 	void nextFrame();
 	void updateTitle();
 	void createPipelineCache();
+	void savePipelineCache();
 	void createCommandPool();
 	void createSynchronizationPrimitives();
 	void initSwapchain();
@@ -153,6 +296,15 @@ private:
 	uint32_t frameCounter = 0;
 	uint32_t lastFPS = 0;
 	std::chrono::time_point<std::chrono::high_resolution_clock> lastTimestamp;
+	// Setup times of the current scene, filled when it is loaded and uploaded
+	struct {
+		double loadMs = 0.0;
+		double uploadMs = 0.0;
+		double accelerationStructureMs = 0.0;
+		double pipelineMs = 0.0;
+	} sceneTimings;
+	// Construction time, the server reports its startup time from it
+	std::chrono::time_point<std::chrono::high_resolution_clock> startTimestamp = std::chrono::high_resolution_clock::now();
 	// Vulkan instance, stores all per-application states
 	VkInstance instance;
 	std::vector<std::string> supportedInstanceExtensions;
@@ -188,17 +340,23 @@ private:
 	// Command buffers used for rendering
 	std::vector<VkCommandBuffer> drawCmdBuffers;
 	// Global render pass for frame buffer writes
-	VkRenderPass renderPass;
+	VkRenderPass renderPass = VK_NULL_HANDLE;
 	// List of available frame buffers (same as number of swap chain images)
 	std::vector<VkFramebuffer>frameBuffers;
 	// Active frame buffer index
 	uint32_t currentBuffer = 0;
 	// Descriptor set pool
 	VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
-	// List of shader modules created (stored for cleanup)
-	std::vector<VkShaderModule> shaderModules;
-	// Pipeline cache object
-	VkPipelineCache pipelineCache;
+	// Shader modules by file name, loaded once and reused by every pipeline
+	std::map<std::string, VkShaderModule> shaderModules;
+	// Pipeline cache object, loaded from and saved to settings.pipelineCacheFile
+	VkPipelineCache pipelineCache = VK_NULL_HANDLE;
+	struct {
+		// Valid data for this device and driver was read from disk
+		bool loaded = false;
+		// Pipeline creation time without cached data, kept in the file to report the savings of warm starts
+		double coldCompileMs = 0.0;
+	} pipelineCacheStats;
 	// Wraps the swap chain to present images (framebuffers) to the windowing system
 	VulkanSwapChain swapChain;
 	// Synchronization semaphores
@@ -211,11 +369,13 @@ private:
 	std::vector<VkFence> waitFences;
 
 	bool prepared = false;
+	bool failed = false;
 	bool resized = false;
 	uint32_t width = 1280;
 	uint32_t height = 720;
 
 	Scene scene;
+	GpuProfiler gpuProfiler;
 
 	PFN_vkGetBufferDeviceAddressKHR vkGetBufferDeviceAddressKHR = VK_NULL_HANDLE;
 	PFN_vkCmdBuildAccelerationStructuresKHR vkCmdBuildAccelerationStructuresKHR = VK_NULL_HANDLE;
@@ -236,13 +396,41 @@ private:
 	VkPhysicalDeviceRayTracingPipelineFeaturesKHR enabledRayTracingPipelineFeatures{};
 	VkPhysicalDeviceAccelerationStructureFeaturesKHR enabledAccelerationStructureFeatures{};
 
-	AccelerationStructure trianglesBlas;
+	// One per scene mesh, instanced by the TLAS
+	std::vector<AccelerationStructure> meshBlases;
 	AccelerationStructure spheresBlas;
 	AccelerationStructure topLevelAS;
+	// Animated scenes keep the TLAS inputs and the scratch memory of their updates alive between frames
+	struct {
+		float time = 0.0f;
+		vks::Buffer instances;
+		ScratchBuffer tlasScratch{};
+		// Deformed vertices of all dynamic meshes, copied into their ranges of the vertex buffer
+		vks::Buffer vertexStaging;
+		// Per mesh, only allocated for dynamic ones
+		std::vector<ScratchBuffer> blasScratch;
+		std::vector<uint32_t> refitsSinceBuild;
+		// Vertex positions of the last full build of every dynamic mesh and the diagonal of their bounds then,
+		// the reference the drift of the refits is measured against
+		std::vector<std::vector<glm::vec3>> builtPositions;
+		std::vector<float> builtDiagonal;
+		// Dynamic BLAS updates that were full builds, including the forced ones
+		uint64_t rebuilds = 0;
+	} animation;
 
 	std::vector<VkRayTracingShaderGroupCreateInfoKHR> shaderGroups{};
 	vks::Buffer shaderBindingTable;
 
+	// Size of the storage image and the per-pixel buffers: the whole frame, or one tile in tiled mode
+	VkExtent2D storageExtent{};
+	// Part of the storage image inside the frame for the current pass, smaller than storageExtent for edge tiles
+	VkExtent2D traceExtent{};
+	// Push constants of the ray generation shader
+	struct RenderTile {
+		glm::uvec2 offset{ 0 };
+		glm::uvec2 imageSize{ 0 };
+	} renderTile;
+
 	struct StorageImage {
 		VkDeviceMemory memory;
 		VkImage image;
@@ -258,10 +446,55 @@ private:
 		uint32_t quadLightsNum;
 		uint32_t lightsamples;
 		uint32_t lightstratify;
+		uint32_t samplerType;
+		uint32_t frameIndex = 0;
+		uint32_t accumulation = ACCUMULATION_OFF;
+		uint32_t warmupPasses;
+		float targetError;
 	} uniformData;
 	vks::Buffer uboData;
 
+	// Must match ADAPTIVE_TILE_SIZE in shaders/raycommon.glsl
+	static constexpr uint32_t adaptiveTileSize = 16;
+	vks::Buffer pixelStatsBuffer;
+	vks::Buffer tileStatsBuffer;
+	vks::Buffer activeTilesBuffer;
+	// RayStats of the last pass followed by the rays traced per pixel, host visible
+	vks::Buffer rayStatsBuffer;
+	struct : RayCounts {
+		RayStats lastPass{};
+		uint32_t passes = 0;
+	} rayStats;
+	struct {
+		uint32_t tilesX = 0;
+		uint32_t tilesY = 0;
+		// Tiles traced by the next adaptive pass
+		std::vector<uint32_t> activeTiles;
+		// Fixed point relative error sums of each tile from the last pass that traced it
+		std::vector<uint32_t> tileErrorSums;
+		uint64_t tracedPixelSamples = 0;
+		uint64_t uniformPixelSamples = 0;
+		bool converged = false;
+	} adaptive;
+
+	struct {
+		// Persistent readback of the storage image, sized for the current window
+		vks::Buffer readback;
+		VkCommandBuffer copyCmd = VK_NULL_HANDLE;
+		VkFence fence = VK_NULL_HANDLE;
+		VkExtent2D extent{};
+		std::string filename;
+		bool requested = false;
+		bool submitted = false;
+		// The worker reads the mapped readback, no new copy is submitted until it is done
+		std::atomic<bool> encoding = false;
+		std::thread worker;
+	} capture;
+
+	// Pipeline of the current scene, one of pipelineVariants
 	VkPipeline pipeline;
+	// Pipelines by integrator and PipelineVariant::features, created on first use
+	std::map<std::pair<std::string, uint32_t>, VkPipeline> pipelineVariants;
 	VkPipelineLayout pipelineLayout;
 	VkDescriptorSet descriptorSet;
 	VkDescriptorSetLayout descriptorSetLayout;
@@ -278,6 +511,55 @@ private:
 		bool validation = false;
 		/** @brief Set to true if v-sync will be forced for the swapchain */
 		bool vsync = false;
+		/** @brief Accumulates passes while the camera stands still, adaptive mode stops tracing converged tiles */
+		AccumulationMode accumulation = ACCUMULATION_OFF;
+		/** @brief Time budget, target error, spp limit and warmup of headless rendering, the warmup and target error also drive adaptive sampling */
+		StopCriteria stop;
+		/** @brief Renders offscreen without a window or swap chain */
+		bool headless = false;
+		/** @brief Renders headless in tiles of this size, so memory use depends on the tile size instead of the frame (0 = off) */
+		uint32_t tileSize = 0;
+		/** @brief EXR output uses 16-bit half floats instead of 32-bit floats */
+		bool halfFloat = false;
+		/** @brief PNG output is sRGB encoded instead of the linear edx rounding */
+		bool srgb = false;
+		/** @brief Renders every frame of this camera path file headless instead of a single image */
+		std::string cameraPath;
+		/** @brief Renders jobs read from stdin in one process instead of a single scene */
+		bool server = false;
+		/** @brief Triangles outside objects get a BLAS per transform group instead of one for all */
+		bool splitMeshes = true;
+		/** @brief Pipeline cache file loaded at startup and written on shutdown */
+		std::string pipelineCacheFile = "pipeline_cache.bin";
+		/** @brief Dynamic BLAS are rebuilt once their vertices moved this far on average since the last build, as a fraction
+			of the mesh's bounds diagonal. Refits keep the build's tree, the further primitives leave their place in it the looser its bounds */
+		float refitDrift = 0.02f;
+		/** @brief Dynamic BLAS are rebuilt from scratch after this many refits regardless of the drift */
+		uint32_t refitLimit = 32;
+		/** @brief Benchmarks this many animation updates with refits against full rebuilds after startup (0 = off) */
+		uint32_t updateBenchmarkFrames = 0;
+		/** @brief CSV file receiving the GPU time of every trace, copy, acceleration structure build and upload (empty = off) */
+		std::string gpuTimingsFile;
+		/** @brief Renders the scene corpus and writes timings to this JSON file instead of rendering one scene (empty = off) */
+		std::string benchmarkFile;
+		/** @brief Directory holding the benchmark scenes */
+		std::string benchmarkDir = "data";
+		/** @brief Renders of every benchmark scene, their spread is reported next to the mean */
+		uint32_t benchmarkRuns = 3;
+		/** @brief Renders the scenes of this directory and compares them with their PNG reference images (empty = off) */
+		std::string regressionDir;
+		/** @brief Headless renders are compared with this PNG after saving (empty = off) */
+		std::string referenceImage;
+		/** @brief Channel difference in 1/255 steps a pixel may have against the reference */
+		uint32_t regressionTolerance = 8;
+		/** @brief Fraction of pixels allowed over the tolerance before a comparison fails */
+		double regressionMaxBadPixels = 0.001;
+		/** @brief Counts primary, secondary and shadow rays, hits and misses of every pass */
+		bool rayStats = false;
+		/** @brief Headless renders also write the rays traced per pixel to this image (empty = off) */
+		std::string heatmapFile;
+		/** @brief Every memory allocation name is listed after a scene is loaded, not only the totals */
+		bool memoryReport = false;
 	} settings;
 
 	// Defines a frame rate independent timer value clamped from -1.0...1.0
@@ -293,9 +575,9 @@ private:
 	std::string applicationName = "Vulkan Raytracer";
 
 	struct {
-		VkImage image;
-		VkDeviceMemory mem;
-		VkImageView view;
+		VkImage image = VK_NULL_HANDLE;
+		VkDeviceMemory mem = VK_NULL_HANDLE;
+		VkImageView view = VK_NULL_HANDLE;
 	} depthStencil;
 
 	struct {
@@ -304,7 +586,7 @@ private:
 		bool middle = false;
 	} mouseButtons;
 
-	GLFWwindow* window;
+	GLFWwindow* window = nullptr;
 
 	std::map<std::string, uint32_t> descriptorSetBindings = {
 		{ "accelerationStructure", 0 },
@@ -317,7 +599,14 @@ private:
 		{ "directLightsBuffer", 7 },
 		{ "triangleMaterialsBuffer", 8 },
 		{ "sphereMaterialsBuffer", 9 },
-		{ "quadLightsBuffer", 10 }
+		{ "quadLightsBuffer", 10 },
+		{ "lightAliasTableBuffer", 11 },
+		{ "blueNoiseBuffer", 12 },
+		{ "pixelStatsBuffer", 13 },
+		{ "tileStatsBuffer", 14 },
+		{ "activeTilesBuffer", 15 },
+		{ "meshInstancesBuffer", 16 },
+		{ "rayStatsBuffer", 17 }
 	};
 
 	VulkanDebug vkDebug;
@@ -0,0 +1,39 @@
+#include <algorithm>
+#include <WorkerPool.h>
+
+
+WorkerPool::WorkerPool(const std::vector<CpuTopology::Worker>& workers, bool pinThreads)
+  : workers(workers), pinThreads(pinThreads), stageStart(static_cast<std::ptrdiff_t>(workers.size()) + 1),
+  stageEnd(static_cast<std::ptrdiff_t>(workers.size()) + 1)
+{
+  for (uint32_t worker = 0; worker < workers.size(); ++worker)
+    threads.emplace_back(&WorkerPool::work, this, worker);
+}
+
+WorkerPool::~WorkerPool()
+{
+  stopping = true;
+  stageStart.arrive_and_wait();
+  for (std::thread& thread : threads)
+    thread.join();
+}
+
+void WorkerPool::work(uint32_t worker)
+{
+  if (pinThreads)
+    pinCurrentThread(workers[worker].cpu);
+  for (;;)
+  {
+    stageStart.arrive_and_wait();
+    if (stopping)
+      return;
+    for (;;)
+    {
+      const size_t begin = next.fetch_add(grain, std::memory_order_relaxed);
+      if (begin >= count)
+        break;
+      chunk(body, worker, begin, std::min(begin + grain, count));
+    }
+    stageEnd.arrive_and_wait();
+  }
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <atomic>
+#include <barrier>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <CpuTopology.h>
+
+
+// One thread per worker for the lifetime of the pool, pinned to the worker's processor like the threads of the
+// TileScheduler. Each run() is a stage: the threads meet at a barrier to start it, take chunks of it until none are
+// left and meet at a second barrier, so the stages of a wavefront run back to back on the same pinned threads
+class WorkerPool
+{
+public:
+  WorkerPool(const std::vector<CpuTopology::Worker>& workers, bool pinThreads);
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+  ~WorkerPool();
+
+  // Calls body(begin, end) for [0, count) in chunks of grain and returns when all of them are done.
+  // The calling thread only waits, it isn't one of the workers. A body(worker, begin, end) also gets the index of the
+  // worker running the chunk, e.g. to pick the geometry of its NUMA node
+  template <typename Body>
+  void run(size_t count, size_t grain, const Body& body);
+
+private:
+  void work(uint32_t worker);
+
+  std::vector<CpuTopology::Worker> workers;
+  bool pinThreads;
+  // Every worker and the calling thread of run()
+  std::barrier<> stageStart;
+  std::barrier<> stageEnd;
+
+  // The current stage, written before stageStart
+  void (*chunk)(const void* body, uint32_t worker, size_t begin, size_t end) = nullptr;
+  const void* body = nullptr;
+  size_t count = 0;
+  size_t grain = 1;
+  std::atomic<size_t> next = 0;
+  bool stopping = false;
+
+  std::vector<std::thread> threads;
+};
+
+template <typename Body>
+void WorkerPool::run(size_t count, size_t grain, const Body& body)
+{
+  if (count == 0)
+    return;
+  chunk = [](const void* body, uint32_t worker, size_t begin, size_t end)
+    {
+      if constexpr (std::is_invocable_v<const Body&, uint32_t, size_t, size_t>)
+        (*static_cast<const Body*>(body))(worker, begin, end);
+      else
+        (*static_cast<const Body*>(body))(begin, end);
+    };
+  this->body = &body;
+  this->count = count;
+  this->grain = grain;
+  next.store(0, std::memory_order_relaxed);
+  stageStart.arrive_and_wait();
+  stageEnd.arrive_and_wait();
+}
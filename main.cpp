@@ -1,18 +1,35 @@
+#include "CpuRenderer.h"
 #include "VulkanRaytracer.h"
 
 int main(int argc, char* argv[]) {
+	int result = EXIT_SUCCESS;
 	try {
 		std::vector<std::string> args(argv, argv + argc);
-		auto raytracer = std::make_unique<VulkanRaytracer>(args);
-		raytracer->initAPIs();
-		raytracer->setupWindow();
-		raytracer->prepare();
-		raytracer->renderLoop();
+		// The regression falls back to the CPU renderer on machines without a ray tracing device
+		const bool regression = std::find(args.begin(), args.end(), "-regression") != args.end();
+		if (CpuRenderer::requested(args) || (regression && !VulkanRaytracer::rayTracingDeviceAvailable())) {
+			// Host only reference renderer, no Vulkan instance or window
+			if (!CpuRenderer::run(args)) {
+				result = EXIT_FAILURE;
+			}
+		}
+		else {
+			auto raytracer = std::make_unique<VulkanRaytracer>(args);
+			raytracer->initAPIs();
+			raytracer->setupWindow();
+			raytracer->prepare();
+			raytracer->renderLoop();
+			if (!raytracer->succeeded()) {
+				result = EXIT_FAILURE;
+			}
+		}
 	}
 	catch (const std::exception& e) {
 		std::cerr << e.what() << std::endl;
-		return EXIT_FAILURE;
+		result = EXIT_FAILURE;
 	}
 
-	return EXIT_SUCCESS;
+	// After the renderer is gone, so shutdown and the pipeline cache write are in the trace
+	PROFILE_WRITE("trace.json");
+	return result;
 }
@@ -30,6 +30,15 @@ struct DirectionLight
 	vec4 color;
 };
 
+// Instance data of the triangle hit groups, indexed by gl_InstanceCustomIndexEXT. Must match MeshInstance in Primitives.h
+struct MeshInstance
+{
+	uint firstTriangle;
+	uint materialOffset;
+	uint materialStride;  // 0 when the whole instance shares one material
+	uint padding;
+};
+
 struct Material
 {
 	vec4 ambient;
@@ -48,17 +57,101 @@ struct QuadLight
 	vec4 color;
 };
 
+struct LightAliasEntry
+{
+	float probability;
+	uint alias;
+	float pdf;
+};
+
+#include "sampling.glsl"
+#include "rayoffset.glsl"
+
 const float PI = 3.1415926535897932384626433832795;
 const float EPS = 0.001;
 
+// Scene features baked into the pipeline variant (see VulkanRaytracer::PipelineVariant), so lights and
+// sampler branches the scene doesn't use are compiled out. Constant 0 is MAX_RECURSION in raygen.rgen
+layout(constant_id = 1) const bool HAS_DIRECT_LIGHTS = true;
+layout(constant_id = 2) const bool HAS_POINT_LIGHTS = true;
+layout(constant_id = 3) const bool HAS_QUAD_LIGHTS = true;
+layout(constant_id = 4) const uint SAMPLER_TYPE = SAMPLER_PCG;
+layout(constant_id = 5) const bool LIGHT_STRATIFY = false;
+// Ray counting for -ray-stats, off in normal pipelines so the counters cost nothing
+layout(constant_id = 6) const bool RAY_STATS = false;
+
 struct RayPayload
 {
 	vec3 color;
 	vec3 intersectionPoint;
 	vec3 normal;
 	vec3 specular;
+	uint depth;  // bounce index, selects the sample dimensions used by the hit shader
+	uvec2 pixel;
+	// Shadow rays traced by the hit shaders for the pixel, only counted with RAY_STATS
+	uint shadowRays;
+	uint occludedShadowRays;
+};
+
+// Counters of the traced rays, summed by the raygen shader over a pass and cleared by the host.
+// Must match RayStats in VulkanRaytracer.h
+struct RayStats
+{
+	uint primaryRays;
+	uint secondaryRays;
+	uint shadowRays;
+	uint occludedShadowRays;
+	uint hits;
+	uint misses;
+};
+
+void countShadowRay(inout RayPayload payload, bool occluded)
+{
+	if (RAY_STATS)
+	{
+		payload.shadowRays += 1;
+		payload.occludedShadowRays += occluded ? 1 : 0;
+	}
+}
+
+const uint ACCUMULATION_OFF = 0u;
+const uint ACCUMULATION_ON = 1u;
+const uint ACCUMULATION_ADAPTIVE = 2u;
+
+// Adaptive sampling traces the image in square tiles, must match VulkanRaytracer::adaptiveTileSize
+const uint ADAPTIVE_TILE_SIZE = 16u;
+
+// Running estimate of a pixel over the accumulated passes (Welford):
+// mean color, sum of squared luminance deviations and relative error of the mean
+struct PixelStats
+{
+	vec3 mean;
+	float m2;
+	uint count;
+	float relError;
+};
+
+// Counters filled by every pass, read back and cleared by the host. The relative errors of the
+// tile's pixels are summed in fixed point, clamped to 1 per pixel
+struct TileStats
+{
+	uint unconvergedPixels;
+	uint tracedPixels;
+	uint relErrorSum;
 };
 
+const float TILE_ERROR_SCALE = 65536.0f;
+
+uint quantizeRelError(float relError)
+{
+	return uint(min(relError, 1.0f) * TILE_ERROR_SCALE);
+}
+
+float luminance(vec3 c)
+{
+	return dot(c, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
 vec4 computeLight(vec3 direction, vec4 lightcolor, vec3 normal,
 	vec3 halfvec, vec4 diffuse, vec4 specular, float shininess)
 {
@@ -71,15 +164,6 @@ vec4 computeLight(vec3 direction, vec4 lightcolor, vec3 normal,
 	return lightcolor * (lambert + phong);
 }
 
-vec3 compensateFloatRoundingError(vec3 origin, vec3 direction, vec3 normal) {
-	if (dot(direction, normal) < 0.0f)
-		origin -= 1e-4f * normal;
-	else
-		origin += 1e-4f * normal;
-
-	return origin;
-}
-
 // float PHI = 1.61803398874989484820459;  // Golden Ratio
 // float gold_noise(in vec2 xy, in float seed)
 // {
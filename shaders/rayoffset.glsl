@@ -0,0 +1,31 @@
+// Origin offset for rays leaving a surface, shared by the shaders and the host code (see Intersection.h).
+// Waechter and Binder, "A Fast and Robust Method for Avoiding Self-Intersection" (Ray Tracing Gems, chapter 6):
+// the point moves along the geometric normal by a number of float ulps, so the offset grows with the magnitude
+// of the position instead of being a fixed distance like EPS. Close to the world origin, where ulps get tiny,
+// a small constant offset is used instead. Rays offset this way can start at tmin 0.
+// Keep this file in the common subset of GLSL and C++, see sampling.glsl
+#ifndef RAYOFFSET_GLSL
+#define RAYOFFSET_GLSL
+
+#ifndef SHARED_FUNC
+#define SHARED_FUNC
+#endif
+
+const float RAY_OFFSET_ORIGIN = 1.0f / 32.0f;
+const float RAY_OFFSET_FLOAT_SCALE = 1.0f / 65536.0f;
+const float RAY_OFFSET_INT_SCALE = 256.0f;
+
+SHARED_FUNC float offsetRayComponent(float p, float n)
+{
+	int ulps = int(RAY_OFFSET_INT_SCALE * n);
+	float offset = intBitsToFloat(floatBitsToInt(p) + (p < 0.0f ? -ulps : ulps));
+	return abs(p) < RAY_OFFSET_ORIGIN ? p + RAY_OFFSET_FLOAT_SCALE * n : offset;
+}
+
+// n is the geometric normal on the side the ray leaves to
+SHARED_FUNC vec3 offsetRayOrigin(vec3 p, vec3 n)
+{
+	return vec3(offsetRayComponent(p.x, n.x), offsetRayComponent(p.y, n.y), offsetRayComponent(p.z, n.z));
+}
+
+#endif // RAYOFFSET_GLSL
@@ -0,0 +1,155 @@
+// Sample generators shared by the shaders and the host code (see Sampling.h).
+// Keep this file in the common subset of GLSL and C++: no inout parameters, no vector swizzles,
+// functions are declared with SHARED_FUNC so the C++ side can make them inline.
+#ifndef SAMPLING_GLSL
+#define SAMPLING_GLSL
+
+#ifndef SHARED_FUNC
+#define SHARED_FUNC
+#endif
+
+const uint SAMPLER_PCG = 0u;
+const uint SAMPLER_SOBOL = 1u;
+const uint SAMPLER_BLUE_NOISE = 2u;
+
+// Sample dimensions reserved for a single bounce: light selection + 2D position on the light, padded to
+// the four dimensions of a sampleSobol group so a bounce never straddles two groups
+const uint DIMENSIONS_PER_BOUNCE = 4u;
+
+const uint BLUE_NOISE_SIZE = 64u;
+
+// Direction numbers of the first four Sobol dimensions (Joe & Kuo), 32 bits each
+const uint SOBOL_DIRECTIONS[4 * 32] = {
+	0x80000000u, 0x40000000u, 0x20000000u, 0x10000000u, 0x08000000u, 0x04000000u, 0x02000000u, 0x01000000u,
+	0x00800000u, 0x00400000u, 0x00200000u, 0x00100000u, 0x00080000u, 0x00040000u, 0x00020000u, 0x00010000u,
+	0x00008000u, 0x00004000u, 0x00002000u, 0x00001000u, 0x00000800u, 0x00000400u, 0x00000200u, 0x00000100u,
+	0x00000080u, 0x00000040u, 0x00000020u, 0x00000010u, 0x00000008u, 0x00000004u, 0x00000002u, 0x00000001u,
+
+	0x80000000u, 0xc0000000u, 0xa0000000u, 0xf0000000u, 0x88000000u, 0xcc000000u, 0xaa000000u, 0xff000000u,
+	0x80800000u, 0xc0c00000u, 0xa0a00000u, 0xf0f00000u, 0x88880000u, 0xcccc0000u, 0xaaaa0000u, 0xffff0000u,
+	0x80008000u, 0xc000c000u, 0xa000a000u, 0xf000f000u, 0x88008800u, 0xcc00cc00u, 0xaa00aa00u, 0xff00ff00u,
+	0x80808080u, 0xc0c0c0c0u, 0xa0a0a0a0u, 0xf0f0f0f0u, 0x88888888u, 0xccccccccu, 0xaaaaaaaau, 0xffffffffu,
+
+	0x80000000u, 0xc0000000u, 0x60000000u, 0x90000000u, 0xe8000000u, 0x5c000000u, 0x8e000000u, 0xc5000000u,
+	0x68800000u, 0x9cc00000u, 0xee600000u, 0x55900000u, 0x80680000u, 0xc09c0000u, 0x60ee0000u, 0x90550000u,
+	0xe8808000u, 0x5cc0c000u, 0x8e606000u, 0xc5909000u, 0x6868e800u, 0x9c9c5c00u, 0xeeee8e00u, 0x5555c500u,
+	0x8000e880u, 0xc0005cc0u, 0x60008e60u, 0x9000c590u, 0xe8006868u, 0x5c009c9cu, 0x8e00eeeeu, 0xc5005555u,
+
+	0x80000000u, 0xc0000000u, 0x20000000u, 0x50000000u, 0xf8000000u, 0x74000000u, 0xa2000000u, 0x93000000u,
+	0xd8800000u, 0x25400000u, 0x59e00000u, 0xe6d00000u, 0x78080000u, 0xb40c0000u, 0x82020000u, 0xc3050000u,
+	0x208f8000u, 0x51474000u, 0xfbea2000u, 0x75d93000u, 0xa0858800u, 0x914e5400u, 0xdbe79e00u, 0x25db6d00u,
+	0x58800080u, 0xe54000c0u, 0x79e00020u, 0xb6d00050u, 0x800800f8u, 0xc00c0074u, 0x200200a2u, 0x50050093u
+};
+
+SHARED_FUNC uint hashUint(uint x)
+{
+	// lowbias32 by Chris Wellons
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+SHARED_FUNC uint hashCombine(uint seed, uint v)
+{
+	return seed ^ (hashUint(v) + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+SHARED_FUNC uint pixelSeed(uint x, uint y)
+{
+	return hashCombine(hashUint(x), y);
+}
+
+// Converts the upper 24 bits to a float in [0, 1)
+SHARED_FUNC float uintToUnitFloat(uint x)
+{
+	return float(x >> 8) * (1.0f / 16777216.0f);
+}
+
+SHARED_FUNC uint sobol(uint index, uint dimension)
+{
+	uint result = 0u;
+	for (uint bit = 0u; index != 0u; ++bit, index >>= 1)
+	{
+		if ((index & 1u) != 0u)
+			result ^= SOBOL_DIRECTIONS[dimension * 32u + bit];
+	}
+	return result;
+}
+
+// Owen scrambling as a hash of the bit-reversed value (Burley 2020, "Practical Hash-based Owen Scrambling")
+SHARED_FUNC uint laineKarrasPermutation(uint x, uint seed)
+{
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+SHARED_FUNC uint nestedUniformScramble(uint x, uint seed)
+{
+	x = bitfieldReverse(x);
+	x = laineKarrasPermutation(x, seed);
+	return bitfieldReverse(x);
+}
+
+// Owen-scrambled Sobol sample. Dimensions are taken four at a time from the 4D Sobol set, every
+// group of four gets its own index shuffle so higher dimensions stay decorrelated (padding)
+SHARED_FUNC float sampleSobol(uint seed, uint sampleIndex, uint dimension)
+{
+	uint groupSeed = hashCombine(seed, dimension / 4u);
+	uint component = dimension % 4u;
+	uint index = nestedUniformScramble(sampleIndex, groupSeed);
+	uint x = nestedUniformScramble(sobol(index, component), hashCombine(groupSeed, component + 1u));
+	return uintToUnitFloat(x);
+}
+
+// Each dimension reads the blue noise tile at a different toroidal offset so the dimensions don't
+// share the same pattern
+SHARED_FUNC uint blueNoiseIndex(uint x, uint y, uint dimension)
+{
+	uint h = hashUint(dimension + 1u);
+	uint tx = (x + (h & 0xffffu)) % BLUE_NOISE_SIZE;
+	uint ty = (y + (h >> 16)) % BLUE_NOISE_SIZE;
+	return ty * BLUE_NOISE_SIZE + tx;
+}
+
+// Blue-noise dithered sampling: every pixel uses the same scrambled Sobol set, toroidally shifted by
+// the blue noise value of its pixel, so the remaining error is distributed as blue noise on screen
+SHARED_FUNC float sampleBlueNoise(float blueNoiseValue, uint sampleIndex, uint dimension)
+{
+	float u = sampleSobol(0u, sampleIndex, dimension) + blueNoiseValue;
+	return u >= 1.0f ? u - 1.0f : u;
+}
+
+#endif // SAMPLING_GLSL
+
+#if defined(SAMPLING_GET_SAMPLE) && !defined(SAMPLING_GET_SAMPLE_GLSL)
+#define SAMPLING_GET_SAMPLE_GLSL
+
+// Returns one coordinate of the light sample s of the current pass. Dimensions are offset by the
+// bounce so every bounce draws from its own dimensions of the sequence, accumulated passes continue
+// the sequence where the previous pass stopped.
+// GLSL only: it reads ubo, rayPayload, blueNoise and rngState of the hit shader, which includes this
+// file a second time with SAMPLING_GET_SAMPLE defined once those are declared
+float getSample(uint s, uint dimension)
+{
+	uint sampleIndex = ubo.frameIndex * ubo.lightsamples + s;
+	dimension += rayPayload.depth * DIMENSIONS_PER_BOUNCE;
+	if (SAMPLER_TYPE == SAMPLER_SOBOL)
+	{
+		return sampleSobol(pixelSeed(rayPayload.pixel.x, rayPayload.pixel.y), sampleIndex, dimension);
+	}
+	if (SAMPLER_TYPE == SAMPLER_BLUE_NOISE)
+	{
+		float mask = blueNoise.v[blueNoiseIndex(rayPayload.pixel.x, rayPayload.pixel.y, dimension)];
+		return sampleBlueNoise(mask, sampleIndex, dimension);
+	}
+	return stepAndOutputRNGFloat(rngState);
+}
+
+#endif // SAMPLING_GET_SAMPLE